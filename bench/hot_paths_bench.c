@@ -0,0 +1,546 @@
+#include "pg_monitor.h"
+#include "response_cache.h"
+#include "utils.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+    #include <libpq-fe.h>
+#else
+    #include <postgresql/libpq-fe.h>
+#endif
+
+/**
+ * Microbenchmark suite of the in-memory hot paths.
+ *
+ * Covers the host search and selection, the role conditions evaluated
+ * when a topology snapshot is built, the json rendering of the bodies
+ * and the lsn parsing. Every benchmark runs over clusters of 1, 10, 100
+ * and 1000 hosts with several mixes of live, dead and lagging replicas.
+ *
+ * A benchmark is calibrated to run for at least min_time_ms, then repeated
+ * the given number of times. Prints csv with the median and the minimal
+ * time of one operation, so the results of two commits can be compared
+ * with any tool:
+ *     benchmark,hosts,mix,threads,iterations,median_ns,min_ns
+ * The operation timed by each benchmark is described above its function.
+ *
+ * Usage: hot_paths_bench [min_time_ms] [repeats] [max_threads]
+ */
+
+/**
+ * Numbers of hosts of the benchmark clusters
+ */
+const unsigned int bench_sizes[] = {1, 10, 100, 1000};
+
+# define BENCH_SIZES_CNT (sizeof(bench_sizes) / sizeof(bench_sizes[0]))
+
+/**
+ * Mix of the statuses of the hosts of a benchmark cluster.
+ * The first host is the master unless there is none.
+ */
+typedef enum BenchMix {
+    // All replicas are alive and in sync
+    MIX_HEALTHY,
+
+    // Every third replica is dead, the others lag behind in turn by time,
+    // by bytes, by both or not at all
+    MIX_DEGRADED,
+
+    // The master is dead, every other replica is dead
+    MIX_NO_MASTER,
+    MIX_CNT,
+} BenchMix;
+
+const char *const bench_mix_names[MIX_CNT] = {
+    [MIX_HEALTHY] = "healthy",
+    [MIX_DEGRADED] = "degraded",
+    [MIX_NO_MASTER] = "no_master",
+};
+
+const char *const bench_role_names[HOST_ROLES_CNT] = {
+    [ROLE_MASTER] = "master",
+    [ROLE_REPLICA] = "replica",
+    [ROLE_SYNC_BY_TIME] = "sync_by_time",
+    [ROLE_SYNC_BY_BYTES] = "sync_by_bytes",
+    [ROLE_SYNC_BY_TIME_OR_BYTES] = "sync_by_time_or_bytes",
+    [ROLE_SYNC_BY_TIME_AND_BYTES] = "sync_by_time_and_bytes",
+};
+
+const condition_handler bench_conditions[HOST_ROLES_CNT] = {
+    [ROLE_MASTER] = is_master,
+    [ROLE_REPLICA] = is_alive_replica,
+    [ROLE_SYNC_BY_TIME] = is_sync_replica_by_time,
+    [ROLE_SYNC_BY_BYTES] = is_sync_replica_by_bytes,
+    [ROLE_SYNC_BY_TIME_OR_BYTES] = is_sync_replica_by_time_or_bytes,
+    [ROLE_SYNC_BY_TIME_AND_BYTES] = is_sync_replica_by_time_and_bytes,
+};
+
+/**
+ * What a benchmark operates on
+ */
+typedef struct BenchInput {
+    MonitorCluster *cluster;
+    Topology *topology;
+    HostRole role;
+    PGresult *lsn_result;
+} BenchInput;
+
+/**
+ * Runs the operation iterations times.
+ * Returns a value depending on the results, so they are not optimized out.
+ */
+typedef unsigned long long (*bench_fn)(
+    const BenchInput *input, unsigned long long iterations
+);
+
+/**
+ * Keeps the results of the operations
+ */
+volatile unsigned long long bench_sink = 0;
+
+
+/**
+ * Publishes a topology of the cluster with the statuses of the mix
+ */
+void publish_bench_topology(MonitorCluster *cluster, const BenchMix mix) {
+    Topology *topology = take_topology_buffer(cluster);
+    const MonitorParameters *params = topology -> parameters;
+    const unsigned long long over_ms = params -> sync_max_lag_ms * 2;
+    const unsigned long long over_bytes = params -> sync_max_lag_bytes * 2;
+
+    topology -> generation = get_topology(cluster) -> generation + 1;
+    for (unsigned int i = 0; i < topology -> hosts_cnt; i++) {
+        MonitorStatus *status = &topology -> hosts[i];
+        status -> is_master = i == 0;
+        status -> alive = true;
+        status -> delay_ms = 0;
+        status -> delay_bytes = 0;
+
+        if (mix == MIX_DEGRADED && i > 0) {
+            status -> alive = i % 3 != 0;
+            status -> delay_ms = i % 4 == 1 || i % 4 == 3 ? over_ms : 0;
+            status -> delay_bytes = i % 4 == 2 || i % 4 == 3 ? over_bytes : 0;
+        }
+        if (mix == MIX_NO_MASTER) {
+            status -> alive = i % 2 == 1;
+        }
+    }
+
+    index_topology_roles(topology);
+    topology -> master = (
+        topology -> roles[ROLE_MASTER].cnt ?
+            topology -> roles[ROLE_MASTER].hosts[0] : TOPOLOGY_NO_HOST
+    );
+    publish_topology(cluster, topology);
+}
+
+/**
+ * Initializes a cluster for each of bench_sizes without connecting
+ * to their hosts
+ */
+void init_bench_clusters(void) {
+    char *names = nullptr;
+    for (unsigned int i = 0; i < BENCH_SIZES_CNT; i++) {
+        char *name = format_string("hosts_%u", bench_sizes[i]);
+        char *joined = names ?
+            format_string("%s,%s", names, name) : format_string("%s", name);
+        free(names);
+        names = joined;
+
+        char *hosts = format_string("pg-0");
+        for (unsigned int j = 1; j < bench_sizes[i]; j++) {
+            char *more = format_string("%s,pg-%u", hosts, j);
+            free(hosts);
+            hosts = more;
+        }
+
+        char *variable = format_string("pg_status__%s__hosts", name);
+        setenv(variable, hosts, 1);
+        free(variable);
+        free(hosts);
+        free(name);
+    }
+
+    setenv("pg_status__clusters", names, 1);
+    free(names);
+    init_clusters();
+}
+
+/**
+ * Creates a query result with the lsn 16/B374D848 in the binary format,
+ * as the status query returns it
+ */
+PGresult *make_lsn_result(void) {
+    PGresult *result = PQmakeEmptyPGresult(nullptr, PGRES_TUPLES_OK);
+    PGresAttDesc column = {
+        .name = "lsn", .typid = 3220, .typlen = 8, .format = 1,
+    };
+    const unsigned char lsn[8] = {0, 0, 0, 0x16, 0xB3, 0x74, 0xD8, 0x48};
+
+    if (
+        !result ||
+        !PQsetResultAttrs(result, 1, &column) ||
+        !PQsetvalue(result, 0, 0, (char *) lsn, sizeof(lsn))
+    ) {
+        raise_error("Can't make a query result");
+    }
+    return result;
+}
+
+
+/**
+ * find_host of the role, one search
+ */
+unsigned long long bench_find_host(
+    const BenchInput *input, const unsigned long long iterations
+) {
+    unsigned long long sum = 0;
+    for (unsigned long long i = 0; i < iterations; i++) {
+        sum += (uintptr_t) find_host(input -> cluster, input -> role, true);
+    }
+    return sum;
+}
+
+/**
+ * The condition of the role, evaluated for every host of the snapshot
+ */
+unsigned long long bench_condition(
+    const BenchInput *input, const unsigned long long iterations
+) {
+    const condition_handler condition = bench_conditions[input -> role];
+    const Topology *topology = input -> topology;
+    unsigned long long sum = 0;
+    for (unsigned long long i = 0; i < iterations; i++) {
+        for (unsigned int j = 0; j < topology -> hosts_cnt; j++) {
+            sum += condition(topology, &topology -> hosts[j]);
+        }
+    }
+    return sum;
+}
+
+/**
+ * index_topology_roles: all conditions for all hosts of the snapshot
+ */
+unsigned long long bench_index_roles(
+    const BenchInput *input, const unsigned long long iterations
+) {
+    unsigned long long sum = 0;
+    for (unsigned long long i = 0; i < iterations; i++) {
+        index_topology_roles(input -> topology);
+        sum += input -> topology -> roles[ROLE_REPLICA].cnt;
+    }
+    return sum;
+}
+
+/**
+ * round_robin_replica, one selection
+ */
+unsigned long long bench_round_robin(
+    const BenchInput *input, const unsigned long long iterations
+) {
+    unsigned long long sum = 0;
+    for (unsigned long long i = 0; i < iterations; i++) {
+        sum += (uintptr_t) round_robin_replica(input -> cluster);
+    }
+    return sum;
+}
+
+/**
+ * The json body with the found host, one body
+ */
+unsigned long long bench_host_json(
+    const BenchInput *input, const unsigned long long iterations
+) {
+    unsigned long long sum = 0;
+    for (unsigned long long i = 0; i < iterations; i++) {
+        char *body = render_host(
+            find_host(input -> cluster, ROLE_REPLICA, true), RESPONSE_JSON
+        );
+        sum += strlen(body);
+        free(body);
+    }
+    return sum;
+}
+
+/**
+ * The json array of the live replicas of the snapshot, one body
+ */
+unsigned long long bench_replicas_json(
+    const BenchInput *input, const unsigned long long iterations
+) {
+    unsigned long long sum = 0;
+    for (unsigned long long i = 0; i < iterations; i++) {
+        char *body = render_replicas_body(input -> topology);
+        sum += strlen(body);
+        free(body);
+    }
+    return sum;
+}
+
+/**
+ * The json state of the snapshot with the hosts of all roles, one body
+ */
+unsigned long long bench_state_json(
+    const BenchInput *input, const unsigned long long iterations
+) {
+    unsigned long long sum = 0;
+    for (unsigned long long i = 0; i < iterations; i++) {
+        char *body = render_state_body(input -> topology);
+        sum += strlen(body);
+        free(body);
+    }
+    return sum;
+}
+
+/**
+ * parse_lsn of a binary query result, one lsn
+ */
+unsigned long long bench_parse_lsn(
+    const BenchInput *input, const unsigned long long iterations
+) {
+    unsigned long long sum = 0;
+    for (unsigned long long i = 0; i < iterations; i++) {
+        sum += parse_lsn(input -> lsn_result, 0);
+    }
+    return sum;
+}
+
+
+/**
+ * State of one thread of a benchmark
+ */
+typedef struct BenchThread {
+    pthread_t tid;
+    bench_fn run;
+    const BenchInput *input;
+    unsigned long long iterations;
+    pthread_barrier_t *barrier;
+} BenchThread;
+
+/**
+ * Runs the benchmark in a thread once all threads have started
+ */
+void *bench_thread(void *arg) {
+    BenchThread *thread = arg;
+    pthread_barrier_wait(thread -> barrier);
+    bench_sink += thread -> run(thread -> input, thread -> iterations);
+    return nullptr;
+}
+
+/**
+ * Runs the benchmark iterations times in each of threads_cnt threads.
+ * Returns the elapsed time in ns.
+ */
+unsigned long long time_bench(
+    const bench_fn run,
+    const BenchInput *input,
+    const unsigned int threads_cnt,
+    const unsigned long long iterations
+) {
+    if (threads_cnt == 1) {
+        const unsigned long long started_ns = monotonic_ns();
+        bench_sink += run(input, iterations);
+        return monotonic_ns() - started_ns;
+    }
+
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, nullptr, threads_cnt + 1);
+    BenchThread *threads = calloc(threads_cnt, sizeof(BenchThread));
+    if (!threads) {
+        raise_error("Can't allocate memory for threads");
+    }
+
+    for (unsigned int i = 0; i < threads_cnt; i++) {
+        threads[i].run = run;
+        threads[i].input = input;
+        threads[i].iterations = iterations;
+        threads[i].barrier = &barrier;
+        const int started = pthread_create(
+            &threads[i].tid, nullptr, bench_thread, &threads[i]
+        );
+        if (started != 0) {
+            raise_error("Failed to start a benchmark thread");
+        }
+    }
+
+    pthread_barrier_wait(&barrier);
+    const unsigned long long started_ns = monotonic_ns();
+    for (unsigned int i = 0; i < threads_cnt; i++) {
+        pthread_join(threads[i].tid, nullptr);
+    }
+    const unsigned long long elapsed_ns = monotonic_ns() - started_ns;
+
+    pthread_barrier_destroy(&barrier);
+    free(threads);
+    return elapsed_ns;
+}
+
+/**
+ * qsort comparator of unsigned long long
+ */
+int compare_ull(const void *a, const void *b) {
+    const unsigned long long x = *(const unsigned long long *) a;
+    const unsigned long long y = *(const unsigned long long *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Calibrates the number of iterations to run for at least min_time_ms,
+ * repeats the benchmark and prints the median and the minimal time of
+ * one iteration in each thread
+ */
+void run_bench(
+    const char *name,
+    const bench_fn run,
+    const BenchInput *input,
+    const char *mix,
+    const unsigned int threads_cnt,
+    const unsigned long long min_time_ms,
+    const unsigned int repeats
+) {
+    unsigned long long iterations = 1;
+    while (
+        time_bench(run, input, threads_cnt, iterations) <
+            min_time_ms * 1000000 &&
+        iterations < (1ULL << 40)
+    ) {
+        iterations *= 2;
+    }
+
+    unsigned long long *times = malloc(repeats * sizeof(unsigned long long));
+    if (!times) {
+        raise_error("Can't allocate memory for the times");
+    }
+    for (unsigned int i = 0; i < repeats; i++) {
+        times[i] = time_bench(run, input, threads_cnt, iterations);
+    }
+    qsort(times, repeats, sizeof(unsigned long long), compare_ull);
+
+    printf(
+        "%s,%u,%s,%u,%llu,%.2f,%.2f\n",
+        name,
+        input -> topology ? input -> topology -> hosts_cnt : 0,
+        mix,
+        threads_cnt,
+        iterations,
+        (double) times[repeats / 2] / (double) iterations,
+        (double) times[0] / (double) iterations
+    );
+    fflush(stdout);
+    free(times);
+}
+
+/**
+ * Runs the benchmarks of the cluster with the mix of statuses
+ */
+void run_cluster(
+    MonitorCluster *cluster,
+    const BenchMix mix,
+    const unsigned long long min_time_ms,
+    const unsigned int repeats,
+    const unsigned int max_threads
+) {
+    publish_bench_topology(cluster, mix);
+    BenchInput input = {
+        .cluster = cluster,
+        .topology = (Topology *) get_topology(cluster),
+        .role = ROLE_MASTER,
+        .lsn_result = nullptr,
+    };
+    const char *mix_name = bench_mix_names[mix];
+
+    for (unsigned int role = 0; role < HOST_ROLES_CNT; role++) {
+        input.role = (HostRole) role;
+        char *name = format_string("find_host/%s", bench_role_names[role]);
+        run_bench(
+            name, bench_find_host, &input, mix_name, 1, min_time_ms, repeats
+        );
+        free(name);
+    }
+
+    for (unsigned int role = 0; role < HOST_ROLES_CNT; role++) {
+        input.role = (HostRole) role;
+        char *name = format_string("condition/%s", bench_role_names[role]);
+        run_bench(
+            name, bench_condition, &input, mix_name, 1, min_time_ms, repeats
+        );
+        free(name);
+    }
+
+    run_bench(
+        "index_topology_roles", bench_index_roles, &input, mix_name, 1,
+        min_time_ms, repeats
+    );
+    for (unsigned int threads = 1; threads <= max_threads; threads *= 2) {
+        run_bench(
+            "round_robin_replica", bench_round_robin, &input, mix_name,
+            threads, min_time_ms, repeats
+        );
+    }
+    run_bench(
+        "host_json", bench_host_json, &input, mix_name, 1,
+        min_time_ms, repeats
+    );
+    run_bench(
+        "replicas_json", bench_replicas_json, &input, mix_name, 1,
+        min_time_ms, repeats
+    );
+    run_bench(
+        "state_json", bench_state_json, &input, mix_name, 1,
+        min_time_ms, repeats
+    );
+}
+
+
+int main(const int argc, char **argv) {
+    unsigned long long min_time_ms = 20;
+    unsigned int repeats = 5;
+    unsigned int max_threads = (unsigned int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > 1) {
+        min_time_ms = str_to_ull(argv[1]);
+    }
+    if (argc > 2) {
+        repeats = (unsigned int) str_to_ull(argv[2]);
+    }
+    if (argc > 3) {
+        max_threads = (unsigned int) str_to_ull(argv[3]);
+    }
+    if (repeats == 0) {
+        repeats = 1;
+    }
+    if (max_threads == 0) {
+        max_threads = 1;
+    }
+
+    init_bench_clusters();
+
+    printf("benchmark,hosts,mix,threads,iterations,median_ns,min_ns\n");
+    for (unsigned int i = 0; i < get_clusters_cnt(); i++) {
+        for (unsigned int mix = 0; mix < MIX_CNT; mix++) {
+            run_cluster(
+                get_cluster(i), (BenchMix) mix,
+                min_time_ms, repeats, max_threads
+            );
+        }
+    }
+
+    const BenchInput lsn_input = {
+        .cluster = nullptr,
+        .topology = nullptr,
+        .role = ROLE_MASTER,
+        .lsn_result = make_lsn_result(),
+    };
+    run_bench(
+        "parse_lsn", bench_parse_lsn, &lsn_input, "-", 1,
+        min_time_ms, repeats
+    );
+    PQclear(lsn_input.lsn_result);
+    return 0;
+}
@@ -0,0 +1,395 @@
+#include "http_server.h"
+#include "pg_monitor.h"
+#include "response_cache.h"
+#include "routes.h"
+#include "utils.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * HTTP load benchmark of pg-status.
+ *
+ * Starts the http server with the routes of pg-status on the TCP port
+ * and the unix socket, over a cluster with a fixed topology published
+ * without any PostgreSQL: a master, BENCH_REPLICAS replicas and the sync
+ * replicas. For every endpoint, response format and listener, clients
+ * keep-alive connections send requests one after another for a fixed time.
+ * Prints the requests per second and the latency quantiles.
+ *
+ * The port and the socket are taken from pg_status__http_port and
+ * pg_status__http_socket if they are set.
+ *
+ * Usage: http_bench [duration_ms] [clients] [threads]
+ */
+
+# define BENCH_REPLICAS 3
+# define BENCH_HOSTS_LIST "master,replica-1,replica-2,replica-3"
+# define BENCH_PORT "18000"
+# define BENCH_SOCKET "/tmp/pg-status-bench.sock"
+
+/**
+ * Size of the buffer a client reads a response into
+ */
+# define BENCH_RESPONSE_SIZE (16 * 1024)
+
+const char *const bench_endpoints[] = {
+    "/master",
+    "/replica",
+    "/sync_by_time",
+    "/replicas_info",
+    "/hosts?want=master,replica,sync_by_time",
+};
+
+# define BENCH_ENDPOINTS_CNT \
+    (sizeof(bench_endpoints) / sizeof(bench_endpoints[0]))
+
+/**
+ * Response format requested with Accept, nullptr for the text one
+ */
+typedef struct BenchFormat {
+    const char *name;
+    const char *accept;
+} BenchFormat;
+
+const BenchFormat bench_formats[] = {
+    { "text", nullptr },
+    { "json", "application/json" },
+};
+
+# define BENCH_FORMATS_CNT (sizeof(bench_formats) / sizeof(bench_formats[0]))
+
+/**
+ * Listener the clients connect to
+ */
+typedef enum BenchTransport {
+    BENCH_TCP,
+    BENCH_UNIX,
+} BenchTransport;
+
+/**
+ * State of one client thread
+ */
+typedef struct BenchClient {
+    pthread_t tid;
+    BenchTransport transport;
+    const char *request;
+    size_t request_len;
+
+    // Written only by the client, read after it is joined
+    LatencyHistogram latency;
+} BenchClient;
+
+static _Atomic(bool) bench_started = false;
+static _Atomic(bool) bench_stopped = false;
+
+unsigned int bench_port = 0;
+const char *bench_socket = nullptr;
+
+
+/**
+ * Initializes a cluster without connecting to its hosts, publishes
+ * a topology with a live master and BENCH_REPLICAS live replicas,
+ * some of them sync, and renders its responses
+ */
+void init_bench_cluster(void) {
+    setenv("pg_status__hosts", BENCH_HOSTS_LIST, 1);
+    unsetenv("pg_status__clusters");
+    init_clusters();
+    MonitorCluster *cluster = get_default_cluster();
+
+    Topology *topology = take_topology_buffer(cluster);
+    topology -> generation = 1;
+    topology -> next_check_ms = monotonic_ms() + 3600 * 1000;
+    topology -> master = 0;
+    for (unsigned int i = 0; i < topology -> hosts_cnt; i++) {
+        topology -> hosts[i].alive = true;
+        topology -> hosts[i].is_master = i == 0;
+        topology -> hosts[i].delay_ms = i * 10;
+        topology -> hosts[i].delay_bytes = i * 1024;
+    }
+
+    const HostRole sync_roles[] = {
+        ROLE_SYNC_BY_TIME,
+        ROLE_SYNC_BY_BYTES,
+        ROLE_SYNC_BY_TIME_OR_BYTES,
+        ROLE_SYNC_BY_TIME_AND_BYTES,
+    };
+    topology -> roles[ROLE_MASTER].cnt = 1;
+    topology -> roles[ROLE_MASTER].hosts[0] = 0;
+    topology -> hosts[0].roles = ROLE_BIT(ROLE_MASTER);
+    for (unsigned int i = 1; i <= BENCH_REPLICAS; i++) {
+        TopologyRole *replicas = &topology -> roles[ROLE_REPLICA];
+        replicas -> hosts[replicas -> cnt++] = i;
+        topology -> hosts[i].roles = ROLE_BIT(ROLE_REPLICA);
+
+        // All replicas but the last one are sync
+        if (i == BENCH_REPLICAS) {
+            continue;
+        }
+        for (unsigned int j = 0; j < 4; j++) {
+            TopologyRole *sync = &topology -> roles[sync_roles[j]];
+            sync -> hosts[sync -> cnt++] = i;
+            topology -> hosts[i].roles |= ROLE_BIT(sync_roles[j]);
+        }
+    }
+
+    publish_topology(cluster, topology);
+    render_cluster_responses(cluster, topology);
+}
+
+/**
+ * Connects to the listener of the server
+ */
+int bench_connect(const BenchTransport transport) {
+    int fd;
+    int connected;
+
+    if (transport == BENCH_TCP) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t) bench_port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        const int nodelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        connected = connect(fd, (struct sockaddr *) &addr, sizeof(addr));
+    }
+    else {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, bench_socket, sizeof(addr.sun_path) - 1);
+        connected = connect(fd, (struct sockaddr *) &addr, sizeof(addr));
+    }
+
+    if (fd < 0 || connected != 0) {
+        raise_error("Failed to connect to the http server");
+    }
+    return fd;
+}
+
+/**
+ * Reads a whole response into the buffer and returns its status code
+ */
+unsigned int bench_read_response(const int fd, char *buf, const size_t cap) {
+    size_t len = 0;
+    size_t headers_len = 0;
+    size_t content_len = 0;
+
+    while (headers_len == 0 || len < headers_len + content_len) {
+        if (len == cap - 1) {
+            raise_error("The response is longer than %zu bytes", cap);
+        }
+        const ssize_t received = recv(fd, buf + len, cap - 1 - len, 0);
+        if (received <= 0) {
+            raise_error("The http server closed the connection");
+        }
+        len += (size_t) received;
+        buf[len] = '\0';
+
+        if (headers_len == 0) {
+            const char *end = strstr(buf, "\r\n\r\n");
+            if (!end) {
+                continue;
+            }
+            headers_len = (size_t)(end - buf) + 4;
+
+            const char *length = strcasestr(buf, "\r\nContent-Length:");
+            if (length && length < end) {
+                content_len = strtoull(
+                    length + strlen("\r\nContent-Length:"), nullptr, 10
+                );
+            }
+        }
+    }
+    return (unsigned int) strtoul(buf + strlen("HTTP/1.1 "), nullptr, 10);
+}
+
+/**
+ * Sends requests over one keep-alive connection until the benchmark
+ * is stopped and records the time of each of them
+ */
+void *bench_client(void *arg) {
+    BenchClient *client = arg;
+    char *response = malloc(BENCH_RESPONSE_SIZE);
+    if (!response) {
+        raise_error("Can't allocate memory for a response");
+    }
+    const int fd = bench_connect(client -> transport);
+
+    while (!atomic_load_explicit(&bench_started, memory_order_acquire)) {
+    }
+
+    while (!atomic_load_explicit(&bench_stopped, memory_order_relaxed)) {
+        const unsigned long long started_ns = monotonic_ns();
+        if (
+            send(fd, client -> request, client -> request_len, MSG_NOSIGNAL)
+            != (ssize_t) client -> request_len
+        ) {
+            raise_error("Failed to send a request");
+        }
+
+        const unsigned int status = bench_read_response(
+            fd, response, BENCH_RESPONSE_SIZE
+        );
+        if (status != 200) {
+            raise_error("%s responded %u", client -> request, status);
+        }
+        latency_record(
+            &client -> latency, monotonic_ns() - started_ns, true
+        );
+    }
+
+    close(fd);
+    free(response);
+    return nullptr;
+}
+
+/**
+ * Runs clients_cnt clients requesting the endpoint in the format over
+ * the listener for duration_ms and prints the requests per second
+ * and the latency quantiles
+ */
+void run_bench(
+    const BenchTransport transport,
+    const char *endpoint,
+    const BenchFormat *format,
+    const unsigned int clients_cnt,
+    const unsigned long long duration_ms
+) {
+    char *request = format -> accept ?
+        format_string(
+            "GET %s HTTP/1.1\r\nHost: localhost\r\nAccept: %s\r\n\r\n",
+            endpoint, format -> accept
+        ) :
+        format_string(
+            "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", endpoint
+        );
+
+    BenchClient *clients = cache_aligned_calloc(
+        clients_cnt * sizeof(BenchClient)
+    );
+
+    atomic_store(&bench_started, false);
+    atomic_store(&bench_stopped, false);
+    for (unsigned int i = 0; i < clients_cnt; i++) {
+        clients[i].transport = transport;
+        clients[i].request = request;
+        clients[i].request_len = strlen(request);
+        const int started = pthread_create(
+            &clients[i].tid, nullptr, bench_client, &clients[i]
+        );
+        if (started != 0) {
+            raise_error("Failed to start a benchmark client");
+        }
+    }
+
+    const unsigned long long started_ms = monotonic_ms();
+    atomic_store_explicit(&bench_started, true, memory_order_release);
+    usleep((useconds_t)(duration_ms * 1000));
+    atomic_store_explicit(&bench_stopped, true, memory_order_relaxed);
+
+    LatencySnapshot *latency = calloc(1, sizeof(LatencySnapshot));
+    if (!latency) {
+        raise_error("Can't allocate memory for the latency");
+    }
+    for (unsigned int i = 0; i < clients_cnt; i++) {
+        pthread_join(clients[i].tid, nullptr);
+        latency_snapshot_add(latency, &clients[i].latency);
+    }
+    const unsigned long long elapsed_ms = monotonic_ms() - started_ms;
+
+    printf(
+        "%-5s %-40s %-5s %12.0f %10.1f %10.1f %10.1f\n",
+        transport == BENCH_TCP ? "tcp" : "unix",
+        endpoint,
+        format -> name,
+        (double) latency -> count * 1000 / (double) elapsed_ms,
+        (double) latency_quantile(latency, 0.5) / 1000,
+        (double) latency_quantile(latency, 0.99) / 1000,
+        (double) latency_quantile(latency, 0.999) / 1000
+    );
+
+    free(latency);
+    free(clients);
+    free(request);
+}
+
+/**
+ * Runs every endpoint in every format over the listener
+ */
+void run_transport(
+    const BenchTransport transport,
+    const unsigned int clients_cnt,
+    const unsigned long long duration_ms
+) {
+    for (unsigned int i = 0; i < BENCH_ENDPOINTS_CNT; i++) {
+        for (unsigned int j = 0; j < BENCH_FORMATS_CNT; j++) {
+            run_bench(
+                transport, bench_endpoints[i], &bench_formats[j],
+                clients_cnt, duration_ms
+            );
+        }
+    }
+}
+
+
+int main(const int argc, char **argv) {
+    unsigned long long duration_ms = 1000;
+    unsigned int clients_cnt = 8;
+    unsigned int threads = 1;
+    if (argc > 1) {
+        duration_ms = str_to_ull(argv[1]);
+    }
+    if (argc > 2) {
+        clients_cnt = (unsigned int) str_to_ull(argv[2]);
+    }
+    if (argc > 3) {
+        threads = (unsigned int) str_to_ull(argv[3]);
+    }
+    if (clients_cnt == 0) {
+        clients_cnt = 1;
+    }
+
+    char threads_value[16];
+    snprintf(threads_value, sizeof(threads_value), "%u", threads);
+    setenv("pg_status__http_port", BENCH_PORT, 0);
+    setenv("pg_status__http_socket", BENCH_SOCKET, 0);
+    setenv("pg_status__http_threads", threads_value, 1);
+    bench_port = (unsigned int) str_to_ull(getenv("pg_status__http_port"));
+    bench_socket = getenv("pg_status__http_socket");
+
+    init_bench_cluster();
+    HTTPServer *server = start_http_server(
+        pg_status_routes, pg_status_routes_cnt
+    );
+
+    printf(
+        "%-5s %-40s %-5s %12s %10s %10s %10s\n",
+        "conn", "endpoint", "fmt", "requests/s",
+        "p50 us", "p99 us", "p999 us"
+    );
+    if (bench_port > 0) {
+        run_transport(BENCH_TCP, clients_cnt, duration_ms);
+    }
+    if (bench_socket && bench_socket[0] != '\0') {
+        run_transport(BENCH_UNIX, clients_cnt, duration_ms);
+    }
+
+    stop_http_server(server);
+    return 0;
+}
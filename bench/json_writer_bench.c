@@ -0,0 +1,278 @@
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cjson/cJSON.h>
+
+/**
+ * Microbenchmark of the json rendering of the responses.
+ *
+ * Renders the bodies of the dynamic endpoints with a cJSON tree printed
+ * by cJSON_PrintUnformatted, as pg-status did before, and with JsonWriter
+ * into the heap and into the thread-local pool. Checks that all of them
+ * produce the same json and prints the time per body.
+ *
+ * Usage: json_writer_bench [iterations]
+ */
+
+# define BENCH_KEYS 6
+
+const char *const bench_keys[BENCH_KEYS] = {
+    "master",
+    "replica",
+    "sync_by_time",
+    "sync_by_bytes",
+    "sync_by_time_or_bytes",
+    "sync_by_time_and_bytes",
+};
+
+const char *const bench_hosts[BENCH_KEYS] = {
+    "pg-master.db.internal",
+    "pg-replica-1.db.internal",
+    "pg-replica-2.db.internal",
+    nullptr,
+    "pg-replica-1.db.internal",
+    nullptr,
+};
+
+typedef char *(*render_fn)(bool *heap);
+
+
+/**
+ * {"host": "..."} with a cJSON tree
+ */
+char *render_host_cjson(bool *heap) {
+    cJSON *obj = cJSON_CreateObject();
+    cJSON_AddStringToObject(obj, "host", bench_hosts[0]);
+    char *body = cJSON_PrintUnformatted(obj);
+    cJSON_Delete(obj);
+    *heap = true;
+    return body;
+}
+
+/**
+ * {"host": "..."} with JsonWriter into the heap
+ */
+char *render_host_writer(bool *heap) {
+    JsonWriter writer;
+    json_writer_init(&writer, nullptr, 0);
+    json_begin_object(&writer);
+    json_key(&writer, "host");
+    json_string(&writer, bench_hosts[0]);
+    json_end_object(&writer);
+    *heap = true;
+    return json_writer_finish(&writer);
+}
+
+/**
+ * {"host": "..."} with JsonWriter into the thread-local pool
+ */
+char *render_host_pooled(bool *heap) {
+    JsonWriter writer;
+    json_writer_init_pooled(&writer);
+    json_begin_object(&writer);
+    json_key(&writer, "host");
+    json_string(&writer, bench_hosts[0]);
+    json_end_object(&writer);
+    char *body = json_writer_finish(&writer);
+    *heap = writer.heap;
+    return body;
+}
+
+/**
+ * The /hosts object with a cJSON tree
+ */
+char *render_hosts_cjson(bool *heap) {
+    cJSON *obj = cJSON_CreateObject();
+    for (unsigned int i = 0; i < BENCH_KEYS; i++) {
+        if (bench_hosts[i]) {
+            cJSON_AddStringToObject(obj, bench_keys[i], bench_hosts[i]);
+        }
+        else {
+            cJSON_AddNullToObject(obj, bench_keys[i]);
+        }
+    }
+    char *body = cJSON_PrintUnformatted(obj);
+    cJSON_Delete(obj);
+    *heap = true;
+    return body;
+}
+
+/**
+ * The /hosts object with JsonWriter
+ */
+void write_hosts(JsonWriter *writer) {
+    json_begin_object(writer);
+    for (unsigned int i = 0; i < BENCH_KEYS; i++) {
+        json_key(writer, bench_keys[i]);
+        json_string(writer, bench_hosts[i]);
+    }
+    json_end_object(writer);
+}
+
+char *render_hosts_writer(bool *heap) {
+    JsonWriter writer;
+    json_writer_init(&writer, nullptr, 0);
+    write_hosts(&writer);
+    *heap = true;
+    return json_writer_finish(&writer);
+}
+
+char *render_hosts_pooled(bool *heap) {
+    JsonWriter writer;
+    json_writer_init_pooled(&writer);
+    write_hosts(&writer);
+    char *body = json_writer_finish(&writer);
+    *heap = writer.heap;
+    return body;
+}
+
+/**
+ * The /watch state with a cJSON tree
+ */
+char *render_state_cjson(bool *heap) {
+    cJSON *obj = cJSON_CreateObject();
+    cJSON_AddNumberToObject(obj, "generation", 42);
+    cJSON_AddStringToObject(obj, "master", bench_hosts[0]);
+    for (unsigned int i = 1; i < BENCH_KEYS; i++) {
+        cJSON *arr = cJSON_CreateArray();
+        for (unsigned int j = 1; j < BENCH_KEYS; j++) {
+            if (bench_hosts[j] && j <= i) {
+                cJSON_AddItemToArray(arr, cJSON_CreateString(bench_hosts[j]));
+            }
+        }
+        cJSON_AddItemToObject(obj, bench_keys[i], arr);
+    }
+    char *body = cJSON_PrintUnformatted(obj);
+    cJSON_Delete(obj);
+    *heap = true;
+    return body;
+}
+
+/**
+ * The /watch state with JsonWriter
+ */
+void write_state(JsonWriter *writer) {
+    json_begin_object(writer);
+    json_key(writer, "generation");
+    json_uint(writer, 42);
+    json_key(writer, "master");
+    json_string(writer, bench_hosts[0]);
+    for (unsigned int i = 1; i < BENCH_KEYS; i++) {
+        json_key(writer, bench_keys[i]);
+        json_begin_array(writer);
+        for (unsigned int j = 1; j < BENCH_KEYS; j++) {
+            if (bench_hosts[j] && j <= i) {
+                json_string(writer, bench_hosts[j]);
+            }
+        }
+        json_end_array(writer);
+    }
+    json_end_object(writer);
+}
+
+char *render_state_writer(bool *heap) {
+    JsonWriter writer;
+    json_writer_init(&writer, nullptr, 0);
+    write_state(&writer);
+    *heap = true;
+    return json_writer_finish(&writer);
+}
+
+char *render_state_pooled(bool *heap) {
+    JsonWriter writer;
+    json_writer_init_pooled(&writer);
+    write_state(&writer);
+    char *body = json_writer_finish(&writer);
+    *heap = writer.heap;
+    return body;
+}
+
+/**
+ * Renders the body iterations times and prints the time per body.
+ * Exits if the body differs from the expected one.
+ */
+void run_bench(
+    const char *name,
+    const render_fn render,
+    const char *expected,
+    const unsigned long long iterations
+) {
+    bool heap;
+    char *body = render(&heap);
+    if (strcmp(body, expected) != 0) {
+        raise_error("%s rendered %s instead of %s", name, body, expected);
+    }
+    if (heap) {
+        free(body);
+    }
+
+    unsigned long long checksum = 0;
+    const unsigned long long started_ns = monotonic_ns();
+    for (unsigned long long i = 0; i < iterations; i++) {
+        body = render(&heap);
+        checksum += (unsigned char) body[0];
+        if (heap) {
+            free(body);
+        }
+    }
+    const unsigned long long elapsed_ns = monotonic_ns() - started_ns;
+
+    printf(
+        "%-14s %10.1f %10llu\n",
+        name,
+        (double)elapsed_ns / (double)iterations,
+        checksum / iterations
+    );
+}
+
+/**
+ * Runs the renderers of one body, using the cJSON output as the expected
+ */
+void run_body(
+    const char *body,
+    const render_fn cjson,
+    const render_fn writer,
+    const render_fn pooled,
+    const unsigned long long iterations
+) {
+    bool heap;
+    char *expected = cjson(&heap);
+    printf("%s: %s\n", body, expected);
+
+    run_bench("cjson", cjson, expected, iterations);
+    run_bench("writer heap", writer, expected, iterations);
+    run_bench("writer pooled", pooled, expected, iterations);
+    printf("\n");
+    free(expected);
+}
+
+
+int main(const int argc, char **argv) {
+    unsigned long long iterations = 1000000;
+    if (argc > 1) {
+        iterations = str_to_ull(argv[1]);
+    }
+    if (iterations == 0) {
+        iterations = 1;
+    }
+
+    printf("%-14s %10s %10s\n", "renderer", "ns/body", "check");
+    run_body(
+        "host",
+        render_host_cjson, render_host_writer, render_host_pooled,
+        iterations
+    );
+    run_body(
+        "hosts",
+        render_hosts_cjson, render_hosts_writer, render_hosts_pooled,
+        iterations
+    );
+    run_body(
+        "state",
+        render_state_cjson, render_state_writer, render_state_pooled,
+        iterations
+    );
+    return 0;
+}
@@ -0,0 +1,218 @@
+#include "pg_monitor.h"
+#include "utils.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/**
+ * Microbenchmark of the replica selection under concurrent request threads.
+ *
+ * For every number of threads, each thread selects replicas of the same
+ * cluster for a fixed time. Prints the total throughput and how evenly
+ * the selections are spread over the replicas.
+ *
+ * select_host is compared with a single cursor shared by all threads,
+ * which round_robin_replica used before.
+ *
+ * Usage: select_host_bench [duration_ms] [max_threads]
+ */
+
+# define BENCH_REPLICAS 3
+# define BENCH_HOSTS (BENCH_REPLICAS + 1)
+# define BENCH_HOSTS_LIST "master,replica-1,replica-2,replica-3"
+
+typedef char *(*select_fn)(MonitorCluster *cluster);
+
+/**
+ * State of one benchmark thread
+ */
+typedef struct BenchThread {
+    pthread_t tid;
+    select_fn select;
+    unsigned long long ops;
+    unsigned long long hits[BENCH_HOSTS];
+} BenchThread;
+
+static _Atomic(bool) bench_started = false;
+static _Atomic(bool) bench_stopped = false;
+
+/**
+ * Cursor shared by all threads, as in the former round_robin_replica
+ */
+_Atomic(unsigned int) shared_cursor = 0;
+
+MonitorCluster *bench_cluster = nullptr;
+
+
+/**
+ * The former round_robin_replica: one cursor for all threads,
+ * advanced with a separate load and store
+ */
+char *shared_cursor_replica(MonitorCluster *cluster) {
+    const Topology *topology = get_topology(cluster);
+    const TopologyRole *replicas = &topology -> roles[ROLE_REPLICA];
+
+    const unsigned int index = (
+        atomic_load_explicit(&shared_cursor, memory_order_relaxed) + 1
+    ) % replicas -> cnt;
+    atomic_store_explicit(&shared_cursor, index, memory_order_relaxed);
+    return topology -> hosts[replicas -> hosts[index]].host;
+}
+
+/**
+ * Initializes a cluster without connecting to its hosts and publishes
+ * a topology with a live master and BENCH_REPLICAS live replicas
+ */
+void init_bench_cluster(void) {
+    setenv("pg_status__hosts", BENCH_HOSTS_LIST, 1);
+    unsetenv("pg_status__clusters");
+    init_clusters();
+    bench_cluster = get_default_cluster();
+
+    Topology *topology = take_topology_buffer(bench_cluster);
+    topology -> generation = 1;
+    topology -> master = 0;
+    for (unsigned int i = 0; i < topology -> hosts_cnt; i++) {
+        topology -> hosts[i].alive = true;
+        topology -> hosts[i].is_master = i == 0;
+    }
+    topology -> roles[ROLE_MASTER].cnt = 1;
+    topology -> roles[ROLE_MASTER].hosts[0] = 0;
+    topology -> roles[ROLE_REPLICA].cnt = BENCH_REPLICAS;
+    for (unsigned int i = 0; i < BENCH_REPLICAS; i++) {
+        topology -> roles[ROLE_REPLICA].hosts[i] = i + 1;
+    }
+
+    publish_topology(bench_cluster, topology);
+}
+
+/**
+ * Selects replicas until the benchmark is stopped.
+ * The topology is never republished, so the whole run is one read section.
+ */
+void *bench_thread(void *arg) {
+    BenchThread *thread = arg;
+    enter_read_section();
+    const Topology *topology = get_topology(bench_cluster);
+
+    while (!atomic_load_explicit(&bench_started, memory_order_acquire)) {
+    }
+
+    while (!atomic_load_explicit(&bench_stopped, memory_order_relaxed)) {
+        const char *host = thread -> select(bench_cluster);
+        for (unsigned int i = 0; i < BENCH_HOSTS; i++) {
+            if (topology -> hosts[i].host == host) {
+                thread -> hits[i]++;
+                break;
+            }
+        }
+        thread -> ops++;
+    }
+    leave_read_section();
+    return nullptr;
+}
+
+/**
+ * Runs the selection in threads_cnt threads for duration_ms and prints
+ * the throughput and the largest deviation from an even distribution
+ */
+void run_bench(
+    const char *name,
+    const select_fn select,
+    const unsigned int threads_cnt,
+    const unsigned long long duration_ms
+) {
+    BenchThread *threads = calloc(threads_cnt, sizeof(BenchThread));
+    if (!threads) {
+        raise_error("Can't allocate memory for threads");
+    }
+
+    atomic_store(&bench_started, false);
+    atomic_store(&bench_stopped, false);
+    for (unsigned int i = 0; i < threads_cnt; i++) {
+        threads[i].select = select;
+        const int started = pthread_create(
+            &threads[i].tid, nullptr, bench_thread, &threads[i]
+        );
+        if (started != 0) {
+            raise_error("Failed to start a benchmark thread");
+        }
+    }
+
+    const unsigned long long started_ms = monotonic_ms();
+    atomic_store_explicit(&bench_started, true, memory_order_release);
+    usleep((useconds_t)(duration_ms * 1000));
+    atomic_store_explicit(&bench_stopped, true, memory_order_relaxed);
+
+    unsigned long long ops = 0;
+    unsigned long long hits[BENCH_HOSTS] = {0};
+    for (unsigned int i = 0; i < threads_cnt; i++) {
+        pthread_join(threads[i].tid, nullptr);
+        ops += threads[i].ops;
+        for (unsigned int j = 0; j < BENCH_HOSTS; j++) {
+            hits[j] += threads[i].hits[j];
+        }
+    }
+    const unsigned long long elapsed_ms = monotonic_ms() - started_ms;
+
+    const double expected = (double)ops / BENCH_REPLICAS;
+    double max_deviation = 0;
+    for (unsigned int i = 1; i < BENCH_HOSTS; i++) {
+        double deviation = ((double)hits[i] - expected) / expected * 100;
+        if (deviation < 0) {
+            deviation = -deviation;
+        }
+        if (deviation > max_deviation) {
+            max_deviation = deviation;
+        }
+    }
+
+    printf(
+        "%-14s %7u %12.2f %13.3f%%\n",
+        name,
+        threads_cnt,
+        (double)ops / (double)elapsed_ms / 1000,
+        max_deviation
+    );
+    free(threads);
+}
+
+
+int main(const int argc, char **argv) {
+    unsigned long long duration_ms = 1000;
+    unsigned int max_threads = (unsigned int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > 1) {
+        duration_ms = str_to_ull(argv[1]);
+    }
+    if (argc > 2) {
+        max_threads = (unsigned int)str_to_ull(argv[2]);
+    }
+    if (max_threads == 0) {
+        max_threads = 1;
+    }
+
+    init_bench_cluster();
+
+    printf(
+        "%-14s %7s %12s %14s\n", "selection", "threads", "Mops/s", "max skew"
+    );
+    for (unsigned int threads = 1; ; threads *= 2) {
+        if (threads > max_threads) {
+            threads = max_threads;
+        }
+        run_bench(
+            "shared cursor", shared_cursor_replica, threads, duration_ms
+        );
+        run_bench(
+            "select_host", round_robin_replica, threads, duration_ms
+        );
+
+        if (threads == max_threads) {
+            break;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,427 @@
+#include "events.h"
+#include "response_cache.h"
+#include "utils.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * Size of the blocks in which mhd asks for the stream
+ */
+# define EVENTS_BLOCK_SIZE 4096
+
+/**
+ * A serialized event, shared by all subscribers that send it
+ */
+typedef struct TopologyEvent {
+    // Subscribers sending the event and the cluster it is current for
+    _Atomic(unsigned int) refs;
+
+    unsigned long long generation;
+    size_t len;
+
+    // Allocated together with the event
+    const char *data;
+} TopologyEvent;
+
+/**
+ * An open event stream. The stream is suspended while there is nothing
+ * to send and resumed when an event is published or a keep-alive is due.
+ */
+typedef struct Subscriber {
+    MHD_Connection *connection;
+
+    // Index of the cluster
+    unsigned int cluster;
+
+    // The event being sent and how much of it has been sent.
+    // nullptr between events
+    TopologyEvent *event;
+    size_t offset;
+
+    // Generation of the last event sent
+    unsigned long long generation;
+
+    // Whether the subscriber has any event of the cluster
+    bool has_generation;
+
+    // Whether a keep-alive comment must be sent
+    bool keepalive;
+
+    // Whether the stream is suspended in the waiting list
+    bool waiting;
+
+    struct Subscriber *prev;
+    struct Subscriber *next;
+} Subscriber;
+
+/**
+ * Everything below is protected by events_mutex,
+ * except the contents of the events, which never change
+ */
+static pthread_mutex_t events_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t events_cond;
+static bool events_running = false;
+static pthread_t events_tid;
+
+/**
+ * The current event of each cluster, indexed by MonitorCluster.index
+ */
+TopologyEvent **cluster_events = nullptr;
+
+/**
+ * Suspended subscribers of all clusters
+ */
+Subscriber *waiting_subscribers = nullptr;
+
+unsigned long long events_keepalive_ms = DEFAULT_EVENTS_KEEPALIVE_MS;
+
+/**
+ * Comment sent to idle streams. Never freed: it holds a reference
+ * to itself.
+ */
+TopologyEvent keepalive_event = {
+    .refs = 1,
+    .generation = 0,
+    .len = 2,
+    .data = ":\n",
+};
+
+
+/**
+ * Creates the event with the state of the topology snapshot
+ */
+TopologyEvent *create_topology_event(const Topology *topology) {
+    char *state = render_state_body(topology);
+    char *data = format_string(
+        "id: %llu\nevent: topology\ndata: %s\n\n",
+        topology -> generation,
+        state
+    );
+    free(state);
+
+    const size_t len = strlen(data);
+    TopologyEvent *event = malloc(sizeof(TopologyEvent) + len);
+    if (!event) {
+        raise_error("Can't allocate memory for an event");
+    }
+    atomic_init(&event -> refs, 1);
+    event -> generation = topology -> generation;
+    event -> len = len;
+    memcpy(event + 1, data, len);
+    event -> data = (const char *)(event + 1);
+    free(data);
+    return event;
+}
+
+/**
+ * Drops a reference to the event and frees it after the last one
+ */
+void release_event(TopologyEvent *event) {
+    const unsigned int refs = atomic_fetch_sub_explicit(
+        &event -> refs, 1, memory_order_acq_rel
+    );
+    if (refs == 1) {
+        free(event);
+    }
+}
+
+/**
+ * Takes a reference to the event
+ */
+TopologyEvent *retain_event(TopologyEvent *event) {
+    atomic_fetch_add_explicit(&event -> refs, 1, memory_order_relaxed);
+    return event;
+}
+
+/**
+ * Suspends the stream until there is something to send.
+ * events_mutex must be locked.
+ */
+void wait_subscriber(Subscriber *subscriber) {
+    subscriber -> waiting = true;
+    subscriber -> prev = nullptr;
+    subscriber -> next = waiting_subscribers;
+    if (waiting_subscribers) {
+        waiting_subscribers -> prev = subscriber;
+    }
+    waiting_subscribers = subscriber;
+
+    MHD_suspend_connection(subscriber -> connection);
+}
+
+/**
+ * Removes the stream from the waiting list.
+ * events_mutex must be locked.
+ */
+void unlink_subscriber(Subscriber *subscriber) {
+    if (subscriber -> prev) {
+        subscriber -> prev -> next = subscriber -> next;
+    }
+    else {
+        waiting_subscribers = subscriber -> next;
+    }
+    if (subscriber -> next) {
+        subscriber -> next -> prev = subscriber -> prev;
+    }
+
+    subscriber -> waiting = false;
+    subscriber -> prev = nullptr;
+    subscriber -> next = nullptr;
+}
+
+/**
+ * Removes the stream from the waiting list and resumes it.
+ * events_mutex must be locked.
+ */
+void wake_subscriber(Subscriber *subscriber) {
+    unlink_subscriber(subscriber);
+    MHD_resume_connection(subscriber -> connection);
+}
+
+/**
+ * topology_listener that serializes a topology event of the cluster when
+ * the generation of the published topology snapshot changes
+ * and wakes its subscribers.
+ * Must be added with add_topology_listener before start_pg_monitor.
+ *
+ * The event is serialized once and shared by all subscribers.
+ * The first calls come from start_pg_monitor before the request threads
+ * start, so the events are allocated there.
+ */
+void publish_topology_event(
+    const MonitorCluster *cluster, const Topology *topology
+) {
+    pthread_mutex_lock(&events_mutex);
+
+    if (!cluster_events) {
+        cluster_events = calloc(get_clusters_cnt(), sizeof(TopologyEvent *));
+        if (!cluster_events) {
+            raise_error("Can't allocate memory for events");
+        }
+    }
+
+    TopologyEvent *previous = cluster_events[cluster -> index];
+    if (previous && previous -> generation == topology -> generation) {
+        pthread_mutex_unlock(&events_mutex);
+        return;
+    }
+
+    cluster_events[cluster -> index] = create_topology_event(topology);
+    if (previous) {
+        release_event(previous);
+    }
+
+    Subscriber *subscriber = waiting_subscribers;
+    while (subscriber) {
+        Subscriber *next = subscriber -> next;
+        if (subscriber -> cluster == cluster -> index) {
+            wake_subscriber(subscriber);
+        }
+        subscriber = next;
+    }
+
+    pthread_mutex_unlock(&events_mutex);
+}
+
+/**
+ * Takes the next event to send to the subscriber: the current event of
+ * the cluster if it has not been sent yet, or a due keep-alive.
+ * Returns nullptr if there is nothing to send.
+ * events_mutex must be locked.
+ */
+TopologyEvent *next_event(Subscriber *subscriber) {
+    TopologyEvent *current = cluster_events[subscriber -> cluster];
+    if (
+        !subscriber -> has_generation ||
+        subscriber -> generation != current -> generation
+    ) {
+        subscriber -> generation = current -> generation;
+        subscriber -> has_generation = true;
+        subscriber -> keepalive = false;
+        return retain_event(current);
+    }
+
+    if (subscriber -> keepalive) {
+        subscriber -> keepalive = false;
+        return retain_event(&keepalive_event);
+    }
+    return nullptr;
+}
+
+/**
+ * MHD_ContentReaderCallback of the event stream.
+ *
+ * A slow subscriber gets only the latest state: every event carries
+ * the whole state, so the skipped ones are not needed.
+ */
+ssize_t read_events(void *cls, uint64_t pos, char *buf, size_t max) {
+    Subscriber *subscriber = cls;
+
+    if (!subscriber -> event) {
+        pthread_mutex_lock(&events_mutex);
+        if (!events_running) {
+            pthread_mutex_unlock(&events_mutex);
+            return MHD_CONTENT_READER_END_OF_STREAM;
+        }
+
+        subscriber -> event = next_event(subscriber);
+        subscriber -> offset = 0;
+        if (!subscriber -> event) {
+            wait_subscriber(subscriber);
+            pthread_mutex_unlock(&events_mutex);
+            return 0;
+        }
+        pthread_mutex_unlock(&events_mutex);
+    }
+
+    TopologyEvent *event = subscriber -> event;
+    size_t len = event -> len - subscriber -> offset;
+    if (len > max) {
+        len = max;
+    }
+    memcpy(buf, event -> data + subscriber -> offset, len);
+    subscriber -> offset += len;
+
+    if (subscriber -> offset == event -> len) {
+        release_event(event);
+        subscriber -> event = nullptr;
+    }
+    return (ssize_t) len;
+}
+
+/**
+ * MHD_ContentReaderFreeCallback of the event stream
+ */
+void free_subscriber(void *cls) {
+    Subscriber *subscriber = cls;
+
+    pthread_mutex_lock(&events_mutex);
+    if (subscriber -> waiting) {
+        unlink_subscriber(subscriber);
+    }
+    pthread_mutex_unlock(&events_mutex);
+
+    if (subscriber -> event) {
+        release_event(subscriber -> event);
+    }
+    free(subscriber);
+}
+
+/**
+ * Responds with a text/event-stream of the topology events of the cluster.
+ * The stream starts with the current state, unless the Last-Event-ID header
+ * already has its generation.
+ *
+ * The stream is suspended while there is nothing to send,
+ * so it holds no thread.
+ */
+void subscribe_topology_events(
+    HTTPResponse *response, const MonitorCluster *cluster
+) {
+    Subscriber *subscriber = calloc(1, sizeof(Subscriber));
+    if (!subscriber) {
+        printf_error("Can't allocate memory for a subscriber");
+        response -> status_code = MHD_HTTP_INTERNAL_SERVER_ERROR;
+        return;
+    }
+    subscriber -> connection = response -> connection;
+    subscriber -> cluster = cluster -> index;
+
+    const char *last_event_id = get_request_header(response, "Last-Event-ID");
+    if (last_event_id) {
+        subscriber -> has_generation = parse_ull(
+            last_event_id, &subscriber -> generation
+        );
+    }
+
+    MHD_Response *mhd_response = MHD_create_response_from_callback(
+        MHD_SIZE_UNKNOWN,
+        EVENTS_BLOCK_SIZE,
+        read_events,
+        subscriber,
+        free_subscriber
+    );
+    if (!mhd_response) {
+        free(subscriber);
+        printf_error("Failed to create an event stream");
+        response -> status_code = MHD_HTTP_INTERNAL_SERVER_ERROR;
+        return;
+    }
+
+    MHD_add_response_header(
+        mhd_response, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache"
+    );
+    response -> mhd_response = mhd_response;
+    response -> content_type = "text/event-stream";
+}
+
+/**
+ * The thread that wakes the idle streams every events_keepalive_ms to send
+ * a keep-alive comment. Writing to the stream also detects
+ * the subscribers that have gone away, which a suspended stream can't.
+ */
+void *events_thread(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&events_mutex);
+    unsigned long long keepalive_ms = monotonic_ms() + events_keepalive_ms;
+    while (events_running) {
+        if (monotonic_ms() < keepalive_ms) {
+            monotonic_cond_wait(&events_cond, &events_mutex, keepalive_ms);
+            continue;
+        }
+
+        while (waiting_subscribers) {
+            waiting_subscribers -> keepalive = true;
+            wake_subscriber(waiting_subscribers);
+        }
+        keepalive_ms += events_keepalive_ms;
+    }
+    pthread_mutex_unlock(&events_mutex);
+
+    return nullptr;
+}
+
+/**
+ * Reads pg_status__events_keepalive_ms and starts the thread that sends
+ * keep-alive comments. Must be called before start_http_server.
+ */
+void start_events(void) {
+    replace_from_env_ull(
+        "pg_status__events_keepalive_ms", &events_keepalive_ms
+    );
+    if (events_keepalive_ms == 0) {
+        raise_error("pg_status__events_keepalive_ms must be positive");
+    }
+
+    init_monotonic_cond(&events_cond);
+    events_running = true;
+
+    const int started = pthread_create(
+        &events_tid, nullptr, events_thread, nullptr
+    );
+    if (started != 0) {
+        raise_error("Failed to start the events thread");
+    }
+}
+
+/**
+ * Ends all event streams and stops the thread.
+ * Must be called before stop_http_server.
+ */
+void stop_events(void) {
+    pthread_mutex_lock(&events_mutex);
+        events_running = false;
+        while (waiting_subscribers) {
+            wake_subscriber(waiting_subscribers);
+        }
+        pthread_cond_signal(&events_cond);
+    pthread_mutex_unlock(&events_mutex);
+
+    pthread_join(events_tid, nullptr);
+}
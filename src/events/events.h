@@ -0,0 +1,44 @@
+#ifndef PG_STATUS_EVENTS_H
+#define PG_STATUS_EVENTS_H
+
+#include "http_server.h"
+#include "pg_monitor.h"
+
+/**
+ * How often an idle event stream gets a keep-alive comment, ms.
+ * It also detects the subscribers that have gone away.
+ */
+# define DEFAULT_EVENTS_KEEPALIVE_MS 15000
+
+/**
+ * Reads pg_status__events_keepalive_ms and starts the thread that sends
+ * keep-alive comments. Must be called before start_http_server.
+ */
+void start_events(void);
+
+/**
+ * Ends all event streams and stops the thread.
+ * Must be called before stop_http_server.
+ */
+void stop_events(void);
+
+/**
+ * topology_listener that serializes a topology event of the cluster when
+ * the generation of the published topology snapshot changes
+ * and wakes its subscribers.
+ * Must be added with add_topology_listener before start_pg_monitor.
+ */
+void publish_topology_event(
+    const MonitorCluster *cluster, const Topology *topology
+);
+
+/**
+ * Responds with a text/event-stream of the topology events of the cluster.
+ * The stream starts with the current state, unless the Last-Event-ID header
+ * already has its generation.
+ */
+void subscribe_topology_events(
+    HTTPResponse *response, const MonitorCluster *cluster
+);
+
+#endif //PG_STATUS_EVENTS_H
@@ -5,6 +5,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 /**
  * list of routes
@@ -19,18 +22,160 @@ typedef struct Routes {
  */
 Routes *routes_list = nullptr;
 
+/**
+ * Empty response shared by all requests to unknown routes
+ */
+MHD_Response *not_found_response = nullptr;
+
+/**
+ * Limits the messages about the requests that failed, keyed by
+ * MHD_RequestTerminationCode: a broken client would otherwise
+ * log a message per request
+ */
+LogLimit request_termination_log = {0};
+
+/**
+ * http server parameters. The default parameters are set here.
+ */
+HTTPServerParameters http_parameters = {
+    .port = 8000,
+    .socket_path = nullptr,
+    .threads = 1,
+    .connection_limit = 0,
+    .connection_timeout = 0,
+    .connection_memory_limit = 16 * 1024,
+};
+
+
+/**
+ * Overrides default parameters if they are set in environment variables.
+ */
+void get_http_values_from_env(void) {
+    replace_from_env_uint("pg_status__http_port", &http_parameters.port);
+    replace_from_env("pg_status__http_socket", &http_parameters.socket_path);
+    replace_from_env_uint("pg_status__http_threads", &http_parameters.threads);
+    replace_from_env_uint(
+        "pg_status__http_connection_limit",
+        &http_parameters.connection_limit
+    );
+    replace_from_env_uint(
+        "pg_status__http_connection_timeout",
+        &http_parameters.connection_timeout
+    );
+    replace_from_env_ull(
+        "pg_status__http_connection_memory_limit",
+        &http_parameters.connection_memory_limit
+    );
+
+    if (http_parameters.threads == 0) {
+        http_parameters.threads = 1;
+    }
+    if (http_parameters.port > UINT16_MAX) {
+        raise_error("pg_status__http_port is out of range");
+    }
+    if (http_parameters.port == 0 && http_parameters.socket_path == nullptr) {
+        raise_error(
+            "Neither pg_status__http_port nor pg_status__http_socket is set"
+        );
+    }
+}
+
+/**
+ * Maximum number of the mhd options taken from http_parameters,
+ * including MHD_OPTION_END
+ */
+# define DAEMON_OPTIONS_CNT 6
+
+/**
+ * Fills the mhd options from http_parameters.
+ * The options not set in http_parameters are left to mhd.
+ * If listen_socket is valid, the daemon accepts connections on it.
+ */
+void get_daemon_options(
+    struct MHD_OptionItem *options, const MHD_socket listen_socket
+) {
+    unsigned int cnt = 0;
+
+    if (listen_socket != MHD_INVALID_SOCKET) {
+        options[cnt++] = (struct MHD_OptionItem) {
+            MHD_OPTION_LISTEN_SOCKET, listen_socket, nullptr
+        };
+    }
+
+    options[cnt++] = (struct MHD_OptionItem) {
+        MHD_OPTION_CONNECTION_MEMORY_LIMIT,
+        (intptr_t) http_parameters.connection_memory_limit,
+        nullptr
+    };
+    if (http_parameters.threads > 1) {
+        options[cnt++] = (struct MHD_OptionItem) {
+            MHD_OPTION_THREAD_POOL_SIZE, http_parameters.threads, nullptr
+        };
+    }
+    if (http_parameters.connection_limit > 0) {
+        options[cnt++] = (struct MHD_OptionItem) {
+            MHD_OPTION_CONNECTION_LIMIT,
+            http_parameters.connection_limit,
+            nullptr
+        };
+    }
+    if (http_parameters.connection_timeout > 0) {
+        options[cnt++] = (struct MHD_OptionItem) {
+            MHD_OPTION_CONNECTION_TIMEOUT,
+            http_parameters.connection_timeout,
+            nullptr
+        };
+    }
+    options[cnt] = (struct MHD_OptionItem) {MHD_OPTION_END, 0, nullptr};
+}
+
 
 /**
  * The default handler if no matching route is found is to return a 404.
  */
 void not_found(HTTPResponse *response) {
-    MHD_Response *mhd_response = MHD_create_response_from_buffer(
-        0, NULL, MHD_RESPMEM_PERSISTENT
-    );
-    response -> mhd_response = mhd_response;
+    response -> mhd_response = not_found_response;
+    response -> shared_response = true;
     response -> status_code = MHD_HTTP_NOT_FOUND;
 }
 
+/**
+ * Adds the headers set by set_response_cache or set_response_no_store
+ */
+void add_cache_headers(
+    MHD_Response *mhd_response, const HTTPResponse *response
+) {
+    if (response -> max_age == HTTP_NO_STORE) {
+        MHD_add_response_header(
+            mhd_response, MHD_HTTP_HEADER_CACHE_CONTROL, "no-store"
+        );
+        return;
+    }
+
+    MHD_add_response_header(
+        mhd_response, MHD_HTTP_HEADER_ETAG, response -> etag
+    );
+    MHD_add_response_header(
+        mhd_response, MHD_HTTP_HEADER_VARY, MHD_HTTP_HEADER_ACCEPT
+    );
+
+    if (response -> max_age == HTTP_NO_MAX_AGE) {
+        MHD_add_response_header(
+            mhd_response, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache"
+        );
+        return;
+    }
+
+    char cache_control[32];
+    snprintf(
+        cache_control, sizeof(cache_control),
+        "max-age=%ld", response -> max_age
+    );
+    MHD_add_response_header(
+        mhd_response, MHD_HTTP_HEADER_CACHE_CONTROL, cache_control
+    );
+}
+
 /**
  * Sends a response to the mhd queue for sending the response
  */
@@ -48,9 +193,10 @@ MHD_Result queue_response(
     }
 
     if (!mhd_response) {
-        if (response -> response) {
+        if (response -> response && !response -> not_modified) {
             mhd_response = MHD_create_response_from_buffer(
-                strlen(response -> response),
+                response -> response_len ?
+                    response -> response_len : strlen(response -> response),
                 (void*) response -> response,
                 response -> memory_mode
             );
@@ -63,13 +209,23 @@ MHD_Result queue_response(
     }
 
     if (mhd_response) {
-        if (response -> content_type != nullptr) {
+        if (
+            !response -> shared_response &&
+            !response -> not_modified &&
+            response -> content_type != nullptr
+        ) {
             MHD_add_response_header(
                 mhd_response,
                 MHD_HTTP_HEADER_CONTENT_TYPE,
                 response -> content_type
             );
         }
+        if (
+            response -> etag[0] != '\0' ||
+            response -> max_age == HTTP_NO_STORE
+        ) {
+            add_cache_headers(mhd_response, response);
+        }
 
         ret = MHD_queue_response(
             connection, response->status_code, mhd_response
@@ -81,8 +237,9 @@ MHD_Result queue_response(
             );
         }
 
-        MHD_destroy_response(mhd_response);
-
+        if (!response -> shared_response) {
+            MHD_destroy_response(mhd_response);
+        }
     }
     else {
         printf_error(
@@ -101,32 +258,34 @@ void request_completed(
     void **req_cls,
     const MHD_RequestTerminationCode toe
 ) {
+    const char *reason = nullptr;
     switch (toe) {
         case MHD_REQUEST_TERMINATED_COMPLETED_OK:
-            // printf("request completed\n");
             break;
         case MHD_REQUEST_TERMINATED_WITH_ERROR:
-            printf_error("request completed with error\n");
+            reason = "error";
             break;
         case MHD_REQUEST_TERMINATED_TIMEOUT_REACHED:
-            printf_error("request completed with timeout\n");
+            reason = "timeout";
             break;
         case MHD_REQUEST_TERMINATED_DAEMON_SHUTDOWN:
-            printf_error("request completed with MHD shutdown\n");
+            reason = "MHD shutdown";
             break;
         case MHD_REQUEST_TERMINATED_READ_ERROR:
-            printf_error(
-                "request completed with terminated read error\n"
-            );
+            reason = "terminated read error";
             break;
         case MHD_REQUEST_TERMINATED_CLIENT_ABORT:
-            printf_error("request completed with client abort\n");
+            reason = "client abort";
             break;
     }
-    if (*req_cls) {
-        HTTPResponse *response = *req_cls;
-        free(response);
+    if (reason) {
+        log_limited(
+            &request_termination_log, (unsigned int) toe, LOG_WARNING,
+            "request completed with %s", reason
+        );
     }
+    // The response of a post request or the context of a get request
+    free(*req_cls);
 }
 
 /**
@@ -140,18 +299,19 @@ void notify_connection_callback(
 ) {
     switch (toe) {
         case MHD_CONNECTION_NOTIFY_STARTED:
-            printf("Connection started\n");
+            log_message(LOG_DEBUG, "Connection started");
             break;
         case MHD_CONNECTION_NOTIFY_CLOSED:
-            printf("Connection closed\n");
+            log_message(LOG_DEBUG, "Connection closed");
             break;
     }
 }
 
 /**
- * Searches for a suitable route among registered routes
+ * Searches for a suitable route among registered routes.
+ * Returns its index, or the number of the routes if there is none.
  */
-request_handler_t find_handler(const char *method, const char *path) {
+unsigned int find_route(const char *method, const char *path) {
     for (unsigned int i = 0; i < routes_list -> cnt; i++) {
         Route *routes = routes_list -> routes;
 
@@ -159,14 +319,42 @@ request_handler_t find_handler(const char *method, const char *path) {
             strcmp(routes[i].method, method) == 0 &&
             strcmp(routes[i].path, path) == 0
         ) {
-            return routes[i].handler;
+            return i;
         }
     }
-    return not_found;
+    return routes_list -> cnt;
+}
+
+/**
+ * Splits /c/{scope}/{route} into the scope and /{route}.
+ * Returns the path of the route and saves the scope into the response.
+ * Paths without a scope are returned as is.
+ */
+const char *split_scope(const char *path, HTTPResponse *response) {
+    const size_t prefix_len = strlen(SCOPE_PREFIX);
+    if (strncmp(path, SCOPE_PREFIX, prefix_len) != 0) {
+        return path;
+    }
+
+    const char *scope = path + prefix_len;
+    const char *route = strchr(scope, '/');
+    if (!route || route == scope) {
+        return path;
+    }
+
+    response -> scope = scope;
+    response -> scope_len = (size_t)(route - scope);
+    return route;
 }
 
 /**
  * Starts execution of the handler registered in the route.
+ * Records the time of the handler and of the whole request,
+ * unless the request is suspended.
+ *
+ * The handler runs and its response is queued inside a read section,
+ * see enter_read_section, so the handler may send the published data
+ * as is: mhd copies or references it before the section is left.
  */
 MHD_Result process_handler(
   const char *path,
@@ -174,8 +362,15 @@ MHD_Result process_handler(
   HTTPResponse *response,
   MHD_Connection *connection
 ) {
+    const unsigned long long started_ns = monotonic_ns();
     MHD_Result result = MHD_NO;
-    const request_handler_t handler = find_handler(method, path);
+    const unsigned int route = find_route(
+        method, split_scope(path, response)
+    );
+    const request_handler_t handler = (
+        route < routes_list -> cnt ?
+            routes_list -> routes[route].handler : not_found
+    );
 
     const char *content_type = MHD_lookup_connection_value(
         connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_ACCEPT
@@ -184,29 +379,63 @@ MHD_Result process_handler(
         response -> content_type = content_type;
     }
 
+    response -> connection = connection;
+    enter_read_section();
+    const unsigned long long handler_started_ns = monotonic_ns();
     handler(response);
+    if (response -> suspended) {
+        leave_read_section();
+        return MHD_YES;
+    }
+    const unsigned long long handler_ns = (
+        monotonic_ns() - handler_started_ns
+    );
 
     result = queue_response(connection, response, path, method);
+    leave_read_section();
+    record_request(
+        route, response -> status_code,
+        handler_ns, monotonic_ns() - started_ns
+    );
     return result;
 }
 
+/**
+ * Fills the structure to store the response with default parameters
+ */
+void init_response(HTTPResponse *response) {
+    response -> mhd_response = nullptr;
+    response -> shared_response = false;
+    response -> response = nullptr;
+    response -> response_len = 0;
+    response -> memory_mode = MHD_RESPMEM_MUST_COPY;
+    response -> content_type = nullptr;
+    response -> status_code = MHD_HTTP_OK;
+    response -> scope = nullptr;
+    response -> scope_len = 0;
+    response -> connection = nullptr;
+    response -> context = nullptr;
+    response -> suspended = false;
+    response -> etag[0] = '\0';
+    response -> max_age = HTTP_NO_MAX_AGE;
+    response -> not_modified = false;
+}
+
 /**
  * Prepares a structure with default parameters to store the response
  */
 HTTPResponse *allocate_response(void) {
     HTTPResponse *response = malloc(sizeof(HTTPResponse));
     if (response != nullptr) {
-        response -> mhd_response = nullptr;
-        response -> response = nullptr;
-        response -> memory_mode = MHD_RESPMEM_MUST_COPY;
-        response -> content_type = nullptr;
-        response -> status_code = MHD_HTTP_OK;
+        init_response(response);
     }
     return response;
 }
 
 /**
- * Processing a get request
+ * Processing a get request.
+ * The response structure lives on the stack: a suspended request keeps
+ * its state in req_cls, and the handler is called again after it is resumed.
  */
 MHD_Result process_get(
   void *cls,
@@ -217,10 +446,11 @@ MHD_Result process_get(
   const char *upload_data,
   void **req_cls
 ) {
-    HTTPResponse *response = allocate_response();
-    *req_cls = (void *) response;
+    HTTPResponse response;
+    init_response(&response);
+    response.context = req_cls;
 
-    return process_handler(path, method, response, connection);
+    return process_handler(path, method, &response, connection);
 }
 
 /**
@@ -269,42 +499,134 @@ MHD_Result answer_to_connection(
 
 
 /**
- * Starts http server daemon
+ * Starts an mhd daemon that listens on the TCP port or,
+ * if listen_socket is valid, on listen_socket
  */
-MHD_Daemon *start_http_server(
-    const uint16_t port,
-    Route *routes,
-    const unsigned int cnt_routes
-) {
-
-    routes_list = malloc(sizeof(Routes));
-    routes_list -> routes = routes;
-    routes_list -> cnt = cnt_routes;
+MHD_Daemon *start_daemon(const uint16_t port, const MHD_socket listen_socket) {
+    struct MHD_OptionItem options[DAEMON_OPTIONS_CNT];
+    get_daemon_options(options, listen_socket);
 
     MHD_Daemon *daemon = MHD_start_daemon(
         MHD_USE_AUTO_INTERNAL_THREAD |
+        MHD_ALLOW_SUSPEND_RESUME |
         MHD_USE_ERROR_LOG,
         port, nullptr, nullptr,
         answer_to_connection, nullptr,
         MHD_OPTION_NOTIFY_COMPLETED, request_completed, nullptr,
         // MHD_OPTION_NOTIFY_CONNECTION, notify_connection_callback, nullptr,
-        MHD_OPTION_CONNECTION_MEMORY_LIMIT, 16 * 1024,
+        MHD_OPTION_ARRAY, options,
         MHD_OPTION_END
     );
     if (!daemon) {
         raise_error("Failed to start mhd daemon");
     }
-    printf("http server started at 127.0.0.1:%d\n", port);
     return daemon;
+}
+
+/**
+ * Creates a listening unix domain socket at the path.
+ * A socket file left from a previous run is replaced.
+ */
+MHD_socket listen_unix_socket(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        raise_error("pg_status__http_socket is too long: %s", path);
+    }
+    strcpy(addr.sun_path, path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        raise_error("Failed to create unix socket");
+    }
+
+    unlink(path);
+    if (
+        bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        listen(fd, SOMAXCONN) != 0
+    ) {
+        close(fd);
+        raise_error("Failed to listen on unix socket %s", path);
+    }
+    return fd;
+}
+
+/**
+ * Starts http server daemons on the TCP port and the unix domain socket
+ * from the environment variables.
+ * Both daemons serve the same routes.
+ */
+HTTPServer *start_http_server(
+    Route *routes,
+    const unsigned int cnt_routes
+) {
+
+    routes_list = malloc(sizeof(Routes));
+    routes_list -> routes = routes;
+    routes_list -> cnt = cnt_routes;
+
+    get_http_values_from_env();
+
+    // Each daemon has its own threads
+    const unsigned int daemons_cnt = (
+        (http_parameters.port > 0 ? 1U : 0U) +
+        (http_parameters.socket_path != nullptr ? 1U : 0U)
+    );
+    init_request_metrics(
+        routes, cnt_routes, http_parameters.threads * daemons_cnt
+    );
+
+    not_found_response = MHD_create_response_from_buffer(
+        0, NULL, MHD_RESPMEM_PERSISTENT
+    );
+    if (!not_found_response) {
+        raise_error("Failed to create the not found response");
+    }
+
+    HTTPServer *server = malloc(sizeof(HTTPServer));
+    if (!server) {
+        raise_error("Can't allocate memory for http server");
+    }
+    server -> tcp_daemon = nullptr;
+    server -> unix_daemon = nullptr;
+
+    if (http_parameters.port > 0) {
+        const uint16_t port = (uint16_t) http_parameters.port;
+        server -> tcp_daemon = start_daemon(port, MHD_INVALID_SOCKET);
+        log_message(
+            LOG_INFO, "http server started at 127.0.0.1:%d with %u threads",
+            port, http_parameters.threads
+        );
+    }
 
+    if (http_parameters.socket_path) {
+        server -> unix_daemon = start_daemon(
+            0, listen_unix_socket(http_parameters.socket_path)
+        );
+        log_message(
+            LOG_INFO, "http server started at %s with %u threads",
+            http_parameters.socket_path, http_parameters.threads
+        );
+    }
+    return server;
 }
 
 /**
- * Stops http server daemon
+ * Stops http server daemons.
+ * mhd closes the listening sockets, the unix socket file is removed here.
  */
-void stop_http_server(MHD_Daemon *daemon) {
-    MHD_stop_daemon(daemon);
-    printf("http server stopped\n");
+void stop_http_server(HTTPServer *server) {
+    if (server -> tcp_daemon) {
+        MHD_stop_daemon(server -> tcp_daemon);
+    }
+    if (server -> unix_daemon) {
+        MHD_stop_daemon(server -> unix_daemon);
+        unlink(http_parameters.socket_path);
+    }
+    free(server);
+    MHD_destroy_response(not_found_response);
+    log_message(LOG_INFO, "http server stopped");
 }
 
 
@@ -314,3 +636,114 @@ bool need_json_response(const HTTPResponse *response) {
         is_equal_strings(response -> content_type, "application/json")
     ;
 }
+
+/**
+ * Returns the value of the query argument of the request,
+ * or nullptr if it is not set
+ */
+const char *get_request_argument(
+    const HTTPResponse *response, const char *name
+) {
+    return MHD_lookup_connection_value(
+        response -> connection, MHD_GET_ARGUMENT_KIND, name
+    );
+}
+
+/**
+ * Returns the value of the header of the request,
+ * or nullptr if it is not set
+ */
+const char *get_request_header(
+    const HTTPResponse *response, const char *name
+) {
+    return MHD_lookup_connection_value(
+        response -> connection, MHD_HEADER_KIND, name
+    );
+}
+
+/**
+ * Checks whether the If-None-Match header has the ETag: it is "*" or
+ * a comma-separated list in which the ETag is, weak or not
+ */
+bool is_etag_matched(const char *if_none_match, const char *etag) {
+    const size_t etag_len = strlen(etag);
+
+    const char *item = if_none_match;
+    while (*item != '\0') {
+        while (*item == ' ' || *item == ',') {
+            item++;
+        }
+        if (*item == '*') {
+            return true;
+        }
+        if (strncmp(item, "W/", 2) == 0) {
+            item += 2;
+        }
+
+        const char *end = strchr(item, ',');
+        size_t len = end ? (size_t)(end - item) : strlen(item);
+        while (len > 0 && item[len - 1] == ' ') {
+            len--;
+        }
+        if (len == etag_len && strncmp(item, etag, len) == 0) {
+            return true;
+        }
+
+        if (!end) {
+            break;
+        }
+        item = end;
+    }
+    return false;
+}
+
+/**
+ * Returns true if If-None-Match of the request has the ETag
+ */
+bool is_request_etag_matched(const HTTPResponse *response, const char *etag) {
+    const char *if_none_match = get_request_header(
+        response, MHD_HTTP_HEADER_IF_NONE_MATCH
+    );
+    return if_none_match && is_etag_matched(if_none_match, etag);
+}
+
+/**
+ * Makes the response cacheable: it gets the ETag, Cache-Control with
+ * max_age in seconds, or no-cache for HTTP_NO_MAX_AGE, and Vary: Accept.
+ * Returns true if If-None-Match of the request has the ETag: the server
+ * then responds 304 without a body, so the handler doesn't need to render
+ * one. Can't be used with a shared response.
+ */
+bool set_response_cache(
+    HTTPResponse *response, const char *etag, const long max_age
+) {
+    snprintf(response -> etag, HTTP_ETAG_LEN, "%s", etag);
+    response -> max_age = max_age;
+
+    if (is_request_etag_matched(response, response -> etag)) {
+        response -> not_modified = true;
+        response -> status_code = MHD_HTTP_NOT_MODIFIED;
+    }
+    return response -> not_modified;
+}
+
+/**
+ * Forbids storing the response: it gets Cache-Control: no-store and no
+ * ETag, so every request is answered anew. For the answers that differ
+ * between requests, such as the hosts returned in turn.
+ */
+void set_response_no_store(HTTPResponse *response) {
+    response -> etag[0] = '\0';
+    response -> max_age = HTTP_NO_STORE;
+}
+
+/**
+ * Suspends the request instead of responding to it. The handler is called
+ * again for the same request after MHD_resume_connection, with the same
+ * context, and then responds or suspends the request again.
+ * Suspended requests must be resumed before stop_http_server.
+ */
+void suspend_request(HTTPResponse *response) {
+    MHD_suspend_connection(response -> connection);
+    response -> suspended = true;
+}
@@ -1,6 +1,7 @@
 #ifndef PG_STATUS_HTTP_SERVER_H
 #define PG_STATUS_HTTP_SERVER_H
 
+#include "utils.h"
 #include <microhttpd.h>
 
 
@@ -11,17 +12,48 @@ typedef enum MHD_Result MHD_Result;
 typedef enum MHD_RequestTerminationCode MHD_RequestTerminationCode;
 typedef enum MHD_ResponseMemoryMode MHD_ResponseMemoryMode;
 
+/**
+ * Prefix of the scoped routes: /c/{scope}/{route}.
+ * A scoped route is handled by the same handler as /{route},
+ * with the scope passed in HTTPResponse.
+ */
+# define SCOPE_PREFIX "/c/"
+
+/**
+ * Maximum length of an ETag, including the quotes
+ */
+# define HTTP_ETAG_LEN 64
+
+/**
+ * max_age of the responses that must be revalidated every time,
+ * see set_response_cache
+ */
+# define HTTP_NO_MAX_AGE (-1)
+
+/**
+ * max_age of the responses that must not be stored at all,
+ * see set_response_no_store
+ */
+# define HTTP_NO_STORE (-2)
+
 /**
  * Structure for convenient response formation
  */
 typedef struct HTTPResponse {
     // For simple cases, just form a string, and the server itself will
     // convert it to MHD_Response
-    char *response;
+    const char *response;
+
+    // Length of response, or 0 if it is a null-terminated string
+    size_t response_len;
 
     // For complex cases, you can manually generate MHD_Response
     MHD_Response *mhd_response;
 
+    // Whether mhd_response is shared between requests. The server then
+    // neither adds headers to it nor destroys it
+    bool shared_response;
+
     // Response type. It can be set by the server or specified by handler.
     // Must be allocated on the heap and will be freed by the server.
     const char *content_type;
@@ -31,8 +63,74 @@ typedef struct HTTPResponse {
 
     // Response status
     unsigned int status_code;
+
+    // Scope of the request from /c/{scope}/{route}. Not null-terminated.
+    // nullptr for the routes without a scope
+    const char *scope;
+    size_t scope_len;
+
+    // Connection of the request, see get_request_argument
+    MHD_Connection *connection;
+
+    // State of the request kept between the calls of the handler,
+    // see suspend_request. nullptr on the first call.
+    // Must be allocated on the heap and will be freed by the server.
+    void **context;
+
+    // Set by suspend_request: the server then sends no response,
+    // the handler will be called again after MHD_resume_connection
+    bool suspended;
+
+    // ETag of the response, empty if it has none. See set_response_cache
+    char etag[HTTP_ETAG_LEN];
+
+    // Seconds for which the response may be cached, HTTP_NO_MAX_AGE
+    // or HTTP_NO_STORE
+    long max_age;
+
+    // Whether the client already has the response: the server then
+    // responds 304 without a body
+    bool not_modified;
 } HTTPResponse;
 
+/**
+ * List of all http server parameters
+ */
+typedef struct HTTPServerParameters {
+    // TCP port to listen on. 0 disables the TCP listener
+    unsigned int port;
+
+    // Path of the unix domain socket to listen on.
+    // nullptr disables the unix socket listener
+    char *socket_path;
+
+    // Number of threads that process connections.
+    // More than 1 starts a pool of threads, each with its own listener
+    unsigned int threads;
+
+    // Maximum number of concurrent connections. 0 means the mhd default
+    unsigned int connection_limit;
+
+    // Time in seconds after which an inactive connection is closed.
+    // 0 means no timeout
+    unsigned int connection_timeout;
+
+    // Memory in bytes available to each connection for the request
+    // and the response headers
+    unsigned long long connection_memory_limit;
+} HTTPServerParameters;
+
+/**
+ * Running http server: a daemon for each listener
+ */
+typedef struct HTTPServer {
+    // Daemon listening on the TCP port. nullptr if disabled
+    MHD_Daemon *tcp_daemon;
+
+    // Daemon listening on the unix domain socket. nullptr if disabled
+    MHD_Daemon *unix_daemon;
+} HTTPServer;
+
 /**
  * Interface for the handler that will be called when the route is called
  */
@@ -50,19 +148,131 @@ typedef struct Route {
 } Route;
 
 /**
- * Starts http server daemon
+ * Starts http server daemons on the TCP port and the unix domain socket
+ * from the environment variables
  */
-MHD_Daemon *start_http_server(
-    uint16_t port,
-    Route *routes,
-    unsigned int cnt_routes
-);
+HTTPServer *start_http_server(Route *routes, unsigned int cnt_routes);
 
 /**
- * Stops http server daemon
+ * Stops http server daemons
  */
-void stop_http_server(MHD_Daemon *daemon);
+void stop_http_server(HTTPServer *server);
 
 bool need_json_response(const HTTPResponse *response);
 
+/**
+ * Returns the value of the query argument of the request,
+ * or nullptr if it is not set
+ */
+const char *get_request_argument(
+    const HTTPResponse *response, const char *name
+);
+
+/**
+ * Returns the value of the header of the request,
+ * or nullptr if it is not set
+ */
+const char *get_request_header(
+    const HTTPResponse *response, const char *name
+);
+
+/**
+ * Returns true if If-None-Match of the request has the ETag
+ */
+bool is_request_etag_matched(const HTTPResponse *response, const char *etag);
+
+/**
+ * Makes the response cacheable: it gets the ETag, Cache-Control with
+ * max_age in seconds, or no-cache for HTTP_NO_MAX_AGE, and Vary: Accept.
+ * Returns true if If-None-Match of the request has the ETag: the server
+ * then responds 304 without a body, so the handler doesn't need to render
+ * one. Can't be used with a shared response.
+ */
+bool set_response_cache(
+    HTTPResponse *response, const char *etag, long max_age
+);
+
+/**
+ * Forbids storing the response: it gets Cache-Control: no-store and no
+ * ETag, so every request is answered anew. For the answers that differ
+ * between requests, such as the hosts returned in turn.
+ */
+void set_response_no_store(HTTPResponse *response);
+
+/**
+ * Suspends the request instead of responding to it. The handler is called
+ * again for the same request after MHD_resume_connection, with the same
+ * context, and then responds or suspends the request again.
+ * Suspended requests must be resumed before stop_http_server.
+ */
+void suspend_request(HTTPResponse *response);
+
+/**
+ * Number of the status codes counted separately by the request metrics
+ */
+# define REQUEST_STATUSES_CNT 5
+
+/**
+ * Status codes counted separately by the request metrics:
+ * 200, 304, 400, 404 and 500
+ */
+extern const unsigned int request_metrics_statuses[REQUEST_STATUSES_CNT];
+
+/**
+ * Metrics of the requests to a route summed over all http threads.
+ * A request is measured from the call of its handler by mhd, right after
+ * the headers are parsed, to the response queued. A suspended request is
+ * measured from its last resume.
+ */
+typedef struct RequestMetricsSnapshot {
+    // Route, nullptr for the requests to unknown routes
+    const char *method;
+    const char *path;
+
+    // Time of the handler
+    LatencySnapshot handler_duration;
+
+    // Time from the call of the handler to the response queued
+    LatencySnapshot request_duration;
+
+    // Responses by request_metrics_statuses, the last one counts the others
+    unsigned long long statuses[REQUEST_STATUSES_CNT + 1];
+} RequestMetricsSnapshot;
+
+/**
+ * Returns the number of the routes with metrics, see read_request_metrics.
+ * 0 before the server is started.
+ */
+unsigned int get_request_metrics_cnt(void);
+
+/**
+ * Sums the metrics of the route from all shards into the snapshot.
+ * The last route is not_found with the nullptr path.
+ * The shards are read without stopping the writers, so the snapshot may
+ * miss the requests being recorded.
+ */
+void read_request_metrics(
+    unsigned int route, RequestMetricsSnapshot *snapshot
+);
+
+/**
+ * Allocates the metrics of the routes: a shard for each of the threads
+ * of the server and a shared one.
+ */
+void init_request_metrics(
+    const Route *routes, unsigned int routes_cnt, unsigned int threads
+);
+
+/**
+ * Records a request answered by the route, routes_cnt for not_found:
+ * the time of its handler and of the whole request in ns,
+ * and the status code of the response
+ */
+void record_request(
+    unsigned int route,
+    unsigned int status_code,
+    unsigned long long handler_ns,
+    unsigned long long request_ns
+);
+
 #endif //PG_STATUS_HTTP_SERVER_H
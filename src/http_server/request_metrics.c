@@ -0,0 +1,185 @@
+#include "http_server.h"
+
+#include "utils.h"
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Status codes counted separately, the others are counted together,
+ * see RouteMetrics.statuses
+ */
+const unsigned int request_metrics_statuses[REQUEST_STATUSES_CNT] = {
+    MHD_HTTP_OK,
+    MHD_HTTP_NOT_MODIFIED,
+    MHD_HTTP_BAD_REQUEST,
+    MHD_HTTP_NOT_FOUND,
+    MHD_HTTP_INTERNAL_SERVER_ERROR,
+};
+
+/**
+ * Metrics of one route written by the threads of one shard
+ */
+typedef struct RouteMetrics {
+    LatencyHistogram handler_duration;
+    LatencyHistogram request_duration;
+
+    // Responses by request_metrics_statuses, the last one counts the others
+    _Atomic(unsigned long long) statuses[REQUEST_STATUSES_CNT + 1];
+} RouteMetrics;
+
+/**
+ * Metrics of all routes, split into shards.
+ * Each http thread writes a shard of its own with plain stores, so the
+ * requests share no cache lines and take no locked instructions.
+ * The last shard is shared by the threads that came after the others
+ * were taken and is written with atomic increments.
+ */
+typedef struct RequestMetrics {
+    // Routes of the server and not_found, the last one
+    const Route *routes;
+    unsigned int routes_cnt;
+
+    // shards_cnt arrays of routes_cnt + 1 RouteMetrics each
+    RouteMetrics **shards;
+    unsigned int shards_cnt;
+} RequestMetrics;
+
+RequestMetrics request_metrics = {
+    .routes = nullptr,
+    .routes_cnt = 0,
+    .shards = nullptr,
+    .shards_cnt = 0,
+};
+
+/**
+ * Number of the threads that have recorded a request.
+ * Only used to give each thread its own shard.
+ */
+_Atomic(unsigned int) request_metrics_threads = 0;
+
+/**
+ * Shard of the current thread. UINT_MAX until the first request
+ */
+_Thread_local unsigned int request_metrics_shard = UINT_MAX;
+
+
+/**
+ * Allocates the metrics of the routes: a shard for each of the threads
+ * of the server and a shared one.
+ */
+void init_request_metrics(
+    const Route *routes,
+    const unsigned int routes_cnt,
+    const unsigned int threads
+) {
+    request_metrics.routes = routes;
+    request_metrics.routes_cnt = routes_cnt;
+    request_metrics.shards_cnt = threads + 1;
+    request_metrics.shards = malloc(
+        request_metrics.shards_cnt * sizeof(RouteMetrics *)
+    );
+    if (!request_metrics.shards) {
+        raise_error("Can't allocate memory for request metrics");
+    }
+
+    for (unsigned int i = 0; i < request_metrics.shards_cnt; i++) {
+        request_metrics.shards[i] = cache_aligned_calloc(
+            (routes_cnt + 1) * sizeof(RouteMetrics)
+        );
+    }
+}
+
+/**
+ * Returns the shard of the current thread.
+ * Threads get the exclusive shards in turn, the first time they record
+ * a request, then all of them get the shared one.
+ */
+unsigned int get_request_metrics_shard(void) {
+    if (request_metrics_shard == UINT_MAX) {
+        const unsigned int thread = atomic_fetch_add_explicit(
+            &request_metrics_threads, 1, memory_order_relaxed
+        );
+        const unsigned int shared = request_metrics.shards_cnt - 1;
+        request_metrics_shard = thread < shared ? thread : shared;
+    }
+    return request_metrics_shard;
+}
+
+/**
+ * Returns the index of the status code in RouteMetrics.statuses
+ */
+unsigned int request_status_index(const unsigned int status_code) {
+    for (unsigned int i = 0; i < REQUEST_STATUSES_CNT; i++) {
+        if (request_metrics_statuses[i] == status_code) {
+            return i;
+        }
+    }
+    return REQUEST_STATUSES_CNT;
+}
+
+/**
+ * Records a request answered by the route, routes_cnt for not_found:
+ * the time of its handler and of the whole request in ns,
+ * and the status code of the response
+ */
+void record_request(
+    const unsigned int route,
+    const unsigned int status_code,
+    const unsigned long long handler_ns,
+    const unsigned long long request_ns
+) {
+    if (!request_metrics.shards) {
+        return;
+    }
+
+    const unsigned int shard = get_request_metrics_shard();
+    const bool exclusive = shard < request_metrics.shards_cnt - 1;
+    RouteMetrics *metrics = &request_metrics.shards[shard][route];
+
+    latency_record(&metrics -> handler_duration, handler_ns, exclusive);
+    latency_record(&metrics -> request_duration, request_ns, exclusive);
+    counter_add(
+        &metrics -> statuses[request_status_index(status_code)], 1, exclusive
+    );
+}
+
+/**
+ * Returns the number of the routes with metrics, see read_request_metrics.
+ * 0 before the server is started.
+ */
+unsigned int get_request_metrics_cnt(void) {
+    return request_metrics.shards ? request_metrics.routes_cnt + 1 : 0;
+}
+
+/**
+ * Sums the metrics of the route from all shards into the snapshot.
+ * The last route is not_found with the nullptr path.
+ * The shards are read without stopping the writers, so the snapshot may
+ * miss the requests being recorded.
+ */
+void read_request_metrics(
+    const unsigned int route, RequestMetricsSnapshot *snapshot
+) {
+    memset(snapshot, 0, sizeof(RequestMetricsSnapshot));
+    if (route < request_metrics.routes_cnt) {
+        snapshot -> method = request_metrics.routes[route].method;
+        snapshot -> path = request_metrics.routes[route].path;
+    }
+
+    for (unsigned int i = 0; i < request_metrics.shards_cnt; i++) {
+        const RouteMetrics *metrics = &request_metrics.shards[i][route];
+        latency_snapshot_add(
+            &snapshot -> handler_duration, &metrics -> handler_duration
+        );
+        latency_snapshot_add(
+            &snapshot -> request_duration, &metrics -> request_duration
+        );
+        for (unsigned int j = 0; j <= REQUEST_STATUSES_CNT; j++) {
+            snapshot -> statuses[j] += atomic_load_explicit(
+                &metrics -> statuses[j], memory_order_relaxed
+            );
+        }
+    }
+}
@@ -0,0 +1,467 @@
+#include "metrics.h"
+#include "http_server.h"
+#include "pg_monitor.h"
+#include "utils.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+/**
+ * Histograms of HostMetrics exposed for every host
+ */
+typedef struct HostHistogram {
+    const char *name;
+    const char *help;
+
+    // Offset of the histogram in MonitorHost
+    size_t offset;
+} HostHistogram;
+
+const HostHistogram host_histograms[] = {
+    {
+        "pg_status_connect_duration_seconds",
+        "Time to establish a connection to the host.",
+        offsetof(MonitorHost, metrics.connect_duration),
+    },
+    {
+        "pg_status_query_duration_seconds",
+        "Round trip of the status query.",
+        offsetof(MonitorHost, metrics.query_duration),
+    },
+    {
+        "pg_status_probe_duration_seconds",
+        "Time from the start of the probe of the host to its end.",
+        offsetof(MonitorHost, metrics.probe_duration),
+    },
+};
+
+# define HOST_HISTOGRAMS_CNT \
+    (sizeof(host_histograms) / sizeof(host_histograms[0]))
+
+/**
+ * Quantiles of the request durations
+ */
+const double request_quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+# define REQUEST_QUANTILES_CNT \
+    (sizeof(request_quantiles) / sizeof(request_quantiles[0]))
+
+
+/**
+ * Writes the label value escaped as the text format requires
+ */
+void write_label_value(FILE *out, const char *value) {
+    for (; *value; value++) {
+        switch (*value) {
+            case '\\': fputs("\\\\", out); break;
+            case '"': fputs("\\\"", out); break;
+            case '\n': fputs("\\n", out); break;
+            default: fputc(*value, out);
+        }
+    }
+}
+
+/**
+ * Writes the labels of the cluster, and of the host unless it is nullptr,
+ * without the braces
+ */
+void write_labels(
+    FILE *out, const MonitorCluster *cluster, const MonitorHost *host
+) {
+    fputs("cluster=\"", out);
+    write_label_value(out, cluster -> name);
+    fputc('"', out);
+
+    if (host) {
+        fputs(",host=\"", out);
+        write_label_value(out, host -> host);
+        fputs("\",port=\"", out);
+        write_label_value(out, host -> port);
+        fputc('"', out);
+    }
+}
+
+/**
+ * Writes the HELP and TYPE lines of a metric
+ */
+void write_metric_header(
+    FILE *out, const char *name, const char *type, const char *help
+) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * Writes a sample of the metric of the cluster or of its host
+ */
+void write_sample(
+    FILE *out,
+    const char *name,
+    const MonitorCluster *cluster,
+    const MonitorHost *host,
+    const unsigned long long value
+) {
+    fprintf(out, "%s{", name);
+    write_labels(out, cluster, host);
+    fprintf(out, "} %llu\n", value);
+}
+
+/**
+ * Writes the cumulative buckets, the sum and the count of the histogram
+ * of the cluster or of its host, in seconds
+ */
+void write_histogram(
+    FILE *out,
+    const char *name,
+    const MonitorCluster *cluster,
+    const MonitorHost *host,
+    const Histogram *histogram
+) {
+    unsigned long long count = 0;
+    for (unsigned int i = 0; i <= HISTOGRAM_BUCKETS_CNT; i++) {
+        count += atomic_load_explicit(
+            &histogram -> buckets[i], memory_order_relaxed
+        );
+
+        fprintf(out, "%s_bucket{", name);
+        write_labels(out, cluster, host);
+        if (i < HISTOGRAM_BUCKETS_CNT) {
+            fprintf(
+                out, ",le=\"%g\"} %llu\n",
+                (double) histogram_bounds_us[i] / 1e6, count
+            );
+        }
+        else {
+            fprintf(out, ",le=\"+Inf\"} %llu\n", count);
+        }
+    }
+
+    const unsigned long long sum_us = atomic_load_explicit(
+        &histogram -> sum_us, memory_order_relaxed
+    );
+    fprintf(out, "%s_sum{", name);
+    write_labels(out, cluster, host);
+    fprintf(out, "} %.6f\n", (double) sum_us / 1e6);
+
+    fprintf(out, "%s_count{", name);
+    write_labels(out, cluster, host);
+    fprintf(out, "} %llu\n", count);
+}
+
+/**
+ * Writes the histograms of the checks of the clusters
+ */
+void write_check_durations(FILE *out) {
+    const char *name = "pg_status_check_duration_seconds";
+    write_metric_header(
+        out, name, "histogram",
+        "Time to probe the hosts of the cluster and publish its topology."
+    );
+    for (unsigned int i = 0; i < get_clusters_cnt(); i++) {
+        const MonitorCluster *cluster = get_cluster(i);
+        write_histogram(
+            out, name, cluster, nullptr, &cluster -> check_duration
+        );
+    }
+}
+
+/**
+ * Writes the probe histograms of all hosts
+ */
+void write_host_histograms(FILE *out) {
+    for (unsigned int i = 0; i < HOST_HISTOGRAMS_CNT; i++) {
+        const HostHistogram *metric = &host_histograms[i];
+        write_metric_header(out, metric -> name, "histogram", metric -> help);
+
+        for (unsigned int j = 0; j < get_clusters_cnt(); j++) {
+            const MonitorCluster *cluster = get_cluster(j);
+            for (unsigned int k = 0; k < cluster -> hosts_cnt; k++) {
+                const MonitorHost *host = &cluster -> hosts[k];
+                write_histogram(
+                    out, metric -> name, cluster, host,
+                    (const Histogram *)(
+                        (const char *) host + metric -> offset
+                    )
+                );
+            }
+        }
+    }
+}
+
+/**
+ * Writes the failure and role transition counters of all hosts
+ */
+void write_host_counters(FILE *out) {
+    const unsigned int clusters_cnt = get_clusters_cnt();
+
+    write_metric_header(
+        out, "pg_status_probe_failures_total", "counter",
+        "Number of the probes of the host that got no status."
+    );
+    for (unsigned int i = 0; i < clusters_cnt; i++) {
+        const MonitorCluster *cluster = get_cluster(i);
+        for (unsigned int j = 0; j < cluster -> hosts_cnt; j++) {
+            const MonitorHost *host = &cluster -> hosts[j];
+            write_sample(
+                out, "pg_status_probe_failures_total", cluster, host,
+                atomic_load_explicit(
+                    &host -> metrics.failures, memory_order_relaxed
+                )
+            );
+        }
+    }
+
+    write_metric_header(
+        out, "pg_status_consecutive_failures", "gauge",
+        "Number of the probes of the host that got no status in a row."
+    );
+    for (unsigned int i = 0; i < clusters_cnt; i++) {
+        const MonitorCluster *cluster = get_cluster(i);
+        for (unsigned int j = 0; j < cluster -> hosts_cnt; j++) {
+            const MonitorHost *host = &cluster -> hosts[j];
+            write_sample(
+                out, "pg_status_consecutive_failures", cluster, host,
+                atomic_load_explicit(
+                    &host -> metrics.consecutive_failures,
+                    memory_order_relaxed
+                )
+            );
+        }
+    }
+
+    write_metric_header(
+        out, "pg_status_role_transitions_total", "counter",
+        "Number of the changes of the roles the host plays."
+    );
+    for (unsigned int i = 0; i < clusters_cnt; i++) {
+        const MonitorCluster *cluster = get_cluster(i);
+        for (unsigned int j = 0; j < cluster -> hosts_cnt; j++) {
+            const MonitorHost *host = &cluster -> hosts[j];
+            write_sample(
+                out, "pg_status_role_transitions_total", cluster, host,
+                atomic_load_explicit(
+                    &host -> metrics.role_transitions, memory_order_relaxed
+                )
+            );
+        }
+    }
+}
+
+/**
+ * Writes the statuses of all hosts from the published topology snapshots.
+ * Each snapshot is loaded once, so the samples of a cluster are consistent.
+ */
+void write_host_statuses(FILE *out) {
+    const unsigned int clusters_cnt = get_clusters_cnt();
+    const Topology **topologies = malloc(clusters_cnt * sizeof(Topology *));
+    if (!topologies) {
+        raise_error("Can't allocate memory for metrics");
+    }
+    for (unsigned int i = 0; i < clusters_cnt; i++) {
+        topologies[i] = get_topology(get_cluster(i));
+    }
+
+    write_metric_header(
+        out, "pg_status_generation", "gauge",
+        "Generation of the topology of the cluster."
+    );
+    for (unsigned int i = 0; i < clusters_cnt; i++) {
+        write_sample(
+            out, "pg_status_generation", get_cluster(i), nullptr,
+            topologies[i] -> generation
+        );
+    }
+
+    write_metric_header(
+        out, "pg_status_host_alive", "gauge",
+        "Whether the host is alive."
+    );
+    for (unsigned int i = 0; i < clusters_cnt; i++) {
+        const MonitorCluster *cluster = get_cluster(i);
+        for (unsigned int j = 0; j < cluster -> hosts_cnt; j++) {
+            write_sample(
+                out, "pg_status_host_alive", cluster, &cluster -> hosts[j],
+                topologies[i] -> hosts[j].alive ? 1 : 0
+            );
+        }
+    }
+
+    write_metric_header(
+        out, "pg_status_delay_ms", "gauge",
+        "Replication lag of the host in ms."
+    );
+    for (unsigned int i = 0; i < clusters_cnt; i++) {
+        const MonitorCluster *cluster = get_cluster(i);
+        for (unsigned int j = 0; j < cluster -> hosts_cnt; j++) {
+            write_sample(
+                out, "pg_status_delay_ms", cluster, &cluster -> hosts[j],
+                topologies[i] -> hosts[j].delay_ms
+            );
+        }
+    }
+
+    write_metric_header(
+        out, "pg_status_delay_bytes", "gauge",
+        "Replication lag of the host in bytes."
+    );
+    for (unsigned int i = 0; i < clusters_cnt; i++) {
+        const MonitorCluster *cluster = get_cluster(i);
+        for (unsigned int j = 0; j < cluster -> hosts_cnt; j++) {
+            write_sample(
+                out, "pg_status_delay_bytes", cluster, &cluster -> hosts[j],
+                topologies[i] -> hosts[j].delay_bytes
+            );
+        }
+    }
+
+    free(topologies);
+}
+
+/**
+ * Writes the labels of the route of the snapshot, without the braces.
+ * The requests to unknown routes get the route "unknown".
+ */
+void write_route_labels(FILE *out, const RequestMetricsSnapshot *snapshot) {
+    fputs("method=\"", out);
+    write_label_value(out, snapshot -> method ? snapshot -> method : "");
+    fputs("\",route=\"", out);
+    write_label_value(out, snapshot -> path ? snapshot -> path : "unknown");
+    fputc('"', out);
+}
+
+/**
+ * Writes the quantiles, the sum and the count of the durations
+ * of the requests to the route, in seconds
+ */
+void write_summary(
+    FILE *out,
+    const char *name,
+    const RequestMetricsSnapshot *snapshot,
+    const LatencySnapshot *durations
+) {
+    for (unsigned int i = 0; i < REQUEST_QUANTILES_CNT; i++) {
+        fprintf(out, "%s{", name);
+        write_route_labels(out, snapshot);
+        fprintf(
+            out, ",quantile=\"%g\"} %.9f\n", request_quantiles[i],
+            (double) latency_quantile(durations, request_quantiles[i]) / 1e9
+        );
+    }
+
+    fprintf(out, "%s_sum{", name);
+    write_route_labels(out, snapshot);
+    fprintf(out, "} %.9f\n", (double) durations -> sum_ns / 1e9);
+
+    fprintf(out, "%s_count{", name);
+    write_route_labels(out, snapshot);
+    fprintf(out, "} %llu\n", durations -> count);
+}
+
+/**
+ * Writes the durations and the status codes of the requests by route.
+ * The routes without requests are skipped.
+ */
+void write_request_metrics(FILE *out) {
+    const unsigned int routes_cnt = get_request_metrics_cnt();
+    RequestMetricsSnapshot *snapshots = malloc(
+        (routes_cnt + 1) * sizeof(RequestMetricsSnapshot)
+    );
+    if (!snapshots) {
+        raise_error("Can't allocate memory for metrics");
+    }
+    for (unsigned int i = 0; i < routes_cnt; i++) {
+        read_request_metrics(i, &snapshots[i]);
+    }
+
+    write_metric_header(
+        out, "pg_status_http_handler_duration_seconds", "summary",
+        "Time of the handler of the route."
+    );
+    for (unsigned int i = 0; i < routes_cnt; i++) {
+        if (snapshots[i].handler_duration.count) {
+            write_summary(
+                out, "pg_status_http_handler_duration_seconds",
+                &snapshots[i], &snapshots[i].handler_duration
+            );
+        }
+    }
+
+    write_metric_header(
+        out, "pg_status_http_request_duration_seconds", "summary",
+        "Time from the parsed request headers to the queued response."
+    );
+    for (unsigned int i = 0; i < routes_cnt; i++) {
+        if (snapshots[i].request_duration.count) {
+            write_summary(
+                out, "pg_status_http_request_duration_seconds",
+                &snapshots[i], &snapshots[i].request_duration
+            );
+        }
+    }
+
+    write_metric_header(
+        out, "pg_status_http_responses_total", "counter",
+        "Number of the responses of the route by status code."
+    );
+    for (unsigned int i = 0; i < routes_cnt; i++) {
+        for (unsigned int j = 0; j <= REQUEST_STATUSES_CNT; j++) {
+            if (!snapshots[i].statuses[j]) {
+                continue;
+            }
+            fputs("pg_status_http_responses_total{", out);
+            write_route_labels(out, &snapshots[i]);
+            if (j < REQUEST_STATUSES_CNT) {
+                fprintf(out, ",code=\"%u\"", request_metrics_statuses[j]);
+            }
+            else {
+                fputs(",code=\"other\"", out);
+            }
+            fprintf(out, "} %llu\n", snapshots[i].statuses[j]);
+        }
+    }
+
+    free(snapshots);
+}
+
+/**
+ * Writes the number of the log messages dropped because the log was full
+ */
+void write_log_metrics(FILE *out) {
+    write_metric_header(
+        out, "pg_status_log_dropped_total", "counter",
+        "Number of the log messages dropped because the log was full."
+    );
+    fprintf(out, "pg_status_log_dropped_total %llu\n", get_log_dropped());
+}
+
+/**
+ * Renders the metrics of the monitored hosts in the Prometheus text
+ * exposition format: the durations of the probes and the checks,
+ * the failures, the role transitions and the lags, and the metrics
+ * of the http requests by route.
+ * Reads the atomic counters and the published topology snapshots,
+ * so it never blocks the probes nor the requests.
+ * The string must be freed by the caller.
+ */
+char *render_metrics(void) {
+    char *body = nullptr;
+    size_t len = 0;
+    FILE *out = open_memstream(&body, &len);
+    if (!out) {
+        raise_error("Can't allocate memory for metrics");
+    }
+
+    write_check_durations(out);
+    write_host_histograms(out);
+    write_host_counters(out);
+    write_host_statuses(out);
+    write_request_metrics(out);
+    write_log_metrics(out);
+
+    if (fclose(out) != 0) {
+        raise_error("Can't render metrics");
+    }
+    return body;
+}
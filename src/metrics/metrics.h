@@ -0,0 +1,20 @@
+#ifndef PG_STATUS_METRICS_H
+#define PG_STATUS_METRICS_H
+
+/**
+ * Content type of the Prometheus text exposition format
+ */
+# define METRICS_CONTENT_TYPE "text/plain; version=0.0.4; charset=utf-8"
+
+/**
+ * Renders the metrics of the monitored hosts in the Prometheus text
+ * exposition format: the durations of the probes and the checks,
+ * the failures, the role transitions and the lags, and the metrics
+ * of the http requests by route.
+ * Reads the atomic counters and the published topology snapshots,
+ * so it never blocks the probes nor the requests.
+ * The string must be freed by the caller.
+ */
+char *render_metrics(void);
+
+#endif //PG_STATUS_METRICS_H
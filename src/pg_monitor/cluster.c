@@ -0,0 +1,461 @@
+#include "pg_monitor.h"
+#include "utils.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * pg-monitor parameters. The default parameters are set here.
+ * Each cluster starts with a copy of them.
+ */
+MonitorParameters parameters = {
+    .user = "postgres",
+    .password = "postgres",
+    .database = "postgres",
+    .hosts_delimiter = ",",
+    .hosts = nullptr,
+    .port = "5432",
+    .connect_timeout = "2",
+    .connect_timeout_ms = 0,
+    .sleep = 5,
+    .sleep_ms = 0,
+    .fast_sleep_ms = 1000,
+    .max_fails = 3,
+    .prepare_query = 1,
+    .sync_max_lag_ms = 1000,
+    .sync_max_lag_bytes = 1000000,  // 1 mb
+};
+
+/**
+ * Names of the clusters, separated by hosts_delimiter
+ */
+char *cluster_names = nullptr;
+
+/**
+ * Array of the monitored clusters
+ */
+MonitorCluster *monitor_clusters = nullptr;
+unsigned int monitor_clusters_cnt = 0;
+
+/**
+ * Open addressing hash table of the clusters by name.
+ * Its size is a power of two, at least twice the number of clusters.
+ */
+MonitorCluster **clusters_table = nullptr;
+size_t clusters_table_mask = 0;
+
+
+/**
+ * Takes a value from the environment variable {prefix}{name} if it is set,
+ * pastes it by the result pointer.
+ */
+void replace_parameter(const char *prefix, const char *name, char **result) {
+    char *env_name = concatenate_strings(prefix, name);
+    replace_from_env(env_name, result);
+    free(env_name);
+}
+
+/**
+ * Takes a value from the environment variable {prefix}{name} if it is set,
+ * pastes it by the result pointer.
+ */
+void replace_parameter_uint(
+    const char *prefix, const char *name, unsigned int *result
+) {
+    char *env_name = concatenate_strings(prefix, name);
+    replace_from_env_uint(env_name, result);
+    free(env_name);
+}
+
+/**
+ * Takes a value from the environment variable {prefix}{name} if it is set,
+ * pastes it by the result pointer.
+ */
+void replace_parameter_ull(
+    const char *prefix, const char *name, unsigned long long *result
+) {
+    char *env_name = concatenate_strings(prefix, name);
+    replace_from_env_ull(env_name, result);
+    free(env_name);
+}
+
+/**
+ * Overrides parameters if they are set in environment variables
+ * with the given prefix. For example: pg_status__pg_user.
+ */
+void get_values_from_env(MonitorParameters *params, const char *prefix) {
+    replace_parameter(prefix, "pg_user", &params -> user);
+    replace_parameter(prefix, "pg_database", &params -> database);
+    replace_parameter(prefix, "pg_password", &params -> password);
+    replace_parameter(prefix, "delimiter", &params -> hosts_delimiter);
+    replace_parameter(
+        prefix, "connect_timeout", &params -> connect_timeout
+    );
+    replace_parameter(prefix, "port", &params -> port);
+    replace_parameter(prefix, "hosts", &params -> hosts);
+    replace_parameter_uint(prefix, "sleep", &params -> sleep);
+    replace_parameter_ull(prefix, "sleep_ms", &params -> sleep_ms);
+    replace_parameter_ull(
+        prefix, "fast_sleep_ms", &params -> fast_sleep_ms
+    );
+    replace_parameter_uint(prefix, "max_fails", &params -> max_fails);
+    replace_parameter_uint(
+        prefix, "prepare_query", &params -> prepare_query
+    );
+    replace_parameter_ull(
+        prefix, "sync_max_lag_ms", &params -> sync_max_lag_ms
+    );
+    replace_parameter_ull(
+        prefix, "sync_max_lag_bytes", &params -> sync_max_lag_bytes
+    );
+}
+
+/**
+ * Calculates the parameters that derive from the others and checks
+ * the required ones
+ */
+void finalize_parameters(MonitorParameters *params, const char *cluster) {
+    if (params -> sleep_ms == 0) {
+        params -> sleep_ms = (unsigned long long)params -> sleep * 1000;
+    }
+    if (params -> fast_sleep_ms > params -> sleep_ms) {
+        params -> fast_sleep_ms = params -> sleep_ms;
+    }
+    params -> connect_timeout_ms = (
+        str_to_ull(params -> connect_timeout) * 1000
+    );
+
+    if (params -> hosts == nullptr) {
+        raise_error("pg_status__hosts not set for cluster %s", cluster);
+    }
+    if (params -> sleep_ms < MIN_CHECK_INTERVAL_MS) {
+        raise_error(
+            "pg_status__sleep_ms must be at least %d for cluster %s",
+            MIN_CHECK_INTERVAL_MS, cluster
+        );
+    }
+    if (params -> fast_sleep_ms < MIN_CHECK_INTERVAL_MS) {
+        raise_error(
+            "pg_status__fast_sleep_ms must be at least %d for cluster %s",
+            MIN_CHECK_INTERVAL_MS, cluster
+        );
+    }
+}
+
+/**
+ * Returns the number of tokens in the string separated by delimiter
+ */
+unsigned int count_tokens(const char *str, const char *delimiter) {
+    char *copy = strdup(str);
+    char *save_ptr = nullptr;
+    unsigned int cnt = 0;
+
+    char *token = strtok_r(copy, delimiter, &save_ptr);
+    while (token) {
+        cnt++;
+        token = strtok_r(nullptr, delimiter, &save_ptr);
+    }
+
+    free(copy);
+    return cnt;
+}
+
+/**
+ * Returns the string to connect to pg
+ */
+char *get_connection_string(
+    const MonitorParameters *params, char *host, char *port
+) {
+    return format_string(
+        "user=%s password=%s host=%s port=%s "
+        "dbname=%s connect_timeout=%s",
+        params -> user, params -> password, host, port,
+        params -> database, params -> connect_timeout
+    );
+}
+
+/**
+ * Initializes MonitorHost to its initial value.
+ */
+void init_monitor_host(
+    MonitorHost *monitor_host,
+    const MonitorParameters *params,
+    char *host,
+    char *port
+) {
+    monitor_host -> host = strdup(host);
+    monitor_host -> port = strdup(port);
+    monitor_host -> connection_str = get_connection_string(params, host, port);
+    monitor_host -> failed_connections = 0;
+    monitor_host -> conn = nullptr;
+    monitor_host -> query_prepared = false;
+    monitor_host -> reconnect_at_ms = 0;
+    monitor_host -> reconnect_backoff_ms = 0;
+    monitor_host -> wal_lsn = 0;
+    monitor_host -> replay_lsn = 0;
+}
+
+/**
+ * Initializes the array of cluster hosts to its initial value.
+ *
+ * When there are fewer ports than hosts, the last port is used for
+ * the rest of the hosts. This allows a single port to be used for all hosts.
+ */
+void init_monitor_hosts(MonitorCluster *cluster) {
+    const MonitorParameters *params = &cluster -> parameters;
+    const char *delimiter = params -> hosts_delimiter;
+
+    cluster -> hosts_cnt = count_tokens(params -> hosts, delimiter);
+    if (cluster -> hosts_cnt == 0) {
+        raise_error("pg_status__hosts contains no hosts");
+    }
+    cluster -> hosts = cache_aligned_calloc(
+        cluster -> hosts_cnt * sizeof(MonitorHost)
+    );
+
+    char *hosts = strdup(params -> hosts);
+    char *ports = strdup(params -> port);
+    char *hosts_save_ptr = nullptr;
+    char *ports_save_ptr = nullptr;
+
+    char *host = strtok_r(hosts, delimiter, &hosts_save_ptr);
+    char *port = strtok_r(ports, delimiter, &ports_save_ptr);
+    char *last_port = port;
+
+    for (unsigned int i = 0; i < cluster -> hosts_cnt; i++) {
+        init_monitor_host(&cluster -> hosts[i], params, host, last_port);
+
+        host = strtok_r(nullptr, delimiter, &hosts_save_ptr);
+        port = strtok_r(nullptr, delimiter, &ports_save_ptr);
+        if (port != nullptr) {
+            last_port = port;
+        }
+    }
+
+    free(hosts);
+    free(ports);
+}
+
+/**
+ * Allocates a topology snapshot of the cluster in which all hosts are dead
+ * and no host plays any role
+ */
+Topology *init_topology(const MonitorCluster *cluster) {
+    const unsigned int hosts_cnt = cluster -> hosts_cnt;
+    Topology *topology = cache_aligned_calloc(
+        sizeof(Topology) +
+        hosts_cnt * sizeof(MonitorStatus) +
+        HOST_ROLES_CNT * hosts_cnt * sizeof(unsigned int)
+    );
+    topology -> parameters = &cluster -> parameters;
+    topology -> generation = 0;
+    topology -> next_check_ms = 0;
+    topology -> master = TOPOLOGY_NO_HOST;
+    topology -> hosts_cnt = cluster -> hosts_cnt;
+
+    for (unsigned int i = 0; i < hosts_cnt; i++) {
+        MonitorStatus *status = &topology -> hosts[i];
+        status -> host = cluster -> hosts[i].host;
+        status -> delay_ms = 0;
+        status -> delay_bytes = 0;
+        status -> is_master = false;
+        status -> alive = false;
+        status -> roles = 0;
+    }
+
+    // The role indexes follow the statuses in the same allocation
+    unsigned int *role_hosts = (unsigned int *)&topology -> hosts[hosts_cnt];
+    for (unsigned int role = 0; role < HOST_ROLES_CNT; role++) {
+        topology -> roles[role].cnt = 0;
+        topology -> roles[role].hosts = &role_hosts[role * hosts_cnt];
+    }
+    return topology;
+}
+
+/**
+ * Copies the topology snapshot into one allocated with init_topology
+ * for the same cluster. The copy owns its role indexes, so it stays
+ * intact when the buffer of the snapshot is reused.
+ */
+void copy_topology(Topology *copy, const Topology *topology) {
+    const unsigned int hosts_cnt = topology -> hosts_cnt;
+    copy -> generation = topology -> generation;
+    copy -> next_check_ms = topology -> next_check_ms;
+    copy -> master = topology -> master;
+    memcpy(copy -> hosts, topology -> hosts, hosts_cnt * sizeof(MonitorStatus));
+
+    for (unsigned int role = 0; role < HOST_ROLES_CNT; role++) {
+        copy -> roles[role].cnt = topology -> roles[role].cnt;
+        memcpy(
+            copy -> roles[role].hosts, topology -> roles[role].hosts,
+            topology -> roles[role].cnt * sizeof(unsigned int)
+        );
+    }
+}
+
+/**
+ * Initializes the cluster: its parameters, hosts and the initial topology
+ */
+void init_cluster(
+    MonitorCluster *cluster, const unsigned int index, const char *name
+) {
+    cluster -> name = strdup(name);
+    cluster -> name_len = strlen(name);
+    cluster -> index = index;
+    cluster -> parameters = parameters;
+
+    if (!is_equal_strings(name, DEFAULT_CLUSTER_NAME)) {
+        char *prefix = format_string("pg_status__%s__", name);
+        get_values_from_env(&cluster -> parameters, prefix);
+        free(prefix);
+    }
+    finalize_parameters(&cluster -> parameters, name);
+
+    init_monitor_hosts(cluster);
+
+    cluster -> topology_buffers = malloc(sizeof(TopologyBuffer));
+    if (!cluster -> topology_buffers) {
+        raise_error("Can't allocate memory for topology");
+    }
+    cluster -> topology_buffers[0].topology = init_topology(cluster);
+    cluster -> topology_buffers[0].retired_epoch = 0;
+    cluster -> topology_buffers_cnt = 1;
+    atomic_init(&cluster -> topology, cluster -> topology_buffers[0].topology);
+    // Shards start at different hosts, so that threads that have just
+    // started don't all pick the first host of the role
+    for (unsigned int i = 0; i < SELECTION_SHARDS; i++) {
+        for (unsigned int role = 0; role < HOST_ROLES_CNT; role++) {
+            atomic_init(&cluster -> selection[i].cursors[role], i);
+        }
+    }
+
+    cluster -> next_check_ms = 0;
+    cluster -> fast_cycles_left = 0;
+}
+
+/**
+ * Hashes the cluster name with FNV-1a
+ */
+size_t hash_cluster_name(const char *name, const size_t name_len) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < name_len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 1099511628211ULL;
+    }
+    return (size_t)hash;
+}
+
+/**
+ * Builds the hash table of the clusters by name
+ */
+void index_clusters(void) {
+    size_t size = 2;
+    while (size < (size_t)monitor_clusters_cnt * 2) {
+        size *= 2;
+    }
+    clusters_table = calloc(size, sizeof(MonitorCluster *));
+    if (!clusters_table) {
+        raise_error("Can't allocate memory for clusters");
+    }
+    clusters_table_mask = size - 1;
+
+    for (unsigned int i = 0; i < monitor_clusters_cnt; i++) {
+        MonitorCluster *cluster = &monitor_clusters[i];
+        if (find_cluster(cluster -> name, cluster -> name_len)) {
+            raise_error("Cluster %s is specified twice", cluster -> name);
+        }
+
+        size_t index = (
+            hash_cluster_name(cluster -> name, cluster -> name_len) &
+            clusters_table_mask
+        );
+        while (clusters_table[index]) {
+            index = (index + 1) & clusters_table_mask;
+        }
+        clusters_table[index] = cluster;
+    }
+}
+
+/**
+ * Reads the parameters from the environment variables and initializes
+ * the clusters with their hosts.
+ *
+ * Without pg_status__clusters, a single cluster is monitored with
+ * the pg_status__* parameters. Otherwise, each cluster from the list
+ * takes its parameters from pg_status__{cluster}__*, falling back to
+ * pg_status__*.
+ */
+void init_clusters(void) {
+    get_values_from_env(&parameters, "pg_status__");
+    replace_from_env("pg_status__clusters", &cluster_names);
+
+    if (cluster_names == nullptr) {
+        cluster_names = DEFAULT_CLUSTER_NAME;
+    }
+
+    monitor_clusters_cnt = count_tokens(
+        cluster_names, parameters.hosts_delimiter
+    );
+    if (monitor_clusters_cnt == 0) {
+        raise_error("pg_status__clusters contains no clusters");
+    }
+    monitor_clusters = cache_aligned_calloc(
+        monitor_clusters_cnt * sizeof(MonitorCluster)
+    );
+
+    char *names = strdup(cluster_names);
+    char *save_ptr = nullptr;
+    char *name = strtok_r(names, parameters.hosts_delimiter, &save_ptr);
+    for (unsigned int i = 0; i < monitor_clusters_cnt; i++) {
+        init_cluster(&monitor_clusters[i], i, name);
+        name = strtok_r(nullptr, parameters.hosts_delimiter, &save_ptr);
+    }
+    free(names);
+
+    index_clusters();
+}
+
+/**
+ * Returns the number of monitored clusters
+ */
+unsigned int get_clusters_cnt(void) {
+    return monitor_clusters_cnt;
+}
+
+/**
+ * Returns the cluster by its position in pg_status__clusters
+ */
+MonitorCluster *get_cluster(const unsigned int index) {
+    return &monitor_clusters[index];
+}
+
+/**
+ * Returns the cluster served by the routes without a cluster name.
+ * This is the first cluster in pg_status__clusters.
+ */
+MonitorCluster *get_default_cluster(void) {
+    return &monitor_clusters[0];
+}
+
+/**
+ * Searches for the cluster by name in O(1).
+ * The name doesn't have to be null-terminated.
+ * Returns nullptr if there is no such cluster.
+ */
+MonitorCluster *find_cluster(const char *name, const size_t name_len) {
+    size_t index = hash_cluster_name(name, name_len) & clusters_table_mask;
+
+    while (clusters_table[index]) {
+        MonitorCluster *cluster = clusters_table[index];
+        if (
+            cluster -> name_len == name_len &&
+            memcmp(cluster -> name, name, name_len) == 0
+        ) {
+            return cluster;
+        }
+        index = (index + 1) & clusters_table_mask;
+    }
+    return nullptr;
+}
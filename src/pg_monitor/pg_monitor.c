@@ -1,6 +1,7 @@
 #include "pg_monitor.h"
 #include "utils.h"
 
+#include <limits.h>
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdio.h>
@@ -14,243 +15,221 @@
  * Parameters for stopping a thread
  */
 static pthread_mutex_t monitor_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  monitor_cond  = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  monitor_cond;
 static bool monitor_running = true;
 static pthread_t monitor_tid;
 
 /**
- * A pointer to the head of the linked list of hosts
+ * Functions called after every published topology snapshot
  */
-MonitorHost *monitor_host_head = nullptr;
+topology_listener topology_listeners[TOPOLOGY_LISTENERS_MAX];
+unsigned int topology_listeners_cnt = 0;
 
 /**
- * A pointer to the last replica returned in the round-robin algorithm
+ * Adds a function called after every published topology snapshot.
+ * It is called from the monitoring thread, and for the initial snapshots
+ * of the clusters from start_pg_monitor, so it must be added before.
  */
-_Atomic (MonitorHost *) last_random_replica = nullptr;
-
-/**
- * pg-monitor parameters. The default parameters are set here.
- */
-MonitorParameters parameters = {
-    .user = "postgres",
-    .password = "postgres",
-    .database = "postgres",
-    .hosts_delimiter = ",",
-    .hosts = nullptr,
-    .port = "5432",
-    .connect_timeout = "2",
-    .sleep = 5,
-    .max_fails = 3,
-    .sync_max_lag_ms = 1000,
-    .sync_max_lag_bytes = 1000000,  // 1 mb
-};
-
-/**
- * Returns a pointer to the head of the linked list of hosts.
- */
-MonitorHost *get_monitor_host_head(void) {
-    return monitor_host_head;
+void add_topology_listener(const topology_listener listener) {
+    if (topology_listeners_cnt == TOPOLOGY_LISTENERS_MAX) {
+        raise_error("Too many topology listeners");
+    }
+    topology_listeners[topology_listeners_cnt++] = listener;
 }
 
 /**
- * Overrides default parameters if they are set in environment variables.
+ * Calls the listeners of the published topology snapshot in the order
+ * they were added
  */
-void get_values_from_env(void) {
-    replace_from_env("pg_status__pg_user", &parameters.user);
-    replace_from_env("pg_status__pg_database", &parameters.database);
-    replace_from_env("pg_status__pg_password", &parameters.password);
-    replace_from_env("pg_status__delimiter", &parameters.hosts_delimiter);
-    replace_from_env("pg_status__connect_timeout", &parameters.connect_timeout);
-    replace_from_env("pg_status__port", &parameters.port);
-    replace_from_env_uint("pg_status__sleep", &parameters.sleep);
-    replace_from_env_uint("pg_status__max_fails", &parameters.max_fails);
-    replace_from_env_ull(
-        "pg_status__sync_max_lag_ms", &parameters.sync_max_lag_ms
-    );
-    replace_from_env_ull(
-        "pg_status__sync_max_lag_bytes", &parameters.sync_max_lag_bytes
-    );
-
-    replace_from_env("pg_status__hosts", &parameters.hosts);
-    if (parameters.hosts == nullptr) {
-        raise_error("pg_status__hosts not set");
+void notify_topology_published(
+    const MonitorCluster *cluster, const Topology *topology
+) {
+    for (unsigned int i = 0; i < topology_listeners_cnt; i++) {
+        topology_listeners[i](cluster, topology);
     }
 }
 
 /**
- * Returns hosts sequentially. When no more hosts are available,
- * it returns nullptr.
+ * Atomically returns the last published topology snapshot of the cluster.
+ * Must be called inside a read section, see enter_read_section:
+ * the snapshot stays intact until the section is left.
+ * The monitoring thread, which publishes the snapshots, needs none.
  */
-char *next_host(char *hosts) {
-    static char *save_ptr = nullptr;
-    static char *host = nullptr;
-
-    if (host == nullptr) {
-        host = strtok_r(hosts, parameters.hosts_delimiter, &save_ptr);
-    }
-    else {
-        host = strtok_r(nullptr, parameters.hosts_delimiter, &save_ptr);
-    }
-    return host;
+const Topology *get_topology(const MonitorCluster *cluster) {
+    return atomic_load_explicit(&cluster -> topology, memory_order_acquire);
 }
 
 /**
- * Returns ports sequentially. When no more ports are available,
- * it continues returning the last one.
- * This allows a single port to be used for all hosts.
+ * Returns a buffer in which the next topology snapshot of the cluster
+ * can be built: a retired one no read section can still see,
+ * or a new one if the readers may still hold all of them.
+ *
+ * Read sections are short, so two buffers take turns. More are added
+ * only while a reader is stalled inside its section, and the ones left
+ * over are freed once it has left.
  */
-char *next_port(char *ports) {
-    static char *last_port = nullptr;
-    static char *save_ptr = nullptr;
-    static char *port = nullptr;
-
-    if (port == nullptr) {
-        port = strtok_r(ports, parameters.hosts_delimiter, &save_ptr);
+Topology *take_topology_buffer(MonitorCluster *cluster) {
+    const Topology *published = get_topology(cluster);
+    Topology *free_topology = nullptr;
+
+    unsigned int i = 0;
+    while (i < cluster -> topology_buffers_cnt) {
+        TopologyBuffer *buffer = &cluster -> topology_buffers[i];
+        const bool reclaimable = (
+            buffer -> topology != published && (
+                buffer -> retired_epoch == 0 ||
+                is_epoch_reclaimable(buffer -> retired_epoch)
+            )
+        );
+
+        if (reclaimable && !free_topology) {
+            free_topology = buffer -> topology;
+        }
+        else if (reclaimable && cluster -> topology_buffers_cnt > 2) {
+            free(buffer -> topology);
+            *buffer = cluster -> topology_buffers[
+                --cluster -> topology_buffers_cnt
+            ];
+            continue;
+        }
+        i++;
     }
-    else {
-        port = strtok_r(nullptr, parameters.hosts_delimiter, &save_ptr);
+    if (free_topology) {
+        return free_topology;
     }
 
-    if (port != nullptr) {
-        last_port = port;
+    TopologyBuffer *buffers = realloc(
+        cluster -> topology_buffers,
+        (cluster -> topology_buffers_cnt + 1) * sizeof(TopologyBuffer)
+    );
+    if (!buffers) {
+        raise_error("Can't allocate memory for topology");
     }
-    return last_port;
+    cluster -> topology_buffers = buffers;
+
+    TopologyBuffer *buffer = &buffers[cluster -> topology_buffers_cnt++];
+    buffer -> topology = init_topology(cluster);
+    buffer -> retired_epoch = 0;
+    return buffer -> topology;
 }
 
 /**
- * Returns the string to connect to pg
+ * Publishes the topology snapshot built in a buffer from
+ * take_topology_buffer with a single atomic store and retires
+ * the previous one. The listeners are not notified.
  */
-char *get_connection_string(char *host, char *port) {
-    return format_string(
-        "user=%s password=%s host=%s port=%s "
-        "dbname=%s connect_timeout=%s",
-        parameters.user, parameters.password, host, port,
-        parameters.database, parameters.connect_timeout
+void publish_topology(MonitorCluster *cluster, Topology *topology) {
+    const Topology *previous = get_topology(cluster);
+    atomic_store_explicit(
+        &cluster -> topology, topology, memory_order_release
     );
+
+    const unsigned long long epoch = retire_epoch();
+    for (unsigned int i = 0; i < cluster -> topology_buffers_cnt; i++) {
+        TopologyBuffer *buffer = &cluster -> topology_buffers[i];
+        if (buffer -> topology == previous) {
+            buffer -> retired_epoch = epoch;
+        }
+        else if (buffer -> topology == topology) {
+            buffer -> retired_epoch = 0;
+        }
+    }
 }
 
 /**
- * Initializes MonitorStatus to its initial value.
+ * Returns the name of the host by its index in a topology snapshot,
+ * or nullptr for TOPOLOGY_NO_HOST
  */
-MonitorStatus *init_monitor_status(void) {
-    MonitorStatus *status = malloc(sizeof(MonitorStatus));
-    status -> delay_ms = 0;
-    status -> delay_bytes = 0;
-    status -> is_master = false;
-    status -> alive = false;
-    return status;
+char *topology_host_name(
+    const Topology *topology, const unsigned int index
+) {
+    if (index == TOPOLOGY_NO_HOST) {
+        return nullptr;
+    }
+    return topology -> hosts[index].host;
 }
 
 /**
- * Initializes MonitorHost to its initial value.
+ * A function for searching for a host of the cluster that plays the role.
+ * Takes O(1): the hosts of each role are indexed in the topology snapshot.
+ * @param role The role of the desired host
+ * @param master_if_not_found Determines whether to return the master if no host plays the role
+ * @return Host name corresponding to conditions
  */
-MonitorHost *init_monitor_host(char *host, char *port) {
-    MonitorHost *monitor_host = calloc(1, sizeof(MonitorHost));
-    monitor_host -> host = strdup(host);
-    monitor_host -> connection_str = get_connection_string(host, port);
-    monitor_host -> next = nullptr;
-    monitor_host -> failed_connections = 0;
-
-    atomic_store_explicit(
-        &monitor_host -> status,
-        init_monitor_status(),
-        memory_order_release
-    );
-
-    atomic_store_explicit(
-        &monitor_host -> not_actual_status,
-        init_monitor_status(),
-        memory_order_release
+char *find_host(
+    const MonitorCluster *cluster,
+    const HostRole role,
+    const bool master_if_not_found
+) {
+    return topology_find_host(
+        get_topology(cluster), role, master_if_not_found
     );
-
-    return monitor_host;
 }
 
 /**
- * Initializes MonitorHost linked list to its initial value.
+ * The same as find_host, but returns the index of the host
+ * or TOPOLOGY_NO_HOST
  */
-void init_monitor_host_linked_list(void) {
-    char *hosts = strdup(parameters.hosts);
-    char *host = next_host(hosts);
-
-    char *ports = strdup(parameters.port);
-    char *port = next_port(ports);
-
-    monitor_host_head = init_monitor_host(host, port);
-    MonitorHost *cursor = monitor_host_head;
-    host = next_host(hosts);
-    port = next_port(ports);
-    unsigned int cnt = 1;
-
-    while (host) {
-        if (cnt == MAX_HOSTS) {
-            raise_error("Too many hosts. Maximum value = %d", MAX_HOSTS);
-        }
-
-        cursor -> next = init_monitor_host(host, port);
-        cursor = cursor -> next;
-
-        host = next_host(hosts);
-        port = next_port(ports);
-        cnt++;
-    }
-
-    free(hosts);
-    free(ports);
+unsigned int find_host_index(
+    const MonitorCluster *cluster,
+    const HostRole role,
+    const bool master_if_not_found
+) {
+    return topology_find_host_index(
+        get_topology(cluster), role, master_if_not_found
+    );
 }
 
 /**
- * Atomically returns a pointer to the host status
+ * The same as find_host, but searches in the specified topology snapshot
  */
-MonitorStatus *atomic_get_status(const MonitorHost *host) {
-    return atomic_load_explicit(
-        &host -> status, memory_order_acquire
+char *topology_find_host(
+    const Topology *topology,
+    const HostRole role,
+    const bool master_if_not_found
+) {
+    return topology_host_name(
+        topology,
+        topology_find_host_index(topology, role, master_if_not_found)
     );
 }
 
 /**
- * A function for searching for a host that matches certain conditions
- * @param handler A function that determines whether the specified host has been found
- * @param master_if_not_found Determines whether to return the master if the desired host is not found by handler
- * @return Host name corresponding to conditions
+ * The same as find_host_index, but searches in the specified
+ * topology snapshot
  */
-char *find_host(
-    const condition_handler handler, const bool master_if_not_found
+unsigned int topology_find_host_index(
+    const Topology *topology,
+    const HostRole role,
+    const bool master_if_not_found
 ) {
-    const MonitorHost *cursor = monitor_host_head;
-    const MonitorHost *master = nullptr;
-    while (cursor) {
-        const MonitorStatus *status = atomic_get_status(cursor);
-
-        if (handler(status)) {
-            return cursor -> host;
-        }
-
-        if (status -> is_master) {
-            master = cursor;
-        }
-
-        cursor = cursor -> next;
+    const TopologyRole *hosts = &topology -> roles[role];
+    if (hosts -> cnt > 0) {
+        return hosts -> hosts[0];
     }
 
-    if (master_if_not_found && master) {
-        return master -> host;
+    if (master_if_not_found) {
+        return topology -> master;
     }
 
-    return nullptr;
+    return TOPOLOGY_NO_HOST;
 }
 
 /**
  * condition_handler that searches for a live master
  */
-bool is_master(const MonitorStatus *status) {
+bool is_master(const Topology *topology, const MonitorStatus *status) {
+    (void)topology;
     return status -> alive && status -> is_master;
 }
 
 /**
  * condition_handler that searches for a live replica
  */
-bool is_alive_replica(const MonitorStatus *status) {
+bool is_alive_replica(
+    const Topology *topology, const MonitorStatus *status
+) {
+    (void)topology;
     return status -> alive && !status -> is_master;
 }
 
@@ -258,10 +237,12 @@ bool is_alive_replica(const MonitorStatus *status) {
  * condition_handler that searches for a live replica that is considered
  * time-synchronous
  */
-bool is_sync_replica_by_time(const MonitorStatus *status) {
+bool is_sync_replica_by_time(
+    const Topology *topology, const MonitorStatus *status
+) {
     return (
-        is_alive_replica(status) &&
-        status -> delay_ms <= parameters.sync_max_lag_ms
+        is_alive_replica(topology, status) &&
+        status -> delay_ms <= topology -> parameters -> sync_max_lag_ms
     );
 }
 
@@ -269,10 +250,12 @@ bool is_sync_replica_by_time(const MonitorStatus *status) {
  * condition_handler that searches for a live replica that is considered
  * byte-synchronous
  */
-bool is_sync_replica_by_bytes(const MonitorStatus *status) {
+bool is_sync_replica_by_bytes(
+    const Topology *topology, const MonitorStatus *status
+) {
     return (
-        is_alive_replica(status) &&
-        status -> delay_bytes <= parameters.sync_max_lag_bytes
+        is_alive_replica(topology, status) &&
+        status -> delay_bytes <= topology -> parameters -> sync_max_lag_bytes
     );
 }
 
@@ -280,10 +263,12 @@ bool is_sync_replica_by_bytes(const MonitorStatus *status) {
  * condition_handler that searches for a live replica that is considered
  * time-synchronous or byte-synchronous
  */
-bool is_sync_replica_by_time_or_bytes(const MonitorStatus *status) {
+bool is_sync_replica_by_time_or_bytes(
+    const Topology *topology, const MonitorStatus *status
+) {
     return (
-        is_sync_replica_by_time(status) ||
-        is_sync_replica_by_bytes(status)
+        is_sync_replica_by_time(topology, status) ||
+        is_sync_replica_by_bytes(topology, status)
     );
 }
 
@@ -291,82 +276,377 @@ bool is_sync_replica_by_time_or_bytes(const MonitorStatus *status) {
  * condition_handler that searches for a live replica that is considered
  * time-synchronous and byte-synchronous
  */
-bool is_sync_replica_by_time_and_bytes(const MonitorStatus *status) {
+bool is_sync_replica_by_time_and_bytes(
+    const Topology *topology, const MonitorStatus *status
+) {
     return (
-        is_sync_replica_by_time(status) &&
-        is_sync_replica_by_bytes(status)
+        is_sync_replica_by_time(topology, status) &&
+        is_sync_replica_by_bytes(topology, status)
+    );
+}
+
+/**
+ * Number of request threads that have selected a host.
+ * Only used to give each thread its own selection shard.
+ */
+_Atomic(unsigned int) selection_threads = 0;
+
+/**
+ * Selection shard of the current thread. UINT_MAX until the first selection
+ */
+_Thread_local unsigned int selection_shard = UINT_MAX;
+
+/**
+ * Returns the selection shard of the current thread.
+ * Threads get the shards in turn, the first time they select a host.
+ */
+unsigned int get_selection_shard(void) {
+    if (selection_shard == UINT_MAX) {
+        selection_shard = atomic_fetch_add_explicit(
+            &selection_threads, 1, memory_order_relaxed
+        ) % SELECTION_SHARDS;
+    }
+    return selection_shard;
+}
+
+/**
+ * Returns the hosts of the cluster that play the role in turn,
+ * so that the load is spread over all of them.
+ */
+char *select_host(
+    MonitorCluster *cluster,
+    const HostRole role,
+    const bool master_if_not_found
+) {
+    // Host indexes are the same in all snapshots of the cluster
+    return topology_host_name(
+        get_topology(cluster),
+        select_host_index(cluster, role, master_if_not_found)
+    );
+}
+
+/**
+ * The same as select_host, but returns the index of the host
+ * or TOPOLOGY_NO_HOST.
+ *
+ * Each request thread advances a cursor of its own selection shard,
+ * so threads don't contend for a single cursor, and threads sharing
+ * a shard still get different hosts thanks to the atomic increment.
+ */
+unsigned int select_host_index(
+    MonitorCluster *cluster,
+    const HostRole role,
+    const bool master_if_not_found
+) {
+    return topology_select_host_index(
+        cluster, get_topology(cluster), role, master_if_not_found
+    );
+}
+
+/**
+ * The same as select_host_index, but selects from the specified
+ * topology snapshot of the cluster, so several hosts can be selected
+ * from one consistent snapshot
+ */
+unsigned int topology_select_host_index(
+    MonitorCluster *cluster,
+    const Topology *topology,
+    const HostRole role,
+    const bool master_if_not_found
+) {
+    const TopologyRole *hosts = &topology -> roles[role];
+    if (hosts -> cnt == 0) {
+        return topology_find_host_index(topology, role, master_if_not_found);
+    }
+
+    SelectionShard *shard = &cluster -> selection[get_selection_shard()];
+    const unsigned int cursor = atomic_fetch_add_explicit(
+        &shard -> cursors[role], 1, memory_order_relaxed
     );
+    return hosts -> hosts[cursor % hosts -> cnt];
 }
 
 /**
- * Returns a random replica using the round-robin algorithm.
+ * Conditions of the roles, indexed by HostRole
+ */
+const condition_handler role_conditions[HOST_ROLES_CNT] = {
+    [ROLE_MASTER] = is_master,
+    [ROLE_REPLICA] = is_alive_replica,
+    [ROLE_SYNC_BY_TIME] = is_sync_replica_by_time,
+    [ROLE_SYNC_BY_BYTES] = is_sync_replica_by_bytes,
+    [ROLE_SYNC_BY_TIME_OR_BYTES] = is_sync_replica_by_time_or_bytes,
+    [ROLE_SYNC_BY_TIME_AND_BYTES] = is_sync_replica_by_time_and_bytes,
+};
+
+/**
+ * Evaluates the role conditions for every host of the snapshot being built
+ * and indexes the hosts playing each role.
+ * Must be called after the statuses and the lag are filled in.
+ */
+void index_topology_roles(Topology *topology) {
+    for (unsigned int role = 0; role < HOST_ROLES_CNT; role++) {
+        topology -> roles[role].cnt = 0;
+    }
+
+    for (unsigned int i = 0; i < topology -> hosts_cnt; i++) {
+        MonitorStatus *status = &topology -> hosts[i];
+        status -> roles = 0;
+
+        for (unsigned int role = 0; role < HOST_ROLES_CNT; role++) {
+            if (role_conditions[role](topology, status)) {
+                TopologyRole *hosts = &topology -> roles[role];
+                hosts -> hosts[hosts -> cnt++] = i;
+                status -> roles |= ROLE_BIT(role);
+            }
+        }
+    }
+}
+
+/**
+ * Returns the live replicas of the cluster in turn, see select_host.
  * If there are no live replicas, it returns the master.
  */
-char *round_robin_replica(void) {
-    MonitorHost *cursor = atomic_load_explicit(
-        &last_random_replica, memory_order_acquire
+char *round_robin_replica(MonitorCluster *cluster) {
+    return select_host(cluster, ROLE_REPLICA, true);
+}
+
+/**
+ * Checks whether the lag is within UNSTABLE_LAG_MARGIN_PERCENT of the limit
+ */
+bool is_lag_near_limit(
+    const unsigned long long lag, const unsigned long long limit
+) {
+    const unsigned long long margin = limit / 100 * UNSTABLE_LAG_MARGIN_PERCENT;
+    return lag + margin >= limit && lag <= limit + margin;
+}
+
+/**
+ * Checks whether the host looks unstable after the check and so the next
+ * check should be done sooner: its role or liveness has changed, it has failed
+ * to respond but is not yet considered dead, or it is a replica whose lag is
+ * close to the sync limits.
+ */
+bool is_unstable_host(
+    const Topology *topology,
+    const MonitorHost *host,
+    const MonitorStatus *previous,
+    const MonitorStatus *status
+) {
+    const MonitorParameters *params = topology -> parameters;
+
+    if (
+        status -> alive != previous -> alive ||
+        status -> is_master != previous -> is_master
+    ) {
+        return true;
+    }
+
+    if (
+        host -> failed_connections > 0 &&
+        host -> failed_connections <= params -> max_fails
+    ) {
+        return true;
+    }
+
+    return is_alive_replica(topology, status) && (
+        is_lag_near_limit(status -> delay_ms, params -> sync_max_lag_ms) ||
+        is_lag_near_limit(status -> delay_bytes, params -> sync_max_lag_bytes)
     );
-    if (!cursor || !cursor -> next) {
-        cursor = get_monitor_host_head();
+}
+
+/**
+ * Checks whether the hosts play other roles in the snapshot being built
+ * than in the previous one: the master has changed or a host has joined
+ * or left the replicas or any of the sync replica sets.
+ * Changes of the lag within the sync limits don't count.
+ */
+bool is_topology_changed(const Topology *previous, const Topology *topology) {
+    if (topology -> master != previous -> master) {
+        return true;
+    }
+
+    for (unsigned int i = 0; i < topology -> hosts_cnt; i++) {
+        if (topology -> hosts[i].roles != previous -> hosts[i].roles) {
+            return true;
+        }
     }
-    else {
-        cursor = cursor -> next;
+    return false;
+}
+
+/**
+ * Schedules the next check of the cluster.
+ *
+ * Checks start at a fixed rate on the monotonic clock, so the time spent on
+ * a check is not added to the interval. While the hosts look unstable,
+ * and for UNSTABLE_COOLDOWN_CYCLES checks after that, the interval is
+ * fast_sleep_ms, otherwise sleep_ms. A check that overruns its interval
+ * shifts the schedule instead of causing a burst of checks.
+ */
+void schedule_cluster(MonitorCluster *cluster, const bool unstable) {
+    if (unstable) {
+        cluster -> fast_cycles_left = UNSTABLE_COOLDOWN_CYCLES + 1;
+    }
+
+    if (cluster -> fast_cycles_left > 0) {
+        cluster -> fast_cycles_left--;
     }
-    const MonitorStatus *status = atomic_get_status(cursor);
-    const MonitorHost *start = cursor;
 
-    while (!is_alive_replica(status)) {
-        cursor = cursor -> next;
-        if (!cursor) {
-            cursor = get_monitor_host_head();
+    cluster -> next_check_ms += (
+        cluster -> fast_cycles_left > 0 ?
+            cluster -> parameters.fast_sleep_ms :
+            cluster -> parameters.sleep_ms
+    );
+
+    const unsigned long long now = monotonic_ms();
+    if (cluster -> next_check_ms < now) {
+        cluster -> next_check_ms = now;
+    }
+}
+
+/**
+ * Publishes the results of the last probe of the cluster hosts
+ * and schedules the next check.
+ *
+ * Builds a complete topology snapshot: first the status of every host,
+ * then the lag of the replicas against the master of this iteration,
+ * then the index of the hosts playing each role.
+ * The generation is incremented only if the roles have changed.
+ * The snapshot also carries the time of the next check, until which
+ * it stays the latest one.
+ * Then publishes it with a single atomic store, so readers never see
+ * a mix of old and new statuses. The snapshot is built in a buffer
+ * no reader can still see, see take_topology_buffer.
+ */
+void check_cluster(MonitorCluster *cluster) {
+    const MonitorParameters *params = &cluster -> parameters;
+    const Topology *previous = get_topology(cluster);
+    Topology *topology = take_topology_buffer(cluster);
+    topology -> master = TOPOLOGY_NO_HOST;
+
+    for (unsigned int i = 0; i < cluster -> hosts_cnt; i++) {
+        check_host_streaming_replication(
+            &cluster -> hosts[i],
+            &previous -> hosts[i],
+            &topology -> hosts[i],
+            params -> max_fails
+        );
+
+        if (
+            topology -> master == TOPOLOGY_NO_HOST &&
+            is_master(topology, &topology -> hosts[i])
+        ) {
+            topology -> master = i;
         }
-        if (cursor == start) {
-            return find_host(is_master, false);
+    }
+    calculate_replicas_lag(cluster -> hosts, topology);
+    index_topology_roles(topology);
+    topology -> generation = previous -> generation + (
+        is_topology_changed(previous, topology) ? 1 : 0
+    );
+    for (unsigned int i = 0; i < cluster -> hosts_cnt; i++) {
+        if (topology -> hosts[i].roles != previous -> hosts[i].roles) {
+            atomic_fetch_add_explicit(
+                &cluster -> hosts[i].metrics.role_transitions,
+                1,
+                memory_order_relaxed
+            );
         }
+    }
 
-        status = atomic_get_status(cursor);
+    bool unstable = false;
+    for (unsigned int i = 0; i < cluster -> hosts_cnt; i++) {
+        if (
+            is_unstable_host(
+                topology,
+                &cluster -> hosts[i],
+                &previous -> hosts[i],
+                &topology -> hosts[i]
+            )
+        ) {
+            unstable = true;
+        }
     }
-    atomic_store_explicit(&last_random_replica, cursor, memory_order_release);
+    schedule_cluster(cluster, unstable);
+    topology -> next_check_ms = cluster -> next_check_ms;
 
-    return cursor -> host;
+    publish_topology(cluster, topology);
+    notify_topology_published(cluster, topology);
 }
 
 /**
- * One iteration of host checking
+ * One iteration of host checking.
+ *
+ * The hosts of all clusters whose check is due are probed together,
+ * then the next check of each of these clusters is scheduled and
+ * its topology is published.
+ * Returns the monotonic time (ms) of the next due check.
  */
-void check_hosts(void) {
-    MonitorHost *cursor = monitor_host_head;
+unsigned long long check_clusters(MonitorCluster **due) {
+    const unsigned int clusters_cnt = get_clusters_cnt();
+    const unsigned long long now = monotonic_ms();
+    unsigned int due_cnt = 0;
+
+    for (unsigned int i = 0; i < clusters_cnt; i++) {
+        MonitorCluster *cluster = get_cluster(i);
+        if (cluster -> next_check_ms <= now) {
+            due[due_cnt++] = cluster;
+        }
+    }
+
+    const unsigned long long started_ns = monotonic_ns();
+    probe_clusters(due, due_cnt);
+
+    for (unsigned int i = 0; i < due_cnt; i++) {
+        check_cluster(due[i]);
+        histogram_observe(&due[i] -> check_duration, elapsed_us(started_ns));
+    }
 
-    while (cursor) {
-        check_host_streaming_replication(cursor, parameters.max_fails);
-        cursor = cursor -> next;
+    unsigned long long next_check_ms = ULLONG_MAX;
+    for (unsigned int i = 0; i < clusters_cnt; i++) {
+        const MonitorCluster *cluster = get_cluster(i);
+        if (cluster -> next_check_ms < next_check_ms) {
+            next_check_ms = cluster -> next_check_ms;
+        }
+    }
+    return next_check_ms;
+}
+
+/**
+ * Waits until the monotonic time deadline_ms or until the monitor is stopped.
+ * monitor_mutex must be locked.
+ */
+void monitor_wait_until(const unsigned long long deadline_ms) {
+    while (monitor_running && monotonic_ms() < deadline_ms) {
+        monotonic_cond_wait(&monitor_cond, &monitor_mutex, deadline_ms);
     }
-    printf("\n");
-    (void)fflush(stdout);
 }
 
 /**
  * The main monitoring thread, which runs continuously and periodically
- * does host checks
+ * does host checks of all clusters, each on its own schedule.
  */
 void *pg_monitor_thread(void *arg) {
     (void)arg;
 
-    get_values_from_env();
-    init_monitor_host_linked_list();
+    MonitorCluster **due = malloc(
+        get_clusters_cnt() * sizeof(MonitorCluster *)
+    );
+    if (!due) {
+        raise_error("Can't allocate memory for clusters");
+    }
+
+    const unsigned long long now = monotonic_ms();
+    for (unsigned int i = 0; i < get_clusters_cnt(); i++) {
+        get_cluster(i) -> next_check_ms = now;
+    }
 
-    struct timespec ts;
     pthread_mutex_lock(&monitor_mutex);
     while (monitor_running) {
-
-        check_hosts();
-
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_sec += parameters.sleep;
-
-        pthread_cond_timedwait(&monitor_cond, &monitor_mutex, &ts);
+        monitor_wait_until(check_clusters(due));
     }
     pthread_mutex_unlock(&monitor_mutex);
+
+    free(due);
     return nullptr;
 }
 
@@ -374,6 +654,14 @@ void *pg_monitor_thread(void *arg) {
  * Starts a host monitoring thread
  */
 pthread_t start_pg_monitor() {
+    init_clusters();
+    init_monotonic_cond(&monitor_cond);
+
+    for (unsigned int i = 0; i < get_clusters_cnt(); i++) {
+        const MonitorCluster *cluster = get_cluster(i);
+        notify_topology_published(cluster, get_topology(cluster));
+    }
+
     const int started = pthread_create(
         &monitor_tid, nullptr, pg_monitor_thread, nullptr
     );
@@ -382,7 +670,7 @@ pthread_t start_pg_monitor() {
         raise_error("Failed to start pg_monitor");
     }
 
-    printf("pg_monitor started\n");
+    log_message(LOG_INFO, "pg_monitor started");
     return monitor_tid;
 }
 
@@ -396,5 +684,12 @@ void stop_pg_monitor(void) {
     pthread_mutex_unlock(&monitor_mutex);
 
     pthread_join(monitor_tid, nullptr);
-    printf("pg_monitor stopped\n");
+
+    for (unsigned int i = 0; i < get_clusters_cnt(); i++) {
+        const MonitorCluster *cluster = get_cluster(i);
+        for (unsigned int j = 0; j < cluster -> hosts_cnt; j++) {
+            close_host_connection(&cluster -> hosts[j]);
+        }
+    }
+    log_message(LOG_INFO, "pg_monitor stopped");
 }
@@ -1,12 +1,49 @@
 #ifndef PG_STATUS_PG_MONITOR_H
 #define PG_STATUS_PG_MONITOR_H
 
+#include "utils.h"
+
+#include <limits.h>
 #include <pthread.h>
+#include <stdalign.h>
+#include <stddef.h>
+
+/**
+ * Limits of the delay before reconnecting to a host whose connection
+ * could not be established. The delay doubles after every failed attempt.
+ */
+# define RECONNECT_BACKOFF_MIN_MS 1000
+# define RECONNECT_BACKOFF_MAX_MS 30000
+
+/**
+ * A replica is considered unstable while its lag is within this margin
+ * (in percent) of sync_max_lag_ms or sync_max_lag_bytes.
+ */
+# define UNSTABLE_LAG_MARGIN_PERCENT 20
+
+/**
+ * The number of checks after the last sign of instability that are still
+ * performed at fast_sleep_ms
+ */
+# define UNSTABLE_COOLDOWN_CYCLES 3
+
+/**
+ * The shortest sleep_ms and fast_sleep_ms accepted, so that the monitoring
+ * thread never checks the hosts in a busy loop
+ */
+# define MIN_CHECK_INTERVAL_MS 10
 
 /**
- * The maximum number of hosts monitored by pg-status
+ * libpq connection and query result,
+ * declared here so as not to expose libpq-fe.h
  */
-# define MAX_HOSTS 10
+struct pg_conn;
+struct pg_result;
+
+/**
+ * Name of the cluster monitored when pg_status__clusters is not set
+ */
+# define DEFAULT_CLUSTER_NAME "default"
 
 /**
  * Starts a host monitoring thread
@@ -43,120 +80,587 @@ typedef struct MonitorParameters {
     // Time to attempt connection to host
     char *connect_timeout;
 
+    // connect_timeout in ms. Limits both the connection and the query
+    unsigned long long connect_timeout_ms;
+
     // The lag in ms below which a replica is considered synchronous
     unsigned long long sync_max_lag_ms;
 
     // The lag in bytes below which a replica is considered synchronous
     unsigned long long sync_max_lag_bytes;
 
-    // Time between checks
+    // Time between checks in seconds. Used if sleep_ms is not set
     unsigned int sleep;
 
+    // Time between the starts of consecutive checks in ms
+    unsigned long long sleep_ms;
+
+    // Time between checks in ms while the hosts look unstable:
+    // a replica's lag is close to the sync limits, a host fails to respond,
+    // or a host has changed its role
+    unsigned long long fast_sleep_ms;
+
     // After this number of falls, the host is considered dead.
     unsigned int max_fails;
+
+    // Whether to prepare streaming_replication_query once per connection.
+    // Disable for poolers that don't keep prepared statements.
+    unsigned int prepare_query;
 } MonitorParameters;
 
 
 /**
- * Host status. Separated into a structure for atomic access.
+ * Roles a host can play in a topology snapshot. Each role corresponds to
+ * a condition_handler and to the hosts that requests for the role return.
+ */
+typedef enum HostRole {
+    ROLE_MASTER = 0,
+    ROLE_REPLICA,
+    ROLE_SYNC_BY_TIME,
+    ROLE_SYNC_BY_BYTES,
+    ROLE_SYNC_BY_TIME_OR_BYTES,
+    ROLE_SYNC_BY_TIME_AND_BYTES,
+    HOST_ROLES_CNT,
+} HostRole;
+
+/**
+ * Bit of the role in MonitorStatus.roles
+ */
+# define ROLE_BIT(role) (1U << (role))
+
+
+/**
+ * Host status within a topology snapshot.
+ * Hot fields only, so that lookups scan a dense array.
  */
 typedef struct MonitorStatus {
+    char *host;
     unsigned long long delay_ms;
     unsigned long long delay_bytes;
     bool is_master;
     bool alive;
+
+    // Bitmask of the roles the host plays, see ROLE_BIT
+    unsigned int roles;
 } MonitorStatus;
 
 
 /**
- *  Host parameters, including a double buffer (status and not_actual_status)
- *  that is atomically replaced during the next iteration of
- *  host status checking.
- *  Hosts form a linked list.
+ * Hosts of a topology snapshot that play a role
+ */
+typedef struct TopologyRole {
+    // Number of hosts in hosts
+    unsigned int cnt;
+
+    // Indexes of the hosts in the order of the topology
+    unsigned int *hosts;
+} TopologyRole;
+
+
+/**
+ * Host index meaning that there is no such host, for example the master
+ * in a topology snapshot without a live master
+ */
+# define TOPOLOGY_NO_HOST UINT_MAX
+
+/**
+ * Immutable snapshot of the statuses of all hosts of a cluster, built by
+ * one iteration of host checking and published with a single atomic
+ * pointer store.
+ * Hosts are in the order they are specified in pg_status__hosts.
+ * The hosts playing each role are indexed when the snapshot is built,
+ * so requests are answered without evaluating the conditions.
+ * The snapshot is a single cache-aligned allocation, which is not written
+ * again while a read section that could have seen it is running,
+ * see enter_read_section.
+ */
+typedef struct Topology {
+    // Parameters of the cluster the snapshot belongs to
+    const MonitorParameters *parameters;
+
+    // Number of the changes of the roles: incremented by a check only if
+    // the master has changed or a host has joined or left the replicas
+    // or the sync replicas. 0 until the first change
+    unsigned long long generation;
+
+    // Monotonic time (ms) of the next check of the cluster. The snapshot
+    // stays the latest one at least until then
+    unsigned long long next_check_ms;
+
+    // Index of the live master in hosts, or TOPOLOGY_NO_HOST
+    unsigned int master;
+
+    // Hosts playing each role
+    TopologyRole roles[HOST_ROLES_CNT];
+
+    unsigned int hosts_cnt;
+    MonitorStatus hosts[];
+} Topology;
+
+
+/**
+ * A buffer in which the topology snapshots of a cluster are built
+ */
+typedef struct TopologyBuffer {
+    Topology *topology;
+
+    // Epoch at which a newer snapshot was published over the one
+    // in the buffer, see retire_epoch. 0 if it has never been retired
+    unsigned long long retired_epoch;
+} TopologyBuffer;
+
+
+/**
+ * Stage of the host probe within one check iteration, see probe_clusters
+ */
+typedef enum ProbeState {
+    PROBE_DONE = 0,
+    PROBE_CONNECTING,
+    PROBE_RESETTING,
+    PROBE_PREPARING,
+    PROBE_QUERYING,
+} ProbeState;
+
+
+/**
+ * Probe metrics of a host. Written only by the monitoring thread
+ * with relaxed atomics and read by /metrics without locks.
+ */
+typedef struct HostMetrics {
+    // Time to establish a connection
+    Histogram connect_duration;
+
+    // Round trip of the status query
+    Histogram query_duration;
+
+    // Time from the start of the probe to its end, reconnection included
+    Histogram probe_duration;
+
+    // Number of the probes that got no status
+    _Atomic(unsigned long long) failures;
+
+    // Number of the probes that got no status since the last one that did
+    _Atomic(unsigned int) consecutive_failures;
+
+    // Number of the changes of the roles the host plays, see ROLE_BIT
+    _Atomic(unsigned long long) role_transitions;
+} HostMetrics;
+
+
+/**
+ *  Host parameters and the state of its checking. Only touched by the
+ *  monitoring thread, readers get host statuses from the Topology
+ *  and the probe metrics from metrics.
+ *  The connection to the host is kept open between checks.
+ *  Hosts are stored in a contiguous array in the order of the topology.
  */
 typedef struct MonitorHost {
     char *host;
+    char *port;
     char *connection_str;
-    struct MonitorHost *next;
-    _Atomic(MonitorStatus *) status;
-    _Atomic(MonitorStatus *) not_actual_status;
     unsigned int failed_connections;
+
+    // The last lsn received from the host: the current wal lsn of the master
+    // or the last received wal lsn of the replica
+    unsigned long long wal_lsn;
+
+    // The last replayed wal lsn of the replica
+    unsigned long long replay_lsn;
+
+    // Long-lived connection to the host. nullptr if not connected
+    struct pg_conn *conn;
+
+    // Monotonic time (ms) before which no reconnection is attempted
+    unsigned long long reconnect_at_ms;
+
+    // Current delay between reconnection attempts. 0 while connected
+    unsigned long long reconnect_backoff_ms;
+
+    // State of the current probe
+    ProbeState probe_state;
+
+    // poll events the probe is waiting for on the connection socket
+    short probe_events;
+
+    // Whether streaming_replication_query is prepared on the connection
+    bool query_prepared;
+
+    // Whether the probe started on a connection from the previous check
+    bool probe_reused;
+
+    // Monotonic time (ms) after which the probe stage is considered failed
+    unsigned long long probe_deadline_ms;
+
+    // Result of the status query. nullptr if the probe failed
+    struct pg_result *probe_result;
+
+    // Monotonic time (ns) at which the probe started, 0 if it was skipped
+    unsigned long long probe_started_ns;
+
+    // Monotonic time (ns) at which the current probe stage started
+    unsigned long long stage_started_ns;
+
+    HostMetrics metrics;
+
+    // Limit the status and the error messages of the host,
+    // which would otherwise be logged on every check
+    LogLimit status_log;
+    LogLimit error_log;
 } MonitorHost;
 
 
 /**
- * Returns a pointer to the head of the linked list of hosts.
+ * Number of shards of the host selection cursors of a cluster.
+ * Request threads are spread over the shards, so that threads rotating
+ * over the same hosts rarely write to the same cache line.
+ */
+# define SELECTION_SHARDS 16
+
+/**
+ * Rotation cursors of the roles used by the request threads of one shard.
+ * Occupies its own cache line.
+ */
+typedef struct SelectionShard {
+    alignas(CACHE_LINE_SIZE) _Atomic(unsigned int) cursors[HOST_ROLES_CNT];
+} SelectionShard;
+
+
+/**
+ * A named group of hosts with its own parameters and topology.
+ * All clusters are checked by the same monitoring thread.
  */
-MonitorHost *get_monitor_host_head(void);
+typedef struct MonitorCluster {
+    // Used in the cluster routes: /c/{name}/...
+    char *name;
+    size_t name_len;
+
+    // Position of the cluster in pg_status__clusters
+    unsigned int index;
+
+    MonitorParameters parameters;
+
+    // Contiguous array of the monitored hosts
+    MonitorHost *hosts;
+    unsigned int hosts_cnt;
+
+    // Buffers of the topology snapshots, see take_topology_buffer.
+    // Only touched by the monitoring thread. There are two of them
+    // unless a reader stalls inside a read section
+    TopologyBuffer *topology_buffers;
+    unsigned int topology_buffers_cnt;
+
+    // The last published topology snapshot
+    _Atomic(const Topology *) topology;
+
+    // Cursors for rotating over the hosts of each role, see select_host
+    SelectionShard selection[SELECTION_SHARDS];
+
+    // Monotonic time (ms) of the next scheduled check
+    unsigned long long next_check_ms;
+
+    // The number of checks still to be done at fast_sleep_ms
+    unsigned int fast_cycles_left;
+
+    // Duration of the checks of the cluster: the probes of its hosts
+    // and the publication of the topology. Written only by the monitoring
+    // thread, read by /metrics
+    Histogram check_duration;
+} MonitorCluster;
 
 
 /**
- * Atomically returns a pointer to the host status
+ * Reads the parameters from the environment variables and initializes
+ * the clusters with their hosts
  */
-MonitorStatus *atomic_get_status(const MonitorHost *host);
+void init_clusters(void);
 
+/**
+ * Returns the number of monitored clusters
+ */
+unsigned int get_clusters_cnt(void);
 
 /**
- * Returns a random replica using the round-robin algorithm.
+ * Returns the cluster by its position in pg_status__clusters
+ */
+MonitorCluster *get_cluster(unsigned int index);
+
+/**
+ * Returns the cluster served by the routes without a cluster name.
+ * This is the first cluster in pg_status__clusters.
+ */
+MonitorCluster *get_default_cluster(void);
+
+/**
+ * Searches for the cluster by name in O(1).
+ * The name doesn't have to be null-terminated.
+ * Returns nullptr if there is no such cluster.
+ */
+MonitorCluster *find_cluster(const char *name, size_t name_len);
+
+
+/**
+ * Describes the interface of the function that is called after a topology
+ * snapshot of the cluster is published
+ */
+typedef void (*topology_listener)(
+    const MonitorCluster *cluster, const Topology *topology
+);
+
+/**
+ * Maximum number of topology listeners
+ */
+# define TOPOLOGY_LISTENERS_MAX 8
+
+/**
+ * Adds a function called after every published topology snapshot.
+ * It is called from the monitoring thread, and for the initial snapshots
+ * of the clusters from start_pg_monitor, so it must be added before.
+ */
+void add_topology_listener(topology_listener listener);
+
+/**
+ * Atomically returns the last published topology snapshot of the cluster.
+ * Must be called inside a read section, see enter_read_section:
+ * the snapshot stays intact until the section is left.
+ * The monitoring thread, which publishes the snapshots, needs none.
+ */
+const Topology *get_topology(const MonitorCluster *cluster);
+
+/**
+ * Allocates a topology snapshot of the cluster in which all hosts are dead
+ * and no host plays any role
+ */
+Topology *init_topology(const MonitorCluster *cluster);
+
+/**
+ * Copies the topology snapshot into one allocated with init_topology
+ * for the same cluster. The copy owns its role indexes, so it stays
+ * intact when the buffer of the snapshot is reused.
+ */
+void copy_topology(Topology *copy, const Topology *topology);
+
+/**
+ * Returns a buffer in which the next topology snapshot of the cluster
+ * can be built: a retired one no read section can still see,
+ * or a new one if the readers may still hold all of them
+ */
+Topology *take_topology_buffer(MonitorCluster *cluster);
+
+/**
+ * Publishes the topology snapshot built in a buffer from
+ * take_topology_buffer with a single atomic store and retires
+ * the previous one. The listeners are not notified.
+ */
+void publish_topology(MonitorCluster *cluster, Topology *topology);
+
+
+/**
+ * Returns the live replicas of the cluster in turn, see select_host.
  * If there are no live replicas, it returns the master.
  */
-char *round_robin_replica(void);
+char *round_robin_replica(MonitorCluster *cluster);
 
 /**
- * Describes the interface of the function for searching hosts
+ * Describes the interface of the function that determines whether a host
+ * plays a role. Evaluated once per host when a topology snapshot is built.
  */
-typedef bool (*condition_handler)(const MonitorStatus *);
+typedef bool (*condition_handler)(const Topology *, const MonitorStatus *);
 
 /**
- * A function for searching for a host that matches certain conditions
- * @param handler A function that determines whether the specified host has been found
- * @param master_if_not_found Determines whether to return the master if the desired host is not found by handler
+ * A function for searching for a host of the cluster that plays the role.
+ * Takes O(1): the hosts of each role are indexed in the topology snapshot.
+ * @param role The role of the desired host
+ * @param master_if_not_found Determines whether to return the master if no host plays the role
  * @return Host name corresponding to conditions
  */
 char *find_host(
-    condition_handler handler, bool master_if_not_found
+    const MonitorCluster *cluster,
+    HostRole role,
+    bool master_if_not_found
+);
+
+/**
+ * The same as find_host, but returns the index of the host
+ * or TOPOLOGY_NO_HOST
+ */
+unsigned int find_host_index(
+    const MonitorCluster *cluster,
+    HostRole role,
+    bool master_if_not_found
+);
+
+/**
+ * The same as find_host, but searches in the specified topology snapshot
+ */
+char *topology_find_host(
+    const Topology *topology,
+    HostRole role,
+    bool master_if_not_found
+);
+
+/**
+ * The same as find_host_index, but searches in the specified
+ * topology snapshot
+ */
+unsigned int topology_find_host_index(
+    const Topology *topology,
+    HostRole role,
+    bool master_if_not_found
 );
 
+/**
+ * Returns the name of the host by its index in a topology snapshot,
+ * or nullptr for TOPOLOGY_NO_HOST
+ */
+char *topology_host_name(const Topology *topology, unsigned int index);
+
+/**
+ * Returns the hosts of the cluster that play the role in turn,
+ * so that the load is spread over all of them.
+ * Takes O(1) and doesn't write to memory shared by all request threads.
+ * @param role The role of the desired host
+ * @param master_if_not_found Determines whether to return the master if no host plays the role
+ * @return Host name corresponding to conditions
+ */
+char *select_host(
+    MonitorCluster *cluster,
+    HostRole role,
+    bool master_if_not_found
+);
+
+/**
+ * The same as select_host, but returns the index of the host
+ * or TOPOLOGY_NO_HOST
+ */
+unsigned int select_host_index(
+    MonitorCluster *cluster,
+    HostRole role,
+    bool master_if_not_found
+);
+
+/**
+ * The same as select_host_index, but selects from the specified
+ * topology snapshot of the cluster, so several hosts can be selected
+ * from one consistent snapshot
+ */
+unsigned int topology_select_host_index(
+    MonitorCluster *cluster,
+    const Topology *topology,
+    HostRole role,
+    bool master_if_not_found
+);
+
+/**
+ * Evaluates the role conditions for every host of the snapshot being built
+ * and indexes the hosts playing each role.
+ * Must be called after the statuses and the lag are filled in.
+ */
+void index_topology_roles(Topology *topology);
+
 /**
  * condition_handler that searches for a live master
  */
-bool is_master(const MonitorStatus *status);
+bool is_master(
+    const Topology *topology, const MonitorStatus *status
+);
 
 /**
  * condition_handler that searches for a live replica
  */
-bool is_alive_replica(const MonitorStatus *status);
+bool is_alive_replica(
+    const Topology *topology, const MonitorStatus *status
+);
 
 /**
  * condition_handler that searches for a live replica that is considered
  * time-synchronous
  */
-bool is_sync_replica_by_time(const MonitorStatus *status);
+bool is_sync_replica_by_time(
+    const Topology *topology, const MonitorStatus *status
+);
 
 /**
  * condition_handler that searches for a live replica that is considered
  * byte-synchronous
  */
-bool is_sync_replica_by_bytes(const MonitorStatus *status);
+bool is_sync_replica_by_bytes(
+    const Topology *topology, const MonitorStatus *status
+);
 
 /**
  * condition_handler that searches for a live replica that is considered
  * time-synchronous or byte-synchronous
  */
-bool is_sync_replica_by_time_or_bytes(const MonitorStatus *status);
+bool is_sync_replica_by_time_or_bytes(
+    const Topology *topology, const MonitorStatus *status
+);
 
 /**
  * condition_handler that searches for a live replica that is considered
  * time-synchronous and byte-synchronous
  */
-bool is_sync_replica_by_time_and_bytes(const MonitorStatus *status);
+bool is_sync_replica_by_time_and_bytes(
+    const Topology *topology, const MonitorStatus *status
+);
+
+
+/**
+ * sql query to get host status
+ */
+extern const char *const streaming_replication_query;
+
+/**
+ * Name of the prepared streaming_replication_query
+ */
+extern const char *const streaming_replication_statement;
 
+/**
+ * Probes all hosts of the clusters concurrently: connects if needed and
+ * executes streaming_replication_query with results in the binary format.
+ * Each probe stage is limited by connect_timeout_ms of the cluster
+ * (0 means no limit).
+ * The result is left in probe_result of each host.
+ */
+void probe_clusters(MonitorCluster *const *clusters, unsigned int cnt);
 
 /**
- * Updates the host status
+ * Fills the host status from the result of its last probe
+ * and the status from the previous topology snapshot
  */
 void check_host_streaming_replication(
-    MonitorHost *host, unsigned int max_fails
+    MonitorHost *host,
+    const MonitorStatus *previous,
+    MonitorStatus *status,
+    unsigned int max_fails
 );
 
+/**
+ * Checks that the pg answer is valid. Returns 1 if it's not:
+ * the error is left to the caller, see PQresultErrorMessage.
+ */
+int check_exec_result(const struct pg_result *result);
+
+/**
+ * Converts pg lsn in binary format from the first row to bytes.
+ * Returns 0 for null.
+ */
+unsigned long long parse_lsn(const struct pg_result *q_res, int column);
+
+/**
+ * Calculates the lsn lag of the replicas that have responded in this
+ * iteration against the master lsn of the same iteration
+ */
+void calculate_replicas_lag(const MonitorHost *hosts, Topology *topology);
+
+/**
+ * Postpones the next connection attempt to the host.
+ * The delay doubles with every failed attempt.
+ */
+void postpone_reconnect(MonitorHost *host);
+
+/**
+ * Closes the host connection, if any
+ */
+void close_host_connection(MonitorHost *host);
+
 #endif //PG_STATUS_PG_MONITOR_H
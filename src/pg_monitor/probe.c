@@ -0,0 +1,452 @@
+#include "pg_monitor.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+
+#ifdef __APPLE__
+    #include <libpq-fe.h>
+#else
+    #include <postgresql/libpq-fe.h>
+#endif
+
+/**
+ * Keys of the error messages of a host: the same error of a host
+ * is logged once per pg_status__log_repeat_ms, see log_limited
+ */
+typedef enum HostLogError {
+    HOST_LOG_CONNECT_ERROR = 0,
+    HOST_LOG_SEND_ERROR,
+    HOST_LOG_READ_ERROR,
+    HOST_LOG_QUERY_ERROR,
+    HOST_LOG_PROBE_ABORTED,
+} HostLogError;
+
+
+/**
+ * Returns the monotonic time (ms) at which a probe stage started now expires
+ */
+unsigned long long probe_deadline(const unsigned long long timeout_ms) {
+    if (timeout_ms == 0) {
+        return ULLONG_MAX;
+    }
+    return monotonic_ms() + timeout_ms;
+}
+
+/**
+ * Translates the libpq polling status into poll events
+ */
+short polling_events(const PostgresPollingStatusType status) {
+    return status == PGRES_POLLING_WRITING ? POLLOUT : POLLIN;
+}
+
+/**
+ * Marks the probe of the host as finished
+ */
+void probe_done(MonitorHost *host) {
+    host -> probe_state = PROBE_DONE;
+    host -> probe_events = 0;
+
+    if (host -> probe_started_ns) {
+        histogram_observe(
+            &host -> metrics.probe_duration,
+            elapsed_us(host -> probe_started_ns)
+        );
+    }
+}
+
+/**
+ * Fails the probe because the connection could not be established.
+ * The connection is closed and the next attempt is postponed.
+ */
+void probe_connect_failed(MonitorHost *host) {
+    log_limited(
+        &host -> error_log, HOST_LOG_CONNECT_ERROR, LOG_ERROR,
+        "connect error: %s: %s", host -> host,
+        host -> conn ? PQerrorMessage(host -> conn) : "out of memory"
+    );
+    close_host_connection(host);
+    postpone_reconnect(host);
+    probe_done(host);
+}
+
+/**
+ * Starts establishing a connection to the host.
+ * A broken connection from the previous check is reset.
+ */
+void probe_connect(MonitorHost *host, const MonitorParameters *params) {
+    host -> probe_deadline_ms = probe_deadline(params -> connect_timeout_ms);
+    host -> stage_started_ns = monotonic_ns();
+    host -> probe_events = POLLOUT;
+    host -> query_prepared = false;
+
+    if (host -> conn) {
+        host -> probe_state = PROBE_RESETTING;
+        if (!PQresetStart(host -> conn)) {
+            probe_connect_failed(host);
+        }
+        return;
+    }
+
+    host -> probe_state = PROBE_CONNECTING;
+    host -> conn = PQconnectStart(host -> connection_str);
+    if (!host -> conn || PQstatus(host -> conn) == CONNECTION_BAD) {
+        probe_connect_failed(host);
+    }
+}
+
+/**
+ * Fails the probe because the status query failed.
+ *
+ * A reused connection may have been closed by the server or a pooler while
+ * idle. In that case, the connection is reset and the query is repeated once,
+ * so that a stale connection is not counted as a host failure.
+ */
+void probe_query_failed(
+    MonitorHost *host, const MonitorParameters *params
+) {
+    if (host -> probe_result) {
+        PQclear(host -> probe_result);
+        host -> probe_result = nullptr;
+    }
+
+    if (host -> probe_reused && PQstatus(host -> conn) == CONNECTION_BAD) {
+        host -> probe_reused = false;
+        probe_connect(host, params);
+        return;
+    }
+    probe_done(host);
+}
+
+/**
+ * Logs the failure of the query on the connection to the host with
+ * the libpq error. A reused connection closed while idle is reset and
+ * the query is repeated, see probe_query_failed, so that is a warning.
+ */
+void log_query_error(
+    MonitorHost *host, const HostLogError key, const char *what
+) {
+    const bool repeated = (
+        host -> probe_reused && PQstatus(host -> conn) == CONNECTION_BAD
+    );
+    log_limited(
+        &host -> error_log, key, repeated ? LOG_WARNING : LOG_ERROR,
+        "%s: %s: %s", what, host -> host, PQerrorMessage(host -> conn)
+    );
+}
+
+/**
+ * Flushes the query to the server and selects the events to wait for.
+ * Returns false if the connection is broken.
+ */
+bool probe_flush(MonitorHost *host) {
+    const int flushed = PQflush(host -> conn);
+    if (flushed < 0) {
+        return false;
+    }
+    host -> probe_events = flushed == 1 ? (POLLIN | POLLOUT) : POLLIN;
+    return true;
+}
+
+/**
+ * Sends the status query over the established connection.
+ * The results are requested in the binary format.
+ *
+ * If prepare_query is set, the query is prepared first, once per connection,
+ * and then only the prepared statement is executed.
+ */
+void probe_send_query(MonitorHost *host, const MonitorParameters *params) {
+    host -> probe_deadline_ms = probe_deadline(params -> connect_timeout_ms);
+    host -> stage_started_ns = monotonic_ns();
+
+    int sent = PQsetnonblocking(host -> conn, 1) == 0;
+    if (sent && params -> prepare_query && !host -> query_prepared) {
+        host -> probe_state = PROBE_PREPARING;
+        sent = PQsendPrepare(
+            host -> conn,
+            streaming_replication_statement,
+            streaming_replication_query,
+            0, nullptr
+        );
+    }
+    else if (sent && params -> prepare_query) {
+        host -> probe_state = PROBE_QUERYING;
+        sent = PQsendQueryPrepared(
+            host -> conn,
+            streaming_replication_statement,
+            0, nullptr, nullptr, nullptr, 1
+        );
+    }
+    else if (sent) {
+        host -> probe_state = PROBE_QUERYING;
+        sent = PQsendQueryParams(
+            host -> conn,
+            streaming_replication_query,
+            0, nullptr, nullptr, nullptr, nullptr, 1
+        );
+    }
+
+    if (!sent || !probe_flush(host)) {
+        log_query_error(host, HOST_LOG_SEND_ERROR, "send query error");
+        probe_query_failed(host, params);
+    }
+}
+
+/**
+ * Handles the completion of the prepare or the status query
+ */
+void probe_query_completed(
+    MonitorHost *host, const MonitorParameters *params
+) {
+    if (!host -> probe_result) {
+        probe_query_failed(host, params);
+    }
+    else if (host -> probe_state == PROBE_PREPARING) {
+        PQclear(host -> probe_result);
+        host -> probe_result = nullptr;
+        host -> query_prepared = true;
+        probe_send_query(host, params);
+    }
+    else {
+        histogram_observe(
+            &host -> metrics.query_duration,
+            elapsed_us(host -> stage_started_ns)
+        );
+        probe_done(host);
+    }
+}
+
+/**
+ * Advances the connection establishment
+ */
+void probe_poll_connection(
+    MonitorHost *host, const MonitorParameters *params
+) {
+    const PostgresPollingStatusType status = (
+        host -> probe_state == PROBE_RESETTING ?
+            PQresetPoll(host -> conn) :
+            PQconnectPoll(host -> conn)
+    );
+
+    if (status == PGRES_POLLING_OK) {
+        histogram_observe(
+            &host -> metrics.connect_duration,
+            elapsed_us(host -> stage_started_ns)
+        );
+        host -> reconnect_backoff_ms = 0;
+        host -> reconnect_at_ms = 0;
+        probe_send_query(host, params);
+    }
+    else if (status == PGRES_POLLING_FAILED) {
+        probe_connect_failed(host);
+    }
+    else {
+        host -> probe_events = polling_events(status);
+    }
+}
+
+/**
+ * Reads the results of the prepare or the status query that have arrived.
+ * The first successful result is kept in probe_result.
+ */
+void probe_read_result(
+    MonitorHost *host, const MonitorParameters *params
+) {
+    PGconn *conn = host -> conn;
+
+    if (
+        !PQconsumeInput(conn) ||
+        ((host -> probe_events & POLLOUT) && !probe_flush(host))
+    ) {
+        log_query_error(host, HOST_LOG_READ_ERROR, "read result error");
+        probe_query_failed(host, params);
+        return;
+    }
+
+    while (!PQisBusy(conn)) {
+        PGresult *res = PQgetResult(conn);
+        if (!res) {
+            probe_query_completed(host, params);
+            return;
+        }
+
+        if (check_exec_result(res) != 0) {
+            log_limited(
+                &host -> error_log, HOST_LOG_QUERY_ERROR, LOG_ERROR,
+                "execute sql error: %s: %s",
+                host -> host, PQresultErrorMessage(res)
+            );
+            PQclear(res);
+        }
+        else if (!host -> probe_result) {
+            host -> probe_result = res;
+        }
+        else {
+            PQclear(res);
+        }
+    }
+}
+
+/**
+ * Advances the probe after its socket has become ready
+ */
+void probe_advance(MonitorHost *host, const MonitorParameters *params) {
+    switch (host -> probe_state) {
+        case PROBE_CONNECTING:
+        case PROBE_RESETTING:
+            probe_poll_connection(host, params);
+            break;
+        case PROBE_PREPARING:
+        case PROBE_QUERYING:
+            probe_read_result(host, params);
+            break;
+        case PROBE_DONE:
+            break;
+    }
+}
+
+/**
+ * Aborts the probe that has not finished in time or has lost its socket.
+ * A connection in an unknown state can't be reused, so it is closed.
+ */
+void probe_abort(MonitorHost *host) {
+    log_limited(
+        &host -> error_log, HOST_LOG_PROBE_ABORTED, LOG_ERROR,
+        "probe aborted: %s", host -> host
+    );
+    if (host -> probe_result) {
+        PQclear(host -> probe_result);
+        host -> probe_result = nullptr;
+    }
+
+    close_host_connection(host);
+    if (
+        host -> probe_state == PROBE_CONNECTING ||
+        host -> probe_state == PROBE_RESETTING
+    ) {
+        postpone_reconnect(host);
+    }
+    probe_done(host);
+}
+
+/**
+ * Starts the probe of the host.
+ * A probe skipped until the reconnection is not timed.
+ */
+void probe_start(MonitorHost *host, const MonitorParameters *params) {
+    host -> probe_result = nullptr;
+    host -> probe_started_ns = 0;
+    host -> probe_reused = (
+        host -> conn && PQstatus(host -> conn) == CONNECTION_OK
+    );
+
+    if (host -> probe_reused) {
+        host -> probe_started_ns = monotonic_ns();
+        probe_send_query(host, params);
+    }
+    else if (monotonic_ms() < host -> reconnect_at_ms) {
+        probe_done(host);
+    }
+    else {
+        host -> probe_started_ns = monotonic_ns();
+        probe_connect(host, params);
+    }
+}
+
+/**
+ * Probes all hosts of the clusters concurrently.
+ *
+ * All probes are started at once with non-blocking libpq calls and then
+ * advanced in a single poll loop as their sockets become ready. So one check
+ * iteration takes as long as the slowest host, not the sum of all hosts.
+ * Note that libpq resolves host names synchronously on connection start.
+ */
+void probe_clusters(MonitorCluster *const *clusters, const unsigned int cnt) {
+    unsigned int hosts_cnt = 0;
+    for (unsigned int i = 0; i < cnt; i++) {
+        const MonitorCluster *cluster = clusters[i];
+        for (unsigned int j = 0; j < cluster -> hosts_cnt; j++) {
+            probe_start(&cluster -> hosts[j], &cluster -> parameters);
+        }
+        hosts_cnt += cluster -> hosts_cnt;
+    }
+    if (hosts_cnt == 0) {
+        return;
+    }
+
+    struct pollfd *fds = malloc(hosts_cnt * sizeof(struct pollfd));
+    MonitorHost **polled = malloc(hosts_cnt * sizeof(MonitorHost *));
+    const MonitorParameters **polled_params = malloc(
+        hosts_cnt * sizeof(MonitorParameters *)
+    );
+    if (!fds || !polled || !polled_params) {
+        raise_error("Can't allocate memory for probes");
+    }
+
+    while (true) {
+        const unsigned long long now = monotonic_ms();
+        unsigned long long deadline = ULLONG_MAX;
+        nfds_t nfds = 0;
+
+        for (unsigned int i = 0; i < cnt; i++) {
+            const MonitorCluster *cluster = clusters[i];
+
+            for (unsigned int j = 0; j < cluster -> hosts_cnt; j++) {
+                MonitorHost *cursor = &cluster -> hosts[j];
+                if (cursor -> probe_state == PROBE_DONE) {
+                    continue;
+                }
+
+                const int sock = PQsocket(cursor -> conn);
+                if (now >= cursor -> probe_deadline_ms || sock < 0) {
+                    probe_abort(cursor);
+                    continue;
+                }
+
+                if (cursor -> probe_deadline_ms < deadline) {
+                    deadline = cursor -> probe_deadline_ms;
+                }
+                fds[nfds].fd = sock;
+                fds[nfds].events = cursor -> probe_events;
+                fds[nfds].revents = 0;
+                polled[nfds] = cursor;
+                polled_params[nfds] = &cluster -> parameters;
+                nfds++;
+            }
+        }
+
+        if (nfds == 0) {
+            break;
+        }
+
+        int poll_timeout = -1;
+        if (deadline != ULLONG_MAX) {
+            poll_timeout = (
+                deadline - now > INT_MAX ? INT_MAX : (int)(deadline - now)
+            );
+        }
+
+        if (poll(fds, nfds, poll_timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf_error("Failed to poll hosts");
+            for (nfds_t i = 0; i < nfds; i++) {
+                probe_abort(polled[i]);
+            }
+            break;
+        }
+
+        for (nfds_t i = 0; i < nfds; i++) {
+            if (fds[i].revents) {
+                probe_advance(polled[i], polled_params[i]);
+            }
+        }
+    }
+
+    free(fds);
+    free(polled);
+    free(polled_params);
+}
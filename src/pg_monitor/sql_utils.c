@@ -1,7 +1,5 @@
-#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
-#include <errno.h>
 
 #include "pg_monitor.h"
 #include "utils.h"
@@ -15,98 +13,49 @@
 
 
 /**
- * Converts pg false to bool false
+ * Checks that the pg answer is valid. Returns 1 if it's not:
+ * the error is left to the caller, see PQresultErrorMessage.
  */
-bool is_f(const char *pg_val) {
-    return is_equal_strings(pg_val, "f");
-}
-
-/**
- * Converts pg true to bool true
- */
-bool is_t(const char *pg_val) {
-    return is_equal_strings(pg_val, "t");
-}
-
-
-/**
- * Creates a connection to pg
- */
-PGconn *db_connect(const char *connection_str) {
-    PGconn *conn = PQconnectdb(connection_str);
-    if (PQstatus(conn) != CONNECTION_OK) {
-        printf_error(
-            "\033[0;31m connect error: \033[0m %s \n ", PQerrorMessage(conn)
-        );
-        PQfinish(conn);
-        return nullptr;
-    }
-
-    return conn;
-}
-
-/**
- * Checks that the pg answer is valid. Fails with an error if it's not.
- */
-int check_exec_result(const PGconn *conn, const PGresult *result) {
+int check_exec_result(const PGresult *result) {
     const ExecStatusType resStatus = PQresultStatus(result);
     if (resStatus != PGRES_TUPLES_OK && resStatus != PGRES_COMMAND_OK) {
-        printf_error(
-            "\033[0;31m execute sql error: \033[0m %s \n ",
-            PQerrorMessage(conn)
-        );
-
         return 1;
     }
     return 0;
 }
+
 /**
- * Executes sql query with verification that there is a correct pg answer
+ * Closes the host connection, if any
  */
-PGresult *execute_sql(PGconn *conn, const char *query) {
-    PGresult *res = PQexec(conn, query);
-    const int check_result = check_exec_result(conn, res);
-    if (check_result == 1) {
-        PQclear(res);
-        return nullptr;
+void close_host_connection(MonitorHost *host) {
+    if (host -> conn) {
+        PQfinish(host -> conn);
+        host -> conn = nullptr;
     }
-    return res;
+    host -> query_prepared = false;
 }
 
 /**
- * Extracts a bool value from the first column of the first row.
+ * Postpones the next connection attempt to the host.
+ * The delay doubles with every failed attempt.
  */
-int extract_bool_value(PGresult *q_res, bool *result) {
-    if (q_res == nullptr) {
-        return 1;
+void postpone_reconnect(MonitorHost *host) {
+    if (host -> reconnect_backoff_ms == 0) {
+        host -> reconnect_backoff_ms = RECONNECT_BACKOFF_MIN_MS;
     }
-
-    if (PQntuples(q_res) > 0 && PQnfields(q_res) > 0) {
-        *result = is_t(PQgetvalue(q_res, 0, 0));
-    }
-    else {
-        return 1;
+    else if (host -> reconnect_backoff_ms < RECONNECT_BACKOFF_MAX_MS) {
+        host -> reconnect_backoff_ms *= 2;
+        if (host -> reconnect_backoff_ms > RECONNECT_BACKOFF_MAX_MS) {
+            host -> reconnect_backoff_ms = RECONNECT_BACKOFF_MAX_MS;
+        }
     }
-
-    PQclear(q_res);
-    return 0;
-}
-
-/**
- * Executes sql query and extracts a bool value from the first column of the
- * first row
- */
-int execute_sql_bool(PGconn *conn, const char *query, bool *result) {
-    PGresult *q_res = execute_sql(conn, query);
-    const int out = extract_bool_value(q_res, result);
-    PQfinish(conn);
-    return out;
+    host -> reconnect_at_ms = monotonic_ms() + host -> reconnect_backoff_ms;
 }
 
 /**
  * sql query to get host status
  */
-const char *streaming_replication_query =
+const char *const streaming_replication_query =
     "with is_in_recovery as (\n"
     "  select pg_is_in_recovery() is_replica\n"
     ")\n"
@@ -122,35 +71,64 @@ const char *streaming_replication_query =
 
 
 /**
- * Converts pg lsn to bytes
+ * Name of the prepared streaming_replication_query
  */
-unsigned long long parse_lsn(const char *lsn) {
-    if (!lsn) {
-        return 0;
-    }
+const char *const streaming_replication_statement = "pg_status";
 
-    char *slash;
-    unsigned long hi;
-    unsigned long lo;
 
-    slash = strchr(lsn, '/');
-    if (!slash) {
-        return 0;
+/**
+ * Decodes a big-endian 64-bit integer of the pg binary format
+ */
+unsigned long long decode_uint64(const char *value) {
+    const unsigned char *bytes = (const unsigned char *)value;
+    unsigned long long result = 0;
+    for (int i = 0; i < 8; i++) {
+        result = result << 8 | bytes[i];
     }
+    return result;
+}
 
-    errno = 0;
-    hi = strtoul(lsn, NULL, 16);
-    if (errno != 0) {
+/**
+ * Converts pg lsn in binary format from the first row to bytes.
+ * Returns 0 for null.
+ */
+unsigned long long parse_lsn(const PGresult *q_res, const int column) {
+    if (
+        PQgetisnull(q_res, 0, column) ||
+        PQgetlength(q_res, 0, column) != 8
+    ) {
         return 0;
     }
+    return decode_uint64(PQgetvalue(q_res, 0, column));
+}
 
-    errno = 0;
-    lo = strtoul(slash + 1, NULL, 16);
-    if (errno != 0) {
+/**
+ * Converts pg bigint in binary format from the first row to
+ * unsigned long long. Returns 0 for null and negative values.
+ */
+unsigned long long parse_bigint(const PGresult *q_res, const int column) {
+    if (
+        PQgetisnull(q_res, 0, column) ||
+        PQgetlength(q_res, 0, column) != 8
+    ) {
         return 0;
     }
 
-    return (unsigned long long)hi << 32 | lo;
+    const unsigned long long value = decode_uint64(
+        PQgetvalue(q_res, 0, column)
+    );
+    return value >> 63 ? 0 : value;
+}
+
+/**
+ * Converts pg bool in binary format from the first row to bool
+ */
+bool parse_bool(const PGresult *q_res, const int column) {
+    return (
+        !PQgetisnull(q_res, 0, column) &&
+        PQgetlength(q_res, 0, column) == 1 &&
+        *PQgetvalue(q_res, 0, column) != 0
+    );
 }
 
 /**
@@ -161,79 +139,118 @@ unsigned long long max_lsn(unsigned long long  a, unsigned long long  b) {
 }
 
 /**
- * Updates the host status
- *
- * Updating the status is filling `not_actual_status` and atomically
- * replacing the pointer in `status`. The former `status` then atomically
- * becomes `not_actual_status`. This way, concurrent threads can atomically
- * read the current status. And even if there's a thread that
- * has an old pointer, it won't be broken.
+ * Calculates the lsn lag of the replicas that have responded in this
+ * iteration against the master lsn of the same iteration.
  *
  * A replica’s lsn lag is defined as the difference between its own lsn and
  * the greater of the lsn received by the replica or the lsn on the master.
  * Therefore, even if a replica does not receive a new lsn, a measurable
  * lag can still occur.
  */
+void calculate_replicas_lag(const MonitorHost *hosts, Topology *topology) {
+    unsigned long long master_lsn = 0;
+    if (topology -> master != TOPOLOGY_NO_HOST) {
+        master_lsn = hosts[topology -> master].wal_lsn;
+    }
+
+    for (unsigned int i = 0; i < topology -> hosts_cnt; i++) {
+        const MonitorHost *cursor = &hosts[i];
+        MonitorStatus *status = &topology -> hosts[i];
+        if (
+            cursor -> failed_connections > 0 ||
+            !is_alive_replica(topology, status)
+        ) {
+            continue;
+        }
+
+        const unsigned long long newest_lsn = max_lsn(
+            master_lsn, cursor -> wal_lsn
+        );
+        status -> delay_bytes = (
+            newest_lsn > cursor -> replay_lsn ?
+                newest_lsn - cursor -> replay_lsn : 0
+        );
+    }
+}
+
+/**
+ * Keys of the status messages of a host: a host in the same status
+ * is logged once per pg_status__log_repeat_ms, see log_limited
+ */
+typedef enum HostLogStatus {
+    HOST_LOG_DEAD = 0,
+    HOST_LOG_REPLICA,
+    HOST_LOG_MASTER,
+} HostLogStatus;
+
+/**
+ * Fills the host status from the result of its last probe, see probe_clusters
+ * The result is in the binary format, so values are decoded without parsing.
+ *
+ * A host that failed to respond keeps its previous status until it exceeds
+ * max_fails. The lsn lag of replicas is not known yet: it is calculated
+ * once the whole topology is checked, see calculate_replicas_lag.
+ */
 void check_host_streaming_replication(
-    MonitorHost *host, const unsigned int max_fails
+    MonitorHost *host,
+    const MonitorStatus *previous,
+    MonitorStatus *status,
+    const unsigned int max_fails
 ) {
-    static unsigned long long master_lsn = 0;
-    MonitorStatus *status = atomic_get_status(host);
-    MonitorStatus *new_status = atomic_load_explicit(
-        &host -> not_actual_status, memory_order_acquire
-    );
+    *status = *previous;
 
-    PGresult *q_res = nullptr;
-    PGconn *conn = db_connect(host -> connection_str);
-    if (conn) {
-        q_res = execute_sql(conn, streaming_replication_query);
-    }
+    PGresult *q_res = host -> probe_result;
+    host -> probe_result = nullptr;
 
     if (!q_res) {
-        printf("%s: dead\n", host -> host);
+        log_limited(
+            &host -> status_log, HOST_LOG_DEAD, LOG_INFO,
+            "%s: dead", host -> host
+        );
         host -> failed_connections++;
+        atomic_fetch_add_explicit(
+            &host -> metrics.failures, 1, memory_order_relaxed
+        );
+        atomic_store_explicit(
+            &host -> metrics.consecutive_failures,
+            host -> failed_connections,
+            memory_order_relaxed
+        );
         if (host -> failed_connections > max_fails) {
-            new_status -> alive = false;
-            new_status -> is_master = false;
-        }
-    }
-    else {
-        new_status -> alive = true;
-        host -> failed_connections = 0;
-
-        const bool is_replica = is_t(PQgetvalue(q_res, 0, 0));
-        if (is_replica) {
-            printf("%s: replica\n", host -> host);
-            new_status -> is_master = false;
-            new_status -> delay_ms = str_to_ull(PQgetvalue(q_res, 0, 4));
-
-            const unsigned long long replica_received_lsn = parse_lsn(
-                PQgetvalue(q_res, 0, 2)
-            );
-            const unsigned long long replica_lsn = parse_lsn(
-                PQgetvalue(q_res, 0, 3)
-            );
-            new_status -> delay_bytes = (
-                max_lsn(master_lsn, replica_received_lsn) - replica_lsn
-            );
-        }
-        else {
-            printf("%s: master\n", host -> host);
-            new_status -> is_master = true;
-            new_status -> delay_ms = 0;
-            new_status -> delay_bytes = 0;
-            master_lsn = parse_lsn(PQgetvalue(q_res, 0, 1));
+            status -> alive = false;
+            status -> is_master = false;
         }
+        return;
     }
 
-    atomic_store_explicit(&host -> status, new_status, memory_order_release);
-    atomic_store_explicit(&host -> not_actual_status, status, memory_order_release);
+    status -> alive = true;
+    host -> failed_connections = 0;
+    atomic_store_explicit(
+        &host -> metrics.consecutive_failures, 0, memory_order_relaxed
+    );
 
-    if (q_res) {
-        PQclear(q_res);
+    const bool is_replica = parse_bool(q_res, 0);
+    if (is_replica) {
+        log_limited(
+            &host -> status_log, HOST_LOG_REPLICA, LOG_INFO,
+            "%s: replica", host -> host
+        );
+        status -> is_master = false;
+        status -> delay_ms = parse_bigint(q_res, 4);
+        host -> wal_lsn = parse_lsn(q_res, 2);
+        host -> replay_lsn = parse_lsn(q_res, 3);
     }
-
-    if (conn) {
-        PQfinish(conn);
+    else {
+        log_limited(
+            &host -> status_log, HOST_LOG_MASTER, LOG_INFO,
+            "%s: master", host -> host
+        );
+        status -> is_master = true;
+        status -> delay_ms = 0;
+        status -> delay_bytes = 0;
+        host -> wal_lsn = parse_lsn(q_res, 1);
+        host -> replay_lsn = host -> wal_lsn;
     }
+
+    PQclear(q_res);
 }
@@ -0,0 +1,122 @@
+#ifndef PG_STATUS_BINARY_H
+#define PG_STATUS_BINARY_H
+
+/**
+ * Header-only decoder of the pg-status binary responses.
+ *
+ * A request with Accept: application/vnd.pg-status gets the host as
+ * a record with a fixed layout, so a client reads it without any string
+ * parsing. /hosts returns a record per requested role, one after another.
+ *
+ * A record is little-endian:
+ *     offset size
+ *     0      4    magic, PG_STATUS_BINARY_MAGIC
+ *     4      2    version, PG_STATUS_BINARY_VERSION
+ *     6      2    length of the host name, 0 if there is no such host
+ *     8      4    bitmask of the roles the host plays,
+ *                 PG_STATUS_BINARY_ROLE_*
+ *     12     4    reserved, 0
+ *     16     8    generation of the topology
+ *     24     8    replication lag of the host in ms
+ *     32     8    replication lag of the host in bytes
+ *     40     -    host name, not null-terminated
+ *
+ * Usage:
+ *     PgStatusBinaryHost host;
+ *     size_t len = pg_status_binary_decode(body, body_len, &host);
+ *     if (len && host.host_len) { ... }
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Identifies the record and the version of its layout.
+ * The version changes whenever the layout does.
+ */
+# define PG_STATUS_BINARY_MAGIC 0x42535350U // PSSB
+# define PG_STATUS_BINARY_VERSION 1U
+
+/**
+ * Content type of the binary responses
+ */
+# define PG_STATUS_BINARY_CONTENT_TYPE "application/vnd.pg-status"
+
+/**
+ * Length of a record without the host name
+ */
+# define PG_STATUS_BINARY_HEADER_LEN 40U
+
+/**
+ * Roles of a host, bits of PgStatusBinaryHost.roles.
+ * The same as the HostRole of pg-status.
+ */
+# define PG_STATUS_BINARY_ROLE_MASTER (1U << 0)
+# define PG_STATUS_BINARY_ROLE_REPLICA (1U << 1)
+# define PG_STATUS_BINARY_ROLE_SYNC_BY_TIME (1U << 2)
+# define PG_STATUS_BINARY_ROLE_SYNC_BY_BYTES (1U << 3)
+# define PG_STATUS_BINARY_ROLE_SYNC_BY_TIME_OR_BYTES (1U << 4)
+# define PG_STATUS_BINARY_ROLE_SYNC_BY_TIME_AND_BYTES (1U << 5)
+
+/**
+ * A decoded record
+ */
+typedef struct PgStatusBinaryHost {
+    uint64_t generation;
+    uint64_t delay_ms;
+    uint64_t delay_bytes;
+
+    // Bitmask of PG_STATUS_BINARY_ROLE_*
+    uint32_t roles;
+
+    // Host name within the decoded buffer, not null-terminated.
+    // host_len is 0 if there is no such host
+    const char *host;
+    uint16_t host_len;
+} PgStatusBinaryHost;
+
+
+/**
+ * Reads a little-endian integer of the size in bytes
+ */
+static inline uint64_t pg_status_binary_read(
+    const unsigned char *buf, const unsigned int size
+) {
+    uint64_t value = 0;
+    for (unsigned int i = size; i > 0; i--) {
+        value = (value << 8) | buf[i - 1];
+    }
+    return value;
+}
+
+/**
+ * Decodes the record at the start of the buffer.
+ * Returns the length of the record, so the next one starts right after it,
+ * or 0 if the buffer doesn't start with a whole record of this version.
+ */
+static inline size_t pg_status_binary_decode(
+    const void *buffer, const size_t len, PgStatusBinaryHost *host
+) {
+    const unsigned char *buf = buffer;
+    if (
+        len < PG_STATUS_BINARY_HEADER_LEN ||
+        pg_status_binary_read(buf, 4) != PG_STATUS_BINARY_MAGIC ||
+        pg_status_binary_read(buf + 4, 2) != PG_STATUS_BINARY_VERSION
+    ) {
+        return 0;
+    }
+
+    host -> host_len = (uint16_t) pg_status_binary_read(buf + 6, 2);
+    if (len - PG_STATUS_BINARY_HEADER_LEN < host -> host_len) {
+        return 0;
+    }
+
+    host -> roles = (uint32_t) pg_status_binary_read(buf + 8, 4);
+    host -> generation = pg_status_binary_read(buf + 16, 8);
+    host -> delay_ms = pg_status_binary_read(buf + 24, 8);
+    host -> delay_bytes = pg_status_binary_read(buf + 32, 8);
+    host -> host = (const char *) buf + PG_STATUS_BINARY_HEADER_LEN;
+    return PG_STATUS_BINARY_HEADER_LEN + host -> host_len;
+}
+
+#endif //PG_STATUS_BINARY_H
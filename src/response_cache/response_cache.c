@@ -0,0 +1,861 @@
+#include "response_cache.h"
+#include "pg_status_binary.h"
+#include "utils.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+/**
+ * A response shared by the requests, and the empty 304 response
+ * for the clients that already have it
+ */
+typedef struct SharedResponse {
+    MHD_Response *response;
+    MHD_Response *not_modified;
+    char etag[HTTP_ETAG_LEN];
+} SharedResponse;
+
+/**
+ * Responses of a cluster built for one topology snapshot and shared by
+ * all requests until the next snapshot is rendered. They carry the cache
+ * headers of the snapshot, so nothing is added to them per request.
+ *
+ * Published with a single atomic pointer store and freed once no read
+ * section can see them, see enter_read_section. mhd holds its own
+ * reference to a queued response, so a response being sent outlives
+ * the snapshot.
+ */
+struct SnapshotResponses {
+    // Copy of the snapshot the responses were rendered from: the hosts
+    // of an answer are selected against it, see get_snapshot_responses
+    Topology *topology;
+
+    // The cacheable text and json responses with each host: [host][format]
+    SharedResponse *hosts;
+
+    // The text and json responses that must not be stored, see
+    // ClusterBodies.no_store_hosts
+    MHD_Response *const *no_store_hosts;
+
+    // The binary responses with each host, the last one is the response
+    // without a host. They carry the lags, so they are never stored
+    MHD_Response **binary;
+
+    // The binary records of the responses at ClusterBodies.binary_offsets
+    char *records;
+
+    // The json with the live replicas
+    SharedResponse replicas;
+
+    // The json with the generation and the hosts playing each role
+    SharedResponse state;
+
+    // Epoch at which the responses of a newer snapshot were published
+    // over these ones, see retire_epoch
+    unsigned long long retired_epoch;
+
+    // Next in ClusterBodies.retired
+    SnapshotResponses *next;
+};
+
+/**
+ * Rendered bodies and responses of a cluster
+ */
+typedef struct ClusterBodies {
+    // Text and json bodies with each host: [host][format].
+    // Host names never change, so they are rendered once and never freed.
+    // The last row is the body without a host.
+    char **hosts;
+
+    // Text and json responses with the bodies in hosts that must not be
+    // stored: for the hosts returned in turn and for the answers without
+    // a host. Like the bodies, they are built once and never freed.
+    MHD_Response **no_store_hosts;
+
+    // Offsets of the binary records with each host in
+    // SnapshotResponses.records, the last but one is the record without
+    // a host and the last one is the length of all of them. The lengths
+    // of the records depend only on the host names, so they are computed
+    // once.
+    size_t *binary_offsets;
+
+    // The bodies that depend on the roles, rendered again only when the
+    // generation changes. Used only by the monitoring thread: the responses
+    // get copies of them
+    unsigned long long generation;
+    char *replicas;
+    char *state;
+
+    // The responses of the last rendered topology snapshot. nullptr until
+    // the first snapshot is rendered. Written only by the monitoring thread
+    _Atomic(SnapshotResponses *) snapshot;
+
+    // The responses of the previous snapshots that a read section may
+    // still see, the newest first
+    SnapshotResponses *retired;
+} ClusterBodies;
+
+/**
+ * Rendered bodies of the clusters, indexed by MonitorCluster.index
+ */
+ClusterBodies *cluster_bodies = nullptr;
+
+/**
+ * Wall-clock time (ns) at which the cache was created. It is a part of
+ * the ETags, so they don't repeat across restarts and instances.
+ */
+unsigned long long etag_epoch = 0;
+
+/**
+ * Content types of the formats
+ */
+const char *const format_content_types[RESPONSE_FORMATS_CNT] = {
+    [RESPONSE_TEXT] = "text/plain",
+    [RESPONSE_JSON] = "application/json",
+    [RESPONSE_BINARY] = PG_STATUS_BINARY_CONTENT_TYPE,
+};
+
+/**
+ * Keys of the hosts playing each role in the state body
+ */
+const char *const state_role_keys[HOST_ROLES_CNT] = {
+    [ROLE_MASTER] = "master",
+    [ROLE_REPLICA] = "replicas",
+    [ROLE_SYNC_BY_TIME] = "sync_by_time",
+    [ROLE_SYNC_BY_BYTES] = "sync_by_bytes",
+    [ROLE_SYNC_BY_TIME_OR_BYTES] = "sync_by_time_or_bytes",
+    [ROLE_SYNC_BY_TIME_AND_BYTES] = "sync_by_time_and_bytes",
+};
+
+
+/**
+ * Returns the content type of the format
+ */
+const char *response_content_type(const ResponseFormat format) {
+    return format_content_types[format];
+}
+
+/**
+ * Writes the object with the host: {"host": "host"}
+ */
+void write_host_json(JsonWriter *writer, const char *host) {
+    json_begin_object(writer);
+    json_key(writer, "host");
+    json_string(writer, host);
+    json_end_object(writer);
+}
+
+/**
+ * Renders the json array with the live replicas of the snapshot.
+ * The string must be freed by the caller.
+ */
+char *render_replicas_body(const Topology *topology) {
+    JsonWriter writer;
+    json_writer_init(&writer, nullptr, 0);
+
+    json_begin_array(&writer);
+    const TopologyRole *replicas = &topology -> roles[ROLE_REPLICA];
+    for (unsigned int i = 0; i < replicas -> cnt; i++) {
+        const MonitorStatus *status = &topology -> hosts[replicas -> hosts[i]];
+        write_host_json(&writer, status -> host);
+    }
+    json_end_array(&writer);
+
+    return json_writer_finish(&writer);
+}
+
+/**
+ * Renders the text or json body with the host.
+ * A host equal to nullptr means the body without a host.
+ * The string must be freed by the caller.
+ */
+char *render_host(const char *host, const ResponseFormat format) {
+    if (format == RESPONSE_TEXT) {
+        return format_string("%s", host ? host : "");
+    }
+
+    JsonWriter writer;
+    json_writer_init(&writer, nullptr, 0);
+    write_host_json(&writer, host);
+    return json_writer_finish(&writer);
+}
+
+/**
+ * Renders the bodies with each host of the topology snapshot
+ * and the body without a host
+ */
+char **render_hosts(const Topology *topology) {
+    char **hosts = calloc(
+        (topology -> hosts_cnt + 1) * RESPONSE_FORMATS_CNT, sizeof(char *)
+    );
+    if (!hosts) {
+        raise_error("Can't allocate memory for responses");
+    }
+
+    for (unsigned int i = 0; i <= topology -> hosts_cnt; i++) {
+        const char *host = (
+            i < topology -> hosts_cnt ? topology -> hosts[i].host : nullptr
+        );
+        for (unsigned int j = 0; j < RESPONSE_BINARY; j++) {
+            hosts[i * RESPONSE_FORMATS_CNT + j] = render_host(host, j);
+        }
+    }
+    return hosts;
+}
+
+/**
+ * Creates a response shared by the requests with the body of the length.
+ * Fails with an error if mhd can't create it.
+ */
+MHD_Response *create_shared_response(
+    const char *body,
+    const size_t len,
+    const MHD_ResponseMemoryMode memory_mode
+) {
+    MHD_Response *response = MHD_create_response_from_buffer(
+        len, (void *) body, memory_mode
+    );
+    if (!response) {
+        raise_error("Failed to create a shared response");
+    }
+    return response;
+}
+
+/**
+ * Creates a response with the body of the format that must not be stored
+ * by the client. The body must outlive the response.
+ */
+MHD_Response *create_no_store_response(
+    const char *body, const size_t len, const ResponseFormat format
+) {
+    MHD_Response *response = create_shared_response(
+        body, len, format == RESPONSE_BINARY ?
+            MHD_RESPMEM_MUST_COPY : MHD_RESPMEM_PERSISTENT
+    );
+    MHD_add_response_header(
+        response, MHD_HTTP_HEADER_CONTENT_TYPE, format_content_types[format]
+    );
+    MHD_add_response_header(
+        response, MHD_HTTP_HEADER_CACHE_CONTROL, "no-store"
+    );
+    return response;
+}
+
+/**
+ * Creates the responses with the host bodies that must not be stored,
+ * see ClusterBodies.no_store_hosts
+ */
+MHD_Response **create_no_store_hosts(
+    char *const *hosts, const unsigned int hosts_cnt
+) {
+    MHD_Response **responses = calloc(
+        (hosts_cnt + 1) * RESPONSE_FORMATS_CNT, sizeof(MHD_Response *)
+    );
+    if (!responses) {
+        raise_error("Can't allocate memory for responses");
+    }
+
+    for (unsigned int i = 0; i <= hosts_cnt; i++) {
+        for (unsigned int j = 0; j < RESPONSE_BINARY; j++) {
+            const char *body = hosts[i * RESPONSE_FORMATS_CNT + j];
+            responses[i * RESPONSE_FORMATS_CNT + j] = create_no_store_response(
+                body, strlen(body), j
+            );
+        }
+    }
+    return responses;
+}
+
+/**
+ * Writes the ETag of an answer from the topology snapshot of the generation.
+ * It changes with the generation and the format, and with the host for the
+ * answers with a single host: the sync replicas are returned in turn,
+ * so a client revalidating its answer gets 304 only if it would get
+ * the same host again.
+ * host is TOPOLOGY_NO_HOST for the other answers.
+ */
+void format_topology_etag(
+    char *etag,
+    const unsigned long long generation,
+    const ResponseFormat format,
+    const unsigned int host
+) {
+    if (host == TOPOLOGY_NO_HOST) {
+        snprintf(
+            etag, HTTP_ETAG_LEN, "\"%llx-%llu-%u\"",
+            etag_epoch, generation, (unsigned int) format
+        );
+        return;
+    }
+    snprintf(
+        etag, HTTP_ETAG_LEN, "\"%llx-%llu-%u-%u\"",
+        etag_epoch, generation, (unsigned int) format, host
+    );
+}
+
+/**
+ * Formats the wall-clock time of the next check of the snapshot
+ * as an HTTP date for Expires.
+ *
+ * It is rounded up to whole seconds: truncated, it would already have
+ * passed for check intervals under a second, and those answers would never
+ * be cached. So an answer may be reused for up to a second after the next
+ * check.
+ */
+void format_next_check_date(
+    char *date, const size_t size, const Topology *topology
+) {
+    const unsigned long long now = monotonic_ms();
+    const unsigned long long left = (
+        topology -> next_check_ms > now ? topology -> next_check_ms - now : 0
+    );
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    const unsigned long long next_check_ms = (
+        (unsigned long long) ts.tv_sec * 1000ULL +
+        (unsigned long long) ts.tv_nsec / 1000000ULL +
+        left
+    );
+    const time_t next_check = (time_t)((next_check_ms + 999) / 1000);
+
+    struct tm tm;
+    gmtime_r(&next_check, &tm);
+    strftime(date, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/**
+ * Adds the cache headers of an answer from a topology snapshot:
+ * the ETag, Vary: Accept, since the answer depends on the Accept header,
+ * and Expires at the next check of the cluster if the answer can't change
+ * before then, see format_next_check_date. expires is nullptr for the
+ * answers that must be revalidated every time: they get no-cache instead.
+ */
+void add_topology_cache_headers(
+    MHD_Response *response, const char *etag, const char *expires
+) {
+    MHD_add_response_header(response, MHD_HTTP_HEADER_ETAG, etag);
+    MHD_add_response_header(
+        response, MHD_HTTP_HEADER_VARY, MHD_HTTP_HEADER_ACCEPT
+    );
+    if (expires) {
+        MHD_add_response_header(response, MHD_HTTP_HEADER_EXPIRES, expires);
+        return;
+    }
+    MHD_add_response_header(
+        response, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache"
+    );
+}
+
+/**
+ * Creates the cacheable response with the body of the format and its 304
+ * response, see add_topology_cache_headers and format_topology_etag.
+ * The body is sent with the memory mode, so it must outlive the response
+ * unless it is copied.
+ */
+void create_topology_response(
+    SharedResponse *shared,
+    const char *body,
+    const MHD_ResponseMemoryMode memory_mode,
+    const ResponseFormat format,
+    const unsigned long long generation,
+    const unsigned int host,
+    const char *expires
+) {
+    format_topology_etag(shared -> etag, generation, format, host);
+
+    shared -> response = create_shared_response(
+        body, strlen(body), memory_mode
+    );
+    MHD_add_response_header(
+        shared -> response,
+        MHD_HTTP_HEADER_CONTENT_TYPE,
+        format_content_types[format]
+    );
+    add_topology_cache_headers(shared -> response, shared -> etag, expires);
+
+    shared -> not_modified = create_shared_response(
+        "", 0, MHD_RESPMEM_PERSISTENT
+    );
+    add_topology_cache_headers(
+        shared -> not_modified, shared -> etag, expires
+    );
+}
+
+/**
+ * Destroys the response and its 304 response
+ */
+void destroy_topology_response(const SharedResponse *shared) {
+    MHD_destroy_response(shared -> response);
+    MHD_destroy_response(shared -> not_modified);
+}
+
+/**
+ * Length of the host name in the binary record.
+ * Longer names are truncated.
+ */
+uint16_t binary_host_len(const char *host) {
+    const size_t len = host ? strlen(host) : 0;
+    return len < UINT16_MAX ? (uint16_t) len : UINT16_MAX;
+}
+
+/**
+ * Computes the offsets of the binary records with each host of the
+ * topology snapshot and of the record without a host, see binary_offsets
+ */
+void init_binary_offsets(ClusterBodies *bodies, const Topology *topology) {
+    bodies -> binary_offsets = calloc(
+        topology -> hosts_cnt + 2, sizeof(size_t)
+    );
+    if (!bodies -> binary_offsets) {
+        raise_error("Can't allocate memory for responses");
+    }
+
+    size_t offset = 0;
+    for (unsigned int i = 0; i <= topology -> hosts_cnt; i++) {
+        bodies -> binary_offsets[i] = offset;
+        offset += PG_STATUS_BINARY_HEADER_LEN;
+        if (i < topology -> hosts_cnt) {
+            offset += binary_host_len(topology -> hosts[i].host);
+        }
+    }
+    bodies -> binary_offsets[topology -> hosts_cnt + 1] = offset;
+}
+
+/**
+ * Writes a little-endian integer of the size in bytes
+ */
+void write_binary_int(char *buf, uint64_t value, const unsigned int size) {
+    for (unsigned int i = 0; i < size; i++) {
+        buf[i] = (char)(value & 0xFF);
+        value >>= 8;
+    }
+}
+
+/**
+ * Writes the binary record with the host, see pg_status_binary.h.
+ * A status equal to nullptr means the record without a host.
+ */
+void write_binary_record(
+    char *buf,
+    const MonitorStatus *status,
+    const unsigned long long generation
+) {
+    const uint16_t host_len = binary_host_len(
+        status ? status -> host : nullptr
+    );
+
+    write_binary_int(buf, PG_STATUS_BINARY_MAGIC, 4);
+    write_binary_int(buf + 4, PG_STATUS_BINARY_VERSION, 2);
+    write_binary_int(buf + 6, host_len, 2);
+    write_binary_int(buf + 8, status ? status -> roles : 0, 4);
+    write_binary_int(buf + 12, 0, 4);
+    write_binary_int(buf + 16, generation, 8);
+    write_binary_int(buf + 24, status ? status -> delay_ms : 0, 8);
+    write_binary_int(buf + 32, status ? status -> delay_bytes : 0, 8);
+    if (host_len) {
+        memcpy(buf + PG_STATUS_BINARY_HEADER_LEN, status -> host, host_len);
+    }
+}
+
+/**
+ * Renders the binary records of the snapshot and their responses.
+ * The records carry the lags, so they are rendered for every snapshot.
+ */
+void render_binary(
+    ClusterBodies *bodies,
+    SnapshotResponses *responses,
+    const Topology *topology
+) {
+    if (!bodies -> binary_offsets) {
+        init_binary_offsets(bodies, topology);
+    }
+    const size_t *offsets = bodies -> binary_offsets;
+
+    responses -> records = malloc(offsets[topology -> hosts_cnt + 1]);
+    responses -> binary = calloc(
+        topology -> hosts_cnt + 1, sizeof(MHD_Response *)
+    );
+    if (!responses -> records || !responses -> binary) {
+        raise_error("Can't allocate memory for responses");
+    }
+
+    for (unsigned int i = 0; i <= topology -> hosts_cnt; i++) {
+        char *record = responses -> records + offsets[i];
+        write_binary_record(
+            record,
+            i < topology -> hosts_cnt ? &topology -> hosts[i] : nullptr,
+            topology -> generation
+        );
+        responses -> binary[i] = create_no_store_response(
+            record, offsets[i + 1] - offsets[i], RESPONSE_BINARY
+        );
+    }
+}
+
+/**
+ * Renders the json with the generation of the topology snapshot
+ * and the hosts playing each role:
+ * {"generation": 1, "master": "host", "replicas": ["host"], ...}
+ * The string must be freed by the caller.
+ */
+char *render_state_body(const Topology *topology) {
+    JsonWriter writer;
+    json_writer_init(&writer, nullptr, 0);
+
+    json_begin_object(&writer);
+    json_key(&writer, "generation");
+    json_uint(&writer, topology -> generation);
+    json_key(&writer, "master");
+    json_string(&writer, topology_host_name(topology, topology -> master));
+
+    for (unsigned int role = ROLE_REPLICA; role < HOST_ROLES_CNT; role++) {
+        json_key(&writer, state_role_keys[role]);
+        json_begin_array(&writer);
+        const TopologyRole *hosts = &topology -> roles[role];
+        for (unsigned int i = 0; i < hosts -> cnt; i++) {
+            json_string(&writer, topology -> hosts[hosts -> hosts[i]].host);
+        }
+        json_end_array(&writer);
+    }
+    json_end_object(&writer);
+
+    return json_writer_finish(&writer);
+}
+
+/**
+ * Renders the bodies that depend on the roles when the generation
+ * of the snapshot differs from the one they were rendered for
+ */
+void render_generation(ClusterBodies *bodies, const Topology *topology) {
+    if (bodies -> replicas && bodies -> generation == topology -> generation) {
+        return;
+    }
+
+    free(bodies -> replicas);
+    free(bodies -> state);
+    bodies -> generation = topology -> generation;
+    bodies -> replicas = render_replicas_body(topology);
+    bodies -> state = render_state_body(topology);
+}
+
+/**
+ * Builds the responses of the cluster for the topology snapshot,
+ * see SnapshotResponses
+ */
+SnapshotResponses *render_snapshot_responses(
+    const MonitorCluster *cluster,
+    ClusterBodies *bodies,
+    const Topology *topology
+) {
+    SnapshotResponses *responses = calloc(1, sizeof(SnapshotResponses));
+    if (!responses) {
+        raise_error("Can't allocate memory for responses");
+    }
+    responses -> topology = init_topology(cluster);
+    copy_topology(responses -> topology, topology);
+    responses -> no_store_hosts = bodies -> no_store_hosts;
+
+    char expires[32];
+    format_next_check_date(expires, sizeof(expires), topology);
+
+    const unsigned int hosts_cnt = topology -> hosts_cnt;
+    responses -> hosts = calloc(
+        hosts_cnt * RESPONSE_FORMATS_CNT, sizeof(SharedResponse)
+    );
+    if (!responses -> hosts) {
+        raise_error("Can't allocate memory for responses");
+    }
+    for (unsigned int i = 0; i < hosts_cnt; i++) {
+        for (unsigned int j = 0; j < RESPONSE_BINARY; j++) {
+            create_topology_response(
+                &responses -> hosts[i * RESPONSE_FORMATS_CNT + j],
+                bodies -> hosts[i * RESPONSE_FORMATS_CNT + j],
+                MHD_RESPMEM_PERSISTENT,
+                j, topology -> generation, i, expires
+            );
+        }
+    }
+
+    render_binary(bodies, responses, topology);
+
+    create_topology_response(
+        &responses -> replicas, bodies -> replicas, MHD_RESPMEM_MUST_COPY,
+        RESPONSE_JSON, topology -> generation, TOPOLOGY_NO_HOST, expires
+    );
+    create_topology_response(
+        &responses -> state, bodies -> state, MHD_RESPMEM_MUST_COPY,
+        RESPONSE_JSON, topology -> generation, TOPOLOGY_NO_HOST, nullptr
+    );
+    return responses;
+}
+
+/**
+ * Destroys the responses of the snapshot. mhd frees the ones still
+ * being sent once they are sent.
+ */
+void free_snapshot_responses(SnapshotResponses *responses) {
+    const unsigned int hosts_cnt = responses -> topology -> hosts_cnt;
+    for (unsigned int i = 0; i < hosts_cnt; i++) {
+        for (unsigned int j = 0; j < RESPONSE_BINARY; j++) {
+            destroy_topology_response(
+                &responses -> hosts[i * RESPONSE_FORMATS_CNT + j]
+            );
+        }
+    }
+    for (unsigned int i = 0; i <= hosts_cnt; i++) {
+        MHD_destroy_response(responses -> binary[i]);
+    }
+    destroy_topology_response(&responses -> replicas);
+    destroy_topology_response(&responses -> state);
+
+    free(responses -> hosts);
+    free(responses -> binary);
+    free(responses -> records);
+    free(responses -> topology);
+    free(responses);
+}
+
+/**
+ * Publishes the responses of the snapshot over the previous ones and frees
+ * the retired responses that no read section can see anymore
+ */
+void publish_snapshot_responses(
+    ClusterBodies *bodies, SnapshotResponses *responses
+) {
+    // The monitoring thread is the only writer of the pointer
+    SnapshotResponses *previous = atomic_load_explicit(
+        &bodies -> snapshot, memory_order_relaxed
+    );
+    atomic_store_explicit(
+        &bodies -> snapshot, responses, memory_order_release
+    );
+    if (previous) {
+        previous -> retired_epoch = retire_epoch();
+        previous -> next = bodies -> retired;
+        bodies -> retired = previous;
+    }
+
+    SnapshotResponses **link = &bodies -> retired;
+    while (*link) {
+        SnapshotResponses *retired = *link;
+        if (!is_epoch_reclaimable(retired -> retired_epoch)) {
+            link = &retired -> next;
+            continue;
+        }
+        *link = retired -> next;
+        free_snapshot_responses(retired);
+    }
+}
+
+/**
+ * topology_listener that renders the responses of the cluster for
+ * the published topology snapshot.
+ * Must be added with add_topology_listener before start_pg_monitor.
+ *
+ * The hosts never change and are rendered on the first call,
+ * the bodies that depend on the roles are rendered again only when
+ * the generation changes. The responses carry the time of the next check
+ * and the binary records carry the lags, so the responses are built
+ * for every snapshot.
+ *
+ * The first calls come from start_pg_monitor before the request threads
+ * start, so the cache is allocated there.
+ */
+void render_cluster_responses(
+    const MonitorCluster *cluster, const Topology *topology
+) {
+    if (!cluster_bodies) {
+        cluster_bodies = calloc(get_clusters_cnt(), sizeof(ClusterBodies));
+        if (!cluster_bodies) {
+            raise_error("Can't allocate memory for responses");
+        }
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        etag_epoch = (
+            (unsigned long long)ts.tv_sec * 1000000000ULL +
+            (unsigned long long)ts.tv_nsec
+        );
+    }
+
+    ClusterBodies *bodies = &cluster_bodies[cluster -> index];
+    if (!bodies -> hosts) {
+        bodies -> hosts = render_hosts(topology);
+        bodies -> no_store_hosts = create_no_store_hosts(
+            bodies -> hosts, topology -> hosts_cnt
+        );
+    }
+    render_generation(bodies, topology);
+
+    publish_snapshot_responses(
+        bodies, render_snapshot_responses(cluster, bodies, topology)
+    );
+}
+
+/**
+ * Returns the responses of the last rendered topology snapshot
+ * of the cluster. Like the result of get_topology, they may only be used
+ * inside a read section, see enter_read_section.
+ *
+ * The responses are rendered after their snapshot is published, so
+ * get_topology may already return a newer one. The hosts of an answer
+ * must be selected against snapshot_topology instead, so that their
+ * indexes and the responses come from the same snapshot.
+ */
+const SnapshotResponses *get_snapshot_responses(
+    const MonitorCluster *cluster
+) {
+    return atomic_load_explicit(
+        &cluster_bodies[cluster -> index].snapshot, memory_order_acquire
+    );
+}
+
+/**
+ * Returns the copy of the topology snapshot the responses were rendered
+ * from. It lives as long as the responses.
+ */
+const Topology *snapshot_topology(const SnapshotResponses *responses) {
+    return responses -> topology;
+}
+
+/**
+ * Answers with the shared response, or with its 304 response if
+ * If-None-Match of the request has its ETag
+ */
+void send_topology_response(
+    HTTPResponse *response, const SharedResponse *shared
+) {
+    response -> shared_response = true;
+    if (is_request_etag_matched(response, shared -> etag)) {
+        response -> mhd_response = shared -> not_modified;
+        response -> status_code = MHD_HTTP_NOT_MODIFIED;
+        return;
+    }
+    response -> mhd_response = shared -> response;
+}
+
+/**
+ * Answers with the shared response with the host of the snapshot by its
+ * index, or with 404 for TOPOLOGY_NO_HOST.
+ * A cacheable answer may be kept by the client until the next check
+ * of the cluster. The others differ between requests and must not be
+ * stored at all, and neither must the answers without a host and the
+ * binary answers, which carry the lags that change with every check.
+ */
+void send_host_response(
+    HTTPResponse *response,
+    const SnapshotResponses *responses,
+    const unsigned int host,
+    const ResponseFormat format,
+    const bool cacheable
+) {
+    const unsigned int row = (
+        host == TOPOLOGY_NO_HOST ? responses -> topology -> hosts_cnt : host
+    );
+    response -> status_code = (
+        host == TOPOLOGY_NO_HOST ? MHD_HTTP_NOT_FOUND : MHD_HTTP_OK
+    );
+    response -> shared_response = true;
+
+    if (format == RESPONSE_BINARY) {
+        response -> mhd_response = responses -> binary[row];
+        return;
+    }
+    if (!cacheable || host == TOPOLOGY_NO_HOST) {
+        response -> mhd_response = responses -> no_store_hosts[
+            row * RESPONSE_FORMATS_CNT + format
+        ];
+        return;
+    }
+    send_topology_response(
+        response, &responses -> hosts[row * RESPONSE_FORMATS_CNT + format]
+    );
+}
+
+/**
+ * Answers with the shared json response with the live replicas.
+ * It may be kept by the client until the next check of the cluster.
+ */
+void send_replicas_response(
+    HTTPResponse *response, const SnapshotResponses *responses
+) {
+    send_topology_response(response, &responses -> replicas);
+}
+
+/**
+ * Answers with the shared json response with the generation and the hosts
+ * playing each role. It must be revalidated every time.
+ */
+void send_state_response(
+    HTTPResponse *response, const SnapshotResponses *responses
+) {
+    send_topology_response(response, &responses -> state);
+}
+
+/**
+ * Concatenates the binary records with the hosts of the cluster by their
+ * indexes in the snapshot of the responses, and sets the length.
+ * The string must be freed by the caller.
+ */
+char *concat_host_binary_bodies(
+    const MonitorCluster *cluster,
+    const SnapshotResponses *responses,
+    const unsigned int *hosts,
+    const unsigned int cnt,
+    size_t *len
+) {
+    const ClusterBodies *bodies = &cluster_bodies[cluster -> index];
+
+    *len = 0;
+    for (unsigned int i = 0; i < cnt; i++) {
+        const unsigned int row = (
+            hosts[i] == TOPOLOGY_NO_HOST ? cluster -> hosts_cnt : hosts[i]
+        );
+        *len += (
+            bodies -> binary_offsets[row + 1] - bodies -> binary_offsets[row]
+        );
+    }
+
+    char *body = malloc(*len);
+    if (!body) {
+        raise_error("Can't allocate memory for a response");
+    }
+
+    char *end = body;
+    for (unsigned int i = 0; i < cnt; i++) {
+        const unsigned int row = (
+            hosts[i] == TOPOLOGY_NO_HOST ? cluster -> hosts_cnt : hosts[i]
+        );
+        const size_t record_len = (
+            bodies -> binary_offsets[row + 1] - bodies -> binary_offsets[row]
+        );
+        memcpy(
+            end, responses -> records + bodies -> binary_offsets[row],
+            record_len
+        );
+        end += record_len;
+    }
+    return body;
+}
+
+/**
+ * Makes the answer with the hosts of the topology snapshot of the
+ * generation cacheable, see set_response_cache. Its ETag changes with
+ * the generation and the format, and it must be revalidated every time.
+ * Returns true if the client already has the response.
+ */
+bool set_topology_cache(
+    HTTPResponse *response,
+    const unsigned long long generation,
+    const ResponseFormat format
+) {
+    char etag[HTTP_ETAG_LEN];
+    format_topology_etag(etag, generation, format, TOPOLOGY_NO_HOST);
+    return set_response_cache(response, etag, HTTP_NO_MAX_AGE);
+}
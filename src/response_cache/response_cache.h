@@ -0,0 +1,138 @@
+#ifndef PG_STATUS_RESPONSE_CACHE_H
+#define PG_STATUS_RESPONSE_CACHE_H
+
+#include "http_server.h"
+#include "pg_monitor.h"
+
+/**
+ * Formats in which responses are rendered
+ */
+typedef enum ResponseFormat {
+    RESPONSE_TEXT = 0,
+    RESPONSE_JSON,
+
+    // Records of pg_status_binary.h. Unlike the others, they carry the lags
+    // and so are rendered for every topology snapshot
+    RESPONSE_BINARY,
+    RESPONSE_FORMATS_CNT,
+} ResponseFormat;
+
+/**
+ * Responses of a cluster built for one topology snapshot and shared
+ * by all requests, see get_snapshot_responses
+ */
+typedef struct SnapshotResponses SnapshotResponses;
+
+/**
+ * Returns the content type of the format
+ */
+const char *response_content_type(ResponseFormat format);
+
+/**
+ * topology_listener that renders the responses of the cluster for
+ * the published topology snapshot.
+ * Must be added with add_topology_listener before start_pg_monitor.
+ */
+void render_cluster_responses(
+    const MonitorCluster *cluster, const Topology *topology
+);
+
+/**
+ * Renders the text or json body with the host.
+ * A host equal to nullptr means the body without a host.
+ * The string must be freed by the caller.
+ */
+char *render_host(const char *host, ResponseFormat format);
+
+/**
+ * Renders the json array with the live replicas of the snapshot.
+ * The string must be freed by the caller.
+ */
+char *render_replicas_body(const Topology *topology);
+
+/**
+ * Renders the json with the generation of the topology snapshot
+ * and the hosts playing each role:
+ * {"generation": 1, "master": "host", "replicas": ["host"], ...}
+ * The string must be freed by the caller.
+ */
+char *render_state_body(const Topology *topology);
+
+/**
+ * Returns the responses of the last rendered topology snapshot
+ * of the cluster. Like the result of get_topology, they may only be used
+ * inside a read section, see enter_read_section.
+ *
+ * The responses are rendered after their snapshot is published, so
+ * get_topology may already return a newer one. The hosts of an answer
+ * must be selected against snapshot_topology instead, so that their
+ * indexes and the responses come from the same snapshot.
+ */
+const SnapshotResponses *get_snapshot_responses(
+    const MonitorCluster *cluster
+);
+
+/**
+ * Returns the copy of the topology snapshot the responses were rendered
+ * from. It lives as long as the responses.
+ */
+const Topology *snapshot_topology(const SnapshotResponses *responses);
+
+/**
+ * Answers with the shared response with the host of the snapshot by its
+ * index, or with 404 for TOPOLOGY_NO_HOST.
+ * A cacheable answer may be kept by the client until the next check
+ * of the cluster. The others differ between requests and must not be
+ * stored at all, and neither must the answers without a host and the
+ * binary answers, which carry the lags that change with every check.
+ */
+void send_host_response(
+    HTTPResponse *response,
+    const SnapshotResponses *responses,
+    unsigned int host,
+    ResponseFormat format,
+    bool cacheable
+);
+
+/**
+ * Answers with the shared json response with the live replicas.
+ * It may be kept by the client until the next check of the cluster.
+ */
+void send_replicas_response(
+    HTTPResponse *response, const SnapshotResponses *responses
+);
+
+/**
+ * Answers with the shared json response with the generation and the hosts
+ * playing each role. It must be revalidated every time.
+ */
+void send_state_response(
+    HTTPResponse *response, const SnapshotResponses *responses
+);
+
+/**
+ * Concatenates the binary records with the hosts of the cluster by their
+ * indexes in the snapshot of the responses, and sets the length.
+ * The string must be freed by the caller.
+ */
+char *concat_host_binary_bodies(
+    const MonitorCluster *cluster,
+    const SnapshotResponses *responses,
+    const unsigned int *hosts,
+    unsigned int cnt,
+    size_t *len
+);
+
+/**
+ * Makes the answer with the hosts of the topology snapshot of the
+ * generation cacheable, see set_response_cache. Its ETag changes with
+ * the generation and the format, and it must be revalidated every time.
+ * Returns true if the client already has the response.
+ */
+bool set_topology_cache(
+    HTTPResponse *response,
+    unsigned long long generation,
+    ResponseFormat format
+);
+
+#endif //PG_STATUS_RESPONSE_CACHE_H
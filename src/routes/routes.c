@@ -0,0 +1,393 @@
+#include "routes.h"
+
+#include "events.h"
+#include "http_server.h"
+#include "metrics.h"
+#include "pg_monitor.h"
+#include "response_cache.h"
+#include "utils.h"
+#include "watch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * A role that can be requested from /hosts, named as its route
+ */
+typedef struct WantedRole {
+    const char *name;
+    HostRole role;
+
+    // Whether the hosts playing the role are returned in turn,
+    // see select_host. Otherwise the first one is returned, see find_host
+    bool rotate;
+} WantedRole;
+
+/**
+ * Roles that can be requested from /hosts.
+ * They are answered as by the routes of the same name.
+ */
+const WantedRole wanted_roles[] = {
+    { "master", ROLE_MASTER, false },
+    { "replica", ROLE_REPLICA, true },
+    { "sync_by_time", ROLE_SYNC_BY_TIME, true },
+    { "sync_by_bytes", ROLE_SYNC_BY_BYTES, true },
+    { "sync_by_time_or_bytes", ROLE_SYNC_BY_TIME_OR_BYTES, true },
+    { "sync_by_time_and_bytes", ROLE_SYNC_BY_TIME_AND_BYTES, true },
+};
+
+# define WANTED_ROLES_CNT (sizeof(wanted_roles) / sizeof(wanted_roles[0]))
+
+/**
+ * Returns the cluster of the request: the one from /c/{cluster}/...
+ * or the default one. If there is no such cluster, sets 404
+ * and returns nullptr.
+ */
+MonitorCluster *request_cluster(HTTPResponse *response) {
+    if (!response -> scope) {
+        return get_default_cluster();
+    }
+
+    MonitorCluster *cluster = find_cluster(
+        response -> scope, response -> scope_len
+    );
+    if (!cluster) {
+        response -> status_code = 404;
+    }
+    return cluster;
+}
+
+/**
+ * Returns the format of the response requested in the Accept header
+ */
+ResponseFormat response_format(const HTTPResponse *response) {
+    if (need_json_response(response)) {
+        return RESPONSE_JSON;
+    }
+    if (
+        response -> content_type &&
+        is_equal_strings(
+            response -> content_type, response_content_type(RESPONSE_BINARY)
+        )
+    ) {
+        return RESPONSE_BINARY;
+    }
+    return RESPONSE_TEXT;
+}
+
+void get_replicas_json(HTTPResponse *response) {
+    const MonitorCluster *cluster = request_cluster(response);
+    if (!cluster) {
+        return;
+    }
+    send_replicas_response(response, get_snapshot_responses(cluster));
+}
+
+/**
+ * Returns the replicas in turn. Every request may get another one,
+ * so the answer must not be stored by the client.
+ */
+void get_random_replica(HTTPResponse *response) {
+    MonitorCluster *cluster = request_cluster(response);
+    if (!cluster) {
+        return;
+    }
+    const SnapshotResponses *responses = get_snapshot_responses(cluster);
+    const unsigned int host = topology_select_host_index(
+        cluster, snapshot_topology(responses), ROLE_REPLICA, true
+    );
+    send_host_response(
+        response, responses, host, response_format(response), false
+    );
+}
+
+void get_master(HTTPResponse *response) {
+    const MonitorCluster *cluster = request_cluster(response);
+    if (!cluster) {
+        return;
+    }
+    const SnapshotResponses *responses = get_snapshot_responses(cluster);
+    const unsigned int host = topology_find_host_index(
+        snapshot_topology(responses), ROLE_MASTER, false
+    );
+    send_host_response(
+        response, responses, host, response_format(response), true
+    );
+}
+
+/**
+ * Returns the synchronous replicas in turn. Any of them is a valid answer
+ * until the next check, so a cached one is kept by the client. Its ETag
+ * has the host, so a revalidated answer moves on to the next host.
+ */
+void return_sync_host(HTTPResponse *response, const HostRole role) {
+    MonitorCluster *cluster = request_cluster(response);
+    if (!cluster) {
+        return;
+    }
+    const SnapshotResponses *responses = get_snapshot_responses(cluster);
+    const unsigned int host = topology_select_host_index(
+        cluster, snapshot_topology(responses), role, true
+    );
+    send_host_response(
+        response, responses, host, response_format(response), true
+    );
+}
+
+void get_sync_host_by_time(HTTPResponse *response) {
+    return_sync_host(response, ROLE_SYNC_BY_TIME);
+}
+
+void get_sync_host_by_bytes(HTTPResponse *response) {
+    return_sync_host(response, ROLE_SYNC_BY_BYTES);
+}
+
+void get_sync_host_by_time_or_bytes(HTTPResponse *response) {
+    return_sync_host(response, ROLE_SYNC_BY_TIME_OR_BYTES);
+}
+
+void get_sync_host_by_time_and_bytes(HTTPResponse *response) {
+    return_sync_host(response, ROLE_SYNC_BY_TIME_AND_BYTES);
+}
+
+/**
+ * Returns the generation and the hosts playing each role.
+ * With ?since={generation}, waits until the generation differs from it
+ * or until the watch timeout.
+ */
+void watch_topology(HTTPResponse *response) {
+    const MonitorCluster *cluster = request_cluster(response);
+    if (!cluster) {
+        return;
+    }
+
+    const char *since = get_request_argument(response, "since");
+    unsigned long long generation = 0;
+    if (since && !parse_ull(since, &generation)) {
+        response -> status_code = 400;
+        return;
+    }
+    if (since && wait_topology_change(response, cluster, generation)) {
+        return;
+    }
+    send_state_response(response, get_snapshot_responses(cluster));
+}
+
+/**
+ * Streams the topology events as Server-Sent Events
+ */
+void stream_events(HTTPResponse *response) {
+    const MonitorCluster *cluster = request_cluster(response);
+    if (!cluster) {
+        return;
+    }
+    subscribe_topology_events(response, cluster);
+}
+
+/**
+ * Returns the role from wanted_roles by its name, or nullptr.
+ * The name is not null-terminated.
+ */
+const WantedRole *find_wanted_role(const char *name, const size_t len) {
+    for (unsigned int i = 0; i < WANTED_ROLES_CNT; i++) {
+        if (
+            strlen(wanted_roles[i].name) == len &&
+            strncmp(wanted_roles[i].name, name, len) == 0
+        ) {
+            return &wanted_roles[i];
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * Parses the comma-separated list of roles from /hosts?want=...
+ * into wanted, which must fit WANTED_ROLES_CNT roles.
+ * Returns the number of roles, or 0 if the list is empty or has
+ * an unknown or repeated role.
+ */
+unsigned int parse_wanted_roles(const char *want, const WantedRole **wanted) {
+    unsigned int cnt = 0;
+
+    while (true) {
+        const char *end = strchr(want, ',');
+        const size_t len = end ? (size_t)(end - want) : strlen(want);
+
+        const WantedRole *role = find_wanted_role(want, len);
+        if (!role) {
+            return 0;
+        }
+        for (unsigned int i = 0; i < cnt; i++) {
+            if (wanted[i] == role) {
+                return 0;
+            }
+        }
+        wanted[cnt++] = role;
+
+        if (!end) {
+            return cnt;
+        }
+        want = end + 1;
+    }
+}
+
+/**
+ * Renders the hosts of the roles as lines in the order of the roles.
+ * A line is empty if no host plays the role.
+ */
+char *wanted_hosts_to_text(
+    const Topology *topology,
+    const unsigned int *hosts,
+    const unsigned int cnt
+) {
+    size_t len = 0;
+    for (unsigned int i = 0; i < cnt; i++) {
+        const char *host = topology_host_name(topology, hosts[i]);
+        len += (host ? strlen(host) : 0) + 1;
+    }
+
+    char *body = malloc(len + 1);
+    if (!body) {
+        raise_error("Can't allocate memory for a response");
+    }
+
+    char *end = body;
+    for (unsigned int i = 0; i < cnt; i++) {
+        const char *host = topology_host_name(topology, hosts[i]);
+        if (host) {
+            const size_t host_len = strlen(host);
+            memcpy(end, host, host_len);
+            end += host_len;
+        }
+        *end++ = '\n';
+    }
+    *end = '\0';
+    return body;
+}
+
+/**
+ * Renders the hosts of the roles as a json object keyed by the role names:
+ * {"master": "host", "replica": null}
+ * The json is written to the thread-local pool unless it outgrows it,
+ * see json_writer_init_pooled, so the memory mode of the response
+ * depends on writer.heap.
+ */
+char *wanted_hosts_to_json(
+    JsonWriter *writer,
+    const Topology *topology,
+    const WantedRole **wanted,
+    const unsigned int *hosts,
+    const unsigned int cnt
+) {
+    json_writer_init_pooled(writer);
+    json_begin_object(writer);
+    for (unsigned int i = 0; i < cnt; i++) {
+        json_key(writer, wanted[i] -> name);
+        json_string(writer, topology_host_name(topology, hosts[i]));
+    }
+    json_end_object(writer);
+    return json_writer_finish(writer);
+}
+
+/**
+ * Returns the hosts of several roles at once from one topology snapshot:
+ * /hosts?want=master,replica,sync_by_time
+ * Each role is answered as by its own route. An answer with any role
+ * whose hosts are returned in turn must not be stored by the client.
+ * Unlike the answers of the other routes, it is built per request:
+ * the lists of roles are too many to build their responses in advance.
+ */
+void get_hosts(HTTPResponse *response) {
+    MonitorCluster *cluster = request_cluster(response);
+    if (!cluster) {
+        return;
+    }
+
+    const char *want = get_request_argument(response, "want");
+    const WantedRole *wanted[WANTED_ROLES_CNT];
+    const unsigned int cnt = want ? parse_wanted_roles(want, wanted) : 0;
+    if (cnt == 0) {
+        response -> status_code = 400;
+        return;
+    }
+
+    const SnapshotResponses *responses = get_snapshot_responses(cluster);
+    const Topology *topology = snapshot_topology(responses);
+    unsigned int hosts[WANTED_ROLES_CNT];
+    bool rotate = false;
+    for (unsigned int i = 0; i < cnt; i++) {
+        hosts[i] = (
+            wanted[i] -> rotate ?
+                topology_select_host_index(
+                    cluster, topology, wanted[i] -> role, true
+                ) :
+                topology_find_host_index(topology, wanted[i] -> role, false)
+        );
+        rotate = rotate || wanted[i] -> rotate;
+    }
+    if (rotate) {
+        set_response_no_store(response);
+    }
+
+    const ResponseFormat format = response_format(response);
+    response -> content_type = response_content_type(format);
+    response -> memory_mode = MHD_RESPMEM_MUST_FREE;
+    if (format == RESPONSE_BINARY) {
+        // The records carry the lags that change with every check
+        set_response_no_store(response);
+        response -> response = concat_host_binary_bodies(
+            cluster, responses, hosts, cnt, &response -> response_len
+        );
+        return;
+    }
+
+    if (
+        !rotate &&
+        set_topology_cache(response, topology -> generation, format)
+    ) {
+        return;
+    }
+    if (format == RESPONSE_JSON) {
+        JsonWriter writer;
+        response -> response = wanted_hosts_to_json(
+            &writer, topology, wanted, hosts, cnt
+        );
+        response -> memory_mode = (
+            writer.heap ? MHD_RESPMEM_MUST_FREE : MHD_RESPMEM_MUST_COPY
+        );
+        return;
+    }
+    response -> response = wanted_hosts_to_text(topology, hosts, cnt);
+}
+
+
+/**
+ * Returns the metrics of the monitored hosts in the Prometheus text format
+ */
+void get_metrics(HTTPResponse *response) {
+    response -> response = render_metrics();
+    response -> memory_mode = MHD_RESPMEM_MUST_FREE;
+    response -> content_type = METRICS_CONTENT_TYPE;
+}
+
+/**
+ * Routes of pg-status
+ */
+Route pg_status_routes[] = {
+    { "GET", "/master", get_master },
+    { "GET", "/replica", get_random_replica },
+    { "GET", "/replicas_info", get_replicas_json },
+    { "GET", "/sync_by_time", get_sync_host_by_time },
+    { "GET", "/sync_by_bytes", get_sync_host_by_bytes },
+    { "GET", "/sync_by_time_or_bytes", get_sync_host_by_time_or_bytes },
+    { "GET", "/sync_by_time_and_bytes", get_sync_host_by_time_and_bytes },
+    { "GET", "/hosts", get_hosts },
+    { "GET", "/watch", watch_topology },
+    { "GET", "/events", stream_events },
+    { "GET", "/metrics", get_metrics },
+};
+
+const unsigned int pg_status_routes_cnt = (
+    sizeof(pg_status_routes) / sizeof(pg_status_routes[0])
+);
@@ -0,0 +1,16 @@
+#ifndef PG_STATUS_ROUTES_H
+#define PG_STATUS_ROUTES_H
+
+#include "http_server.h"
+
+/**
+ * Routes of pg-status with their handlers, see start_http_server
+ */
+extern Route pg_status_routes[];
+
+/**
+ * Number of pg_status_routes
+ */
+extern const unsigned int pg_status_routes_cnt;
+
+#endif //PG_STATUS_ROUTES_H
@@ -0,0 +1,281 @@
+#ifndef PG_STATUS_SHM_H
+#define PG_STATUS_SHM_H
+
+/**
+ * Header-only reader of the pg-status shared memory segment.
+ *
+ * pg-status publishes the topology of every cluster into its own file,
+ * pg_status__shm_dir/pg_status.{cluster}, which local processes can map
+ * and read with plain memory loads, without syscalls.
+ *
+ * The segment has a fixed layout protected by a seqlock: the writer makes
+ * the sequence odd while it changes the data, so a reader retries
+ * if the sequence was odd or has changed during the read.
+ *
+ * pg-status replaces the file with a new one when it starts, and marks
+ * the segment closed and removes the file when it stops. A mapping of the
+ * old file is never written again, so after a restart the reader must
+ * open the segment anew. A segment that is closed or hasn't been published
+ * for a while, for example because pg-status has crashed, must not be
+ * trusted, see pg_status_shm_is_fresh.
+ *
+ * Usage:
+ *     const PgStatusShmSegment *segment = pg_status_shm_open(path);
+ *     char master[PG_STATUS_SHM_HOST_LEN];
+ *     if (
+ *         pg_status_shm_is_fresh(segment, max_age_ms) &&
+ *         pg_status_shm_find_host(
+ *             segment, PG_STATUS_SHM_ROLE_MASTER, false,
+ *             master, sizeof(master)
+ *         )
+ *     ) { ... }
+ *     else {
+ *         pg_status_shm_close(segment);
+ *         segment = pg_status_shm_open(path);
+ *     }
+ */
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/**
+ * Identifies the segment and the version of its layout.
+ * The version changes whenever the layout does.
+ */
+# define PG_STATUS_SHM_MAGIC 0x54535350U // PSST
+# define PG_STATUS_SHM_VERSION 2U
+
+/**
+ * Limits of the fixed layout. pg-status refuses to start with the segments
+ * enabled for a cluster with more hosts, longer host names are truncated.
+ */
+# define PG_STATUS_SHM_MAX_HOSTS 64U
+# define PG_STATUS_SHM_HOST_LEN 256U
+
+/**
+ * Host index meaning that there is no such host
+ */
+# define PG_STATUS_SHM_NO_HOST UINT32_MAX
+
+/**
+ * Roles of a host, bits of PgStatusShmHost.roles.
+ * The same as the HostRole of pg-status.
+ */
+# define PG_STATUS_SHM_ROLE_MASTER (1U << 0)
+# define PG_STATUS_SHM_ROLE_REPLICA (1U << 1)
+# define PG_STATUS_SHM_ROLE_SYNC_BY_TIME (1U << 2)
+# define PG_STATUS_SHM_ROLE_SYNC_BY_BYTES (1U << 3)
+# define PG_STATUS_SHM_ROLE_SYNC_BY_TIME_OR_BYTES (1U << 4)
+# define PG_STATUS_SHM_ROLE_SYNC_BY_TIME_AND_BYTES (1U << 5)
+# define PG_STATUS_SHM_ROLES_CNT 6U
+
+/**
+ * Status of a host
+ */
+typedef struct PgStatusShmHost {
+    char host[PG_STATUS_SHM_HOST_LEN];
+    uint64_t delay_ms;
+    uint64_t delay_bytes;
+
+    // Bitmask of PG_STATUS_SHM_ROLE_*
+    uint32_t roles;
+
+    uint8_t alive;
+    uint8_t is_master;
+    uint8_t reserved[2];
+} PgStatusShmHost;
+
+/**
+ * The shared memory segment of a cluster
+ */
+typedef struct PgStatusShmSegment {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t max_hosts;
+    uint32_t host_len;
+
+    // Odd while the writer changes the data below
+    _Atomic(uint64_t) sequence;
+
+    // Incremented whenever the master, the replicas or the sync replicas
+    // change
+    uint64_t generation;
+
+    // Time (ms, CLOCK_MONOTONIC) of the last publication. The segment
+    // is published after every check of the cluster
+    uint64_t published_ms;
+
+    // Index of the live master, or PG_STATUS_SHM_NO_HOST
+    uint32_t master;
+
+    uint32_t hosts_cnt;
+
+    // Set when pg-status stops: the segment is never written again
+    uint32_t closed;
+
+    // Index of the first host playing each role, or PG_STATUS_SHM_NO_HOST.
+    // Indexed by the bit number of PG_STATUS_SHM_ROLE_*
+    uint32_t role_first[PG_STATUS_SHM_ROLES_CNT];
+
+    PgStatusShmHost hosts[PG_STATUS_SHM_MAX_HOSTS];
+} PgStatusShmSegment;
+
+
+/**
+ * Maps the segment at the path for reading.
+ * Returns NULL if it can't be mapped or has another layout.
+ */
+static inline const PgStatusShmSegment *pg_status_shm_open(const char *path) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    void *memory = mmap(
+        NULL, sizeof(PgStatusShmSegment), PROT_READ, MAP_SHARED, fd, 0
+    );
+    close(fd);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+
+    const PgStatusShmSegment *segment = memory;
+    if (
+        segment -> magic != PG_STATUS_SHM_MAGIC ||
+        segment -> version != PG_STATUS_SHM_VERSION ||
+        segment -> max_hosts != PG_STATUS_SHM_MAX_HOSTS ||
+        segment -> host_len != PG_STATUS_SHM_HOST_LEN
+    ) {
+        munmap(memory, sizeof(PgStatusShmSegment));
+        return NULL;
+    }
+    return segment;
+}
+
+/**
+ * Unmaps the segment
+ */
+static inline void pg_status_shm_close(const PgStatusShmSegment *segment) {
+    munmap((void *) segment, sizeof(PgStatusShmSegment));
+}
+
+/**
+ * Starts a read of the segment. Returns the sequence to pass to
+ * pg_status_shm_read_end.
+ */
+static inline uint64_t pg_status_shm_read_begin(
+    const PgStatusShmSegment *segment
+) {
+    uint64_t sequence;
+    do {
+        sequence = atomic_load_explicit(
+            (_Atomic(uint64_t) *) &segment -> sequence, memory_order_acquire
+        );
+    } while (sequence & 1);
+    return sequence;
+}
+
+/**
+ * Finishes a read of the segment.
+ * Returns false if the data has changed during the read and the read
+ * must be repeated.
+ */
+static inline bool pg_status_shm_read_end(
+    const PgStatusShmSegment *segment, const uint64_t sequence
+) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(
+        (_Atomic(uint64_t) *) &segment -> sequence, memory_order_relaxed
+    ) == sequence;
+}
+
+/**
+ * Copies a consistent state of the whole segment to snapshot
+ */
+static inline void pg_status_shm_read(
+    const PgStatusShmSegment *segment, PgStatusShmSegment *snapshot
+) {
+    uint64_t sequence;
+    do {
+        sequence = pg_status_shm_read_begin(segment);
+        memcpy(snapshot, segment, sizeof(PgStatusShmSegment));
+    } while (!pg_status_shm_read_end(segment, sequence));
+}
+
+/**
+ * Checks that the segment is still written by a running pg-status:
+ * it is not closed and has been published at most max_age_ms ago.
+ * max_age_ms should cover a few check intervals of the cluster
+ * and the connect timeout.
+ * Returns false if the segment must not be trusted and must be reopened.
+ */
+static inline bool pg_status_shm_is_fresh(
+    const PgStatusShmSegment *segment, const uint64_t max_age_ms
+) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    const uint64_t now_ms = (
+        (uint64_t) ts.tv_sec * 1000U + (uint64_t) ts.tv_nsec / 1000000U
+    );
+
+    bool fresh;
+    uint64_t sequence;
+    do {
+        sequence = pg_status_shm_read_begin(segment);
+        fresh = (
+            !segment -> closed &&
+            segment -> published_ms + max_age_ms >= now_ms
+        );
+    } while (!pg_status_shm_read_end(segment, sequence));
+
+    return fresh;
+}
+
+/**
+ * Copies the name of the first host playing the role to host.
+ * role is one of PG_STATUS_SHM_ROLE_*.
+ * If no host plays the role and master_if_not_found is set,
+ * copies the master.
+ * Returns false if there is no such host.
+ */
+static inline bool pg_status_shm_find_host(
+    const PgStatusShmSegment *segment,
+    const uint32_t role,
+    const bool master_if_not_found,
+    char *host,
+    const size_t host_len
+) {
+    const unsigned int role_index = (unsigned int) __builtin_ctz(role);
+    bool found;
+    uint64_t sequence;
+
+    do {
+        sequence = pg_status_shm_read_begin(segment);
+
+        uint32_t index = segment -> role_first[role_index];
+        if (index == PG_STATUS_SHM_NO_HOST && master_if_not_found) {
+            index = segment -> master;
+        }
+
+        found = index < PG_STATUS_SHM_MAX_HOSTS && host_len > 0;
+        if (found) {
+            const size_t len = (
+                host_len < PG_STATUS_SHM_HOST_LEN ?
+                    host_len : PG_STATUS_SHM_HOST_LEN
+            );
+            strncpy(host, segment -> hosts[index].host, len - 1);
+            host[len - 1] = '\0';
+        }
+    } while (!pg_status_shm_read_end(segment, sequence));
+
+    return found;
+}
+
+#endif //PG_STATUS_SHM_H
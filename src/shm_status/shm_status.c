@@ -0,0 +1,239 @@
+#include "shm_status.h"
+#include "pg_status_shm.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+_Static_assert(
+    PG_STATUS_SHM_ROLES_CNT == HOST_ROLES_CNT &&
+    PG_STATUS_SHM_ROLE_MASTER == ROLE_BIT(ROLE_MASTER) &&
+    PG_STATUS_SHM_ROLE_REPLICA == ROLE_BIT(ROLE_REPLICA) &&
+    PG_STATUS_SHM_ROLE_SYNC_BY_TIME == ROLE_BIT(ROLE_SYNC_BY_TIME) &&
+    PG_STATUS_SHM_ROLE_SYNC_BY_BYTES == ROLE_BIT(ROLE_SYNC_BY_BYTES) &&
+    PG_STATUS_SHM_ROLE_SYNC_BY_TIME_OR_BYTES ==
+        ROLE_BIT(ROLE_SYNC_BY_TIME_OR_BYTES) &&
+    PG_STATUS_SHM_ROLE_SYNC_BY_TIME_AND_BYTES ==
+        ROLE_BIT(ROLE_SYNC_BY_TIME_AND_BYTES),
+    "PG_STATUS_SHM_ROLE_* must match HostRole"
+);
+
+
+/**
+ * Directory of the segment files. nullptr disables the segments
+ */
+char *shm_dir = nullptr;
+
+/**
+ * Whether the segments have been created
+ */
+bool shm_initialized = false;
+
+/**
+ * Mapped segments of the clusters, indexed by MonitorCluster.index
+ */
+PgStatusShmSegment **shm_segments = nullptr;
+
+/**
+ * Paths of the segment files, indexed by MonitorCluster.index
+ */
+char **shm_paths = nullptr;
+
+
+/**
+ * Creates the segment file of the cluster, maps it and fills
+ * the layout description.
+ *
+ * The file is filled under a temporary name and then renamed over the path,
+ * so the readers that still map the file of a previous run keep a file
+ * of the full size, which is never truncated under them.
+ */
+PgStatusShmSegment *create_segment(const char *path) {
+    char *tmp_path = format_string("%s.%d.tmp", path, (int) getpid());
+    const int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        raise_error("Failed to create shared memory segment %s", tmp_path);
+    }
+    if (ftruncate(fd, sizeof(PgStatusShmSegment)) != 0) {
+        close(fd);
+        raise_error("Failed to resize shared memory segment %s", tmp_path);
+    }
+
+    void *memory = mmap(
+        nullptr, sizeof(PgStatusShmSegment),
+        PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0
+    );
+    close(fd);
+    if (memory == MAP_FAILED) {
+        raise_error("Failed to map shared memory segment %s", tmp_path);
+    }
+
+    PgStatusShmSegment *segment = memory;
+    segment -> max_hosts = PG_STATUS_SHM_MAX_HOSTS;
+    segment -> host_len = PG_STATUS_SHM_HOST_LEN;
+    segment -> version = PG_STATUS_SHM_VERSION;
+    atomic_init(&segment -> sequence, 0);
+    segment -> published_ms = 0;
+    segment -> closed = 0;
+    segment -> master = PG_STATUS_SHM_NO_HOST;
+    for (unsigned int i = 0; i < PG_STATUS_SHM_ROLES_CNT; i++) {
+        segment -> role_first[i] = PG_STATUS_SHM_NO_HOST;
+    }
+
+    // Readers check the magic first, so it is written last
+    atomic_thread_fence(memory_order_release);
+    segment -> magic = PG_STATUS_SHM_MAGIC;
+
+    if (rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        raise_error("Failed to replace shared memory segment %s", path);
+    }
+    free(tmp_path);
+    return segment;
+}
+
+/**
+ * Creates the segments of all clusters if pg_status__shm_dir is set.
+ * Called from start_pg_monitor before the monitoring thread starts.
+ * Fails with an error if a cluster has more hosts than the segment holds:
+ * its readers would otherwise be told there is no host of a role
+ * played by a host over the limit.
+ */
+void init_shm_status(void) {
+    shm_initialized = true;
+    replace_from_env("pg_status__shm_dir", &shm_dir);
+    if (!shm_dir) {
+        return;
+    }
+
+    const unsigned int clusters_cnt = get_clusters_cnt();
+    shm_segments = calloc(clusters_cnt, sizeof(PgStatusShmSegment *));
+    shm_paths = calloc(clusters_cnt, sizeof(char *));
+    if (!shm_segments || !shm_paths) {
+        raise_error("Can't allocate memory for shared memory segments");
+    }
+
+    for (unsigned int i = 0; i < clusters_cnt; i++) {
+        const MonitorCluster *cluster = get_cluster(i);
+        if (cluster -> hosts_cnt > PG_STATUS_SHM_MAX_HOSTS) {
+            raise_error(
+                "Cluster %s has %u hosts, pg_status__shm_dir supports "
+                "at most %u", cluster -> name, cluster -> hosts_cnt,
+                PG_STATUS_SHM_MAX_HOSTS
+            );
+        }
+    }
+
+    for (unsigned int i = 0; i < clusters_cnt; i++) {
+        shm_paths[i] = format_string(
+            "%s/pg_status.%s", shm_dir, get_cluster(i) -> name
+        );
+        shm_segments[i] = create_segment(shm_paths[i]);
+    }
+}
+
+/**
+ * Copies the host status into the segment
+ */
+void write_shm_host(PgStatusShmHost *shm_host, const MonitorStatus *status) {
+    strncpy(shm_host -> host, status -> host, PG_STATUS_SHM_HOST_LEN - 1);
+    shm_host -> host[PG_STATUS_SHM_HOST_LEN - 1] = '\0';
+    shm_host -> delay_ms = status -> delay_ms;
+    shm_host -> delay_bytes = status -> delay_bytes;
+    shm_host -> roles = status -> roles;
+    shm_host -> alive = status -> alive;
+    shm_host -> is_master = status -> is_master;
+}
+
+/**
+ * topology_listener that writes the published topology snapshot of
+ * the cluster into its shared memory segment, see pg_status_shm.h.
+ * Does nothing unless pg_status__shm_dir is set.
+ * Must be added with add_topology_listener before start_pg_monitor.
+ *
+ * The segment is only written by the monitoring thread, under a seqlock.
+ */
+void publish_shm_status(
+    const MonitorCluster *cluster, const Topology *topology
+) {
+    if (!shm_initialized) {
+        init_shm_status();
+    }
+    if (!shm_dir) {
+        return;
+    }
+
+    // init_shm_status has checked that all hosts fit into the segment
+    PgStatusShmSegment *segment = shm_segments[cluster -> index];
+    const unsigned int hosts_cnt = topology -> hosts_cnt;
+
+    const uint64_t sequence = atomic_load_explicit(
+        &segment -> sequence, memory_order_relaxed
+    );
+    atomic_store_explicit(
+        &segment -> sequence, sequence + 1, memory_order_relaxed
+    );
+    atomic_thread_fence(memory_order_release);
+
+    segment -> generation = topology -> generation;
+    segment -> published_ms = monotonic_ms();
+    segment -> master = (
+        topology -> master != TOPOLOGY_NO_HOST ?
+            topology -> master : PG_STATUS_SHM_NO_HOST
+    );
+    segment -> hosts_cnt = hosts_cnt;
+    for (unsigned int role = 0; role < HOST_ROLES_CNT; role++) {
+        const TopologyRole *hosts = &topology -> roles[role];
+        segment -> role_first[role] = (
+            hosts -> cnt > 0 ? hosts -> hosts[0] : PG_STATUS_SHM_NO_HOST
+        );
+    }
+    for (unsigned int i = 0; i < hosts_cnt; i++) {
+        write_shm_host(&segment -> hosts[i], &topology -> hosts[i]);
+    }
+
+    atomic_store_explicit(
+        &segment -> sequence, sequence + 2, memory_order_release
+    );
+}
+
+/**
+ * Marks the segment closed, so the readers that still map it stop
+ * trusting it
+ */
+void close_segment(PgStatusShmSegment *segment) {
+    const uint64_t sequence = atomic_load_explicit(
+        &segment -> sequence, memory_order_relaxed
+    );
+    atomic_store_explicit(
+        &segment -> sequence, sequence + 1, memory_order_relaxed
+    );
+    atomic_thread_fence(memory_order_release);
+
+    segment -> closed = 1;
+
+    atomic_store_explicit(
+        &segment -> sequence, sequence + 2, memory_order_release
+    );
+}
+
+/**
+ * Marks the shared memory segments closed, unmaps them and removes
+ * their files
+ */
+void close_shm_status(void) {
+    if (!shm_dir) {
+        return;
+    }
+
+    for (unsigned int i = 0; i < get_clusters_cnt(); i++) {
+        close_segment(shm_segments[i]);
+        munmap(shm_segments[i], sizeof(PgStatusShmSegment));
+        unlink(shm_paths[i]);
+        free(shm_paths[i]);
+    }
+    free(shm_segments);
+    free(shm_paths);
+    shm_dir = nullptr;
+}
@@ -0,0 +1,22 @@
+#ifndef PG_STATUS_SHM_STATUS_H
+#define PG_STATUS_SHM_STATUS_H
+
+#include "pg_monitor.h"
+
+/**
+ * topology_listener that writes the published topology snapshot of
+ * the cluster into its shared memory segment, see pg_status_shm.h.
+ * Does nothing unless pg_status__shm_dir is set.
+ * Must be added with add_topology_listener before start_pg_monitor.
+ */
+void publish_shm_status(
+    const MonitorCluster *cluster, const Topology *topology
+);
+
+/**
+ * Marks the shared memory segments closed, unmaps them and removes
+ * their files
+ */
+void close_shm_status(void);
+
+#endif //PG_STATUS_SHM_STATUS_H
@@ -0,0 +1,367 @@
+#include "utils.h"
+
+#include <errno.h>
+#include <stdalign.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * A message in the log ring. The slot belongs to the writer that claimed it
+ * until sequence is advanced, see log_write.
+ */
+typedef struct LogSlot {
+    // Position of the message the slot is ready for. Equals the position
+    // while the slot is free and the position + 1 once it holds the message
+    _Atomic(unsigned long long) sequence;
+    LogLevel level;
+    char text[LOG_MESSAGE_LEN];
+} LogSlot;
+
+/**
+ * Bounded lock-free queue of the messages: many writers, the log thread
+ * is the only reader. Writers claim positions with a CAS on tail
+ * and never wait: if the ring is full, the message is dropped.
+ */
+typedef struct LogRing {
+    alignas(CACHE_LINE_SIZE) _Atomic(unsigned long long) tail;
+    alignas(CACHE_LINE_SIZE) unsigned long long head;
+    alignas(CACHE_LINE_SIZE) _Atomic(unsigned long long) dropped;
+    LogSlot slots[LOG_RING_SIZE];
+} LogRing;
+
+LogRing log_ring;
+
+/**
+ * Messages below the level are skipped, see pg_status__log_level
+ */
+_Atomic(LogLevel) log_level = LOG_INFO;
+
+/**
+ * Interval in ms in which repeated messages are logged once,
+ * see log_limited and pg_status__log_repeat_ms
+ */
+unsigned long long log_repeat_ms = 60000;
+
+/**
+ * Whether the log thread drains the ring. Until then, and after
+ * stop_logger, the messages are written synchronously.
+ */
+_Atomic(bool) log_running = false;
+
+pthread_t log_tid;
+
+const char *const log_level_names[] = {
+    [LOG_DEBUG] = "debug",
+    [LOG_INFO] = "info",
+    [LOG_WARNING] = "warning",
+    [LOG_ERROR] = "error",
+};
+
+# define LOG_LEVELS_CNT (sizeof(log_level_names) / sizeof(log_level_names[0]))
+
+
+/**
+ * Writes the message of the level: the warnings and the errors
+ * to stderr, the others to stdout
+ */
+void write_log_line(const LogLevel level, const char *text) {
+    FILE *out = level >= LOG_WARNING ? stderr : stdout;
+    (void)fprintf(out, "%s: %s\n", log_level_names[level], text);
+}
+
+/**
+ * Formats the message with the suffix into the buffer.
+ * Trailing whitespace is cut, as the line gets its own \n.
+ */
+void format_log_text(
+    char *text,
+    const char *suffix,
+    const char *format,
+    va_list args
+) {
+    const int written = vsnprintf(text, LOG_MESSAGE_LEN, format, args);
+    size_t len = written < 0 ? 0 : (size_t) written;
+    if (len >= LOG_MESSAGE_LEN) {
+        len = LOG_MESSAGE_LEN - 1;
+    }
+    while (
+        len > 0 &&
+        (text[len - 1] == '\n' || text[len - 1] == ' ')
+    ) {
+        len--;
+    }
+    text[len] = '\0';
+
+    if (suffix) {
+        strlcat(text, suffix, LOG_MESSAGE_LEN);
+    }
+}
+
+/**
+ * Puts the message into the log ring, or writes it synchronously
+ * if the log thread is not running. Never blocks on a full ring:
+ * the message is dropped and counted instead.
+ */
+void log_write(
+    const LogLevel level,
+    const char *suffix,
+    const char *format,
+    va_list args
+) {
+    if (level < atomic_load_explicit(&log_level, memory_order_relaxed)) {
+        return;
+    }
+
+    if (!atomic_load_explicit(&log_running, memory_order_acquire)) {
+        char text[LOG_MESSAGE_LEN];
+        format_log_text(text, suffix, format, args);
+        write_log_line(level, text);
+        return;
+    }
+
+    unsigned long long position = atomic_load_explicit(
+        &log_ring.tail, memory_order_relaxed
+    );
+    LogSlot *slot;
+    while (true) {
+        slot = &log_ring.slots[position % LOG_RING_SIZE];
+        const unsigned long long sequence = atomic_load_explicit(
+            &slot -> sequence, memory_order_acquire
+        );
+
+        if (sequence == position) {
+            // The slot is free: claim the position
+            if (
+                atomic_compare_exchange_weak_explicit(
+                    &log_ring.tail, &position, position + 1,
+                    memory_order_relaxed, memory_order_relaxed
+                )
+            ) {
+                break;
+            }
+        }
+        else if (sequence < position) {
+            // The slot still holds a message a lap behind: the ring is full
+            atomic_fetch_add_explicit(
+                &log_ring.dropped, 1, memory_order_relaxed
+            );
+            return;
+        }
+        else {
+            position = atomic_load_explicit(
+                &log_ring.tail, memory_order_relaxed
+            );
+        }
+    }
+
+    slot -> level = level;
+    format_log_text(slot -> text, suffix, format, args);
+    atomic_store_explicit(
+        &slot -> sequence, position + 1, memory_order_release
+    );
+}
+
+/**
+ * Writes the messages of the ring to the output.
+ * Returns the number of the written messages.
+ */
+unsigned int drain_log_ring(void) {
+    unsigned int cnt = 0;
+
+    while (true) {
+        LogSlot *slot = &log_ring.slots[log_ring.head % LOG_RING_SIZE];
+        const unsigned long long sequence = atomic_load_explicit(
+            &slot -> sequence, memory_order_acquire
+        );
+        if (sequence != log_ring.head + 1) {
+            break;
+        }
+
+        write_log_line(slot -> level, slot -> text);
+        atomic_store_explicit(
+            &slot -> sequence, log_ring.head + LOG_RING_SIZE,
+            memory_order_release
+        );
+        log_ring.head++;
+        cnt++;
+    }
+    return cnt;
+}
+
+/**
+ * Drains the log ring until the logger is stopped, then drains it once
+ * more. Reports the dropped messages.
+ */
+void *log_thread(void *arg) {
+    unsigned long long reported_dropped = 0;
+    bool running = true;
+
+    while (running) {
+        running = atomic_load_explicit(&log_running, memory_order_acquire);
+        const unsigned int cnt = drain_log_ring();
+
+        const unsigned long long dropped = atomic_load_explicit(
+            &log_ring.dropped, memory_order_relaxed
+        );
+        if (dropped != reported_dropped) {
+            (void)fprintf(
+                stderr, "%s: %llu log messages dropped, the log is full\n",
+                log_level_names[LOG_WARNING], dropped - reported_dropped
+            );
+            reported_dropped = dropped;
+        }
+
+        if (cnt > 0) {
+            (void)fflush(stdout);
+            (void)fflush(stderr);
+        }
+        else if (running) {
+            usleep(LOG_DRAIN_INTERVAL_MS * 1000);
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * Returns the level by its name, or fails with an error
+ */
+LogLevel parse_log_level(const char *name) {
+    for (unsigned int i = 0; i < LOG_LEVELS_CNT; i++) {
+        if (is_equal_strings(name, log_level_names[i])) {
+            return (LogLevel) i;
+        }
+    }
+    raise_error("Unknown pg_status__log_level: %s", name);
+    return LOG_INFO;
+}
+
+/**
+ * Starts the log thread. From then on, the messages are written
+ * by it and the callers never wait for the output.
+ */
+void start_logger(void) {
+    char *level = nullptr;
+    replace_from_env("pg_status__log_level", &level);
+    if (level) {
+        atomic_store(&log_level, parse_log_level(level));
+    }
+    replace_from_env_ull("pg_status__log_repeat_ms", &log_repeat_ms);
+
+    for (unsigned int i = 0; i < LOG_RING_SIZE; i++) {
+        atomic_store_explicit(
+            &log_ring.slots[i].sequence, i, memory_order_relaxed
+        );
+    }
+    atomic_store_explicit(&log_ring.tail, 0, memory_order_relaxed);
+    log_ring.head = 0;
+    atomic_store_explicit(&log_running, true, memory_order_release);
+
+    const int started = pthread_create(&log_tid, nullptr, log_thread, nullptr);
+    if (started != 0) {
+        raise_error("Failed to start the log thread");
+    }
+}
+
+/**
+ * Stops the log thread once it has written the messages of the ring.
+ * Later messages are written synchronously.
+ */
+void stop_logger(void) {
+    atomic_store_explicit(&log_running, false, memory_order_release);
+    pthread_join(log_tid, nullptr);
+}
+
+/**
+ * Returns the number of the messages dropped because the log was full
+ */
+unsigned long long get_log_dropped(void) {
+    return atomic_load_explicit(&log_ring.dropped, memory_order_relaxed);
+}
+
+/**
+ * Logs the message of the level, see log_write
+ */
+void log_message(const LogLevel level, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    log_write(level, nullptr, format, args);
+    va_end(args);
+}
+
+/**
+ * Logs the message unless a message with the same key was logged with
+ * the limit less than log_repeat_ms ago. The skipped messages are counted
+ * and their number is added to the next logged one.
+ * A message with another key is always logged, so a change is never missed.
+ */
+void log_limited(
+    LogLimit *limit,
+    const unsigned int key,
+    const LogLevel level,
+    const char *format,
+    ...
+) {
+    if (level < atomic_load_explicit(&log_level, memory_order_relaxed)) {
+        return;
+    }
+
+    const unsigned long long now = monotonic_ms();
+    unsigned long long logged_ms = atomic_load_explicit(
+        &limit -> logged_ms, memory_order_relaxed
+    );
+    const bool repeated = (
+        logged_ms != 0 &&
+        atomic_load_explicit(&limit -> key, memory_order_relaxed) == key &&
+        now - logged_ms < log_repeat_ms
+    );
+    if (
+        repeated ||
+        !atomic_compare_exchange_strong_explicit(
+            &limit -> logged_ms, &logged_ms, now,
+            memory_order_relaxed, memory_order_relaxed
+        )
+    ) {
+        atomic_fetch_add_explicit(
+            &limit -> suppressed, 1, memory_order_relaxed
+        );
+        return;
+    }
+    atomic_store_explicit(&limit -> key, key, memory_order_relaxed);
+
+    char suffix[64];
+    const unsigned long long suppressed = atomic_exchange_explicit(
+        &limit -> suppressed, 0, memory_order_relaxed
+    );
+    if (suppressed > 0) {
+        snprintf(
+            suffix, sizeof(suffix),
+            " (%llu similar messages skipped)", suppressed
+        );
+    }
+
+    va_list args;
+    va_start(args, format);
+    log_write(level, suppressed > 0 ? suffix : nullptr, format, args);
+    va_end(args);
+}
+
+/**
+ * Logs the error with the error text from errno
+ */
+void printf_error(const char *format, ...) {
+    char error[128];
+    if (strerror_r(errno, error, sizeof(error)) != 0) {
+        strlcpy(error, "Unknown error", sizeof(error));
+    }
+
+    char suffix[sizeof(error) + 16];
+    snprintf(suffix, sizeof(suffix), ". strerror: %s", error);
+
+    va_list args;
+    va_start(args, format);
+    log_write(LOG_ERROR, suffix, format, args);
+    va_end(args);
+}
@@ -0,0 +1,150 @@
+#include "utils.h"
+
+#include <stdalign.h>
+#include <stdlib.h>
+
+/**
+ * Epoch of the read sections of a thread. Occupies its own cache line,
+ * so entering a section writes only to memory of the thread.
+ * A slot is reused by a new thread once its thread has exited.
+ */
+typedef struct ReaderSlot {
+    // Epoch at which the running read section started, 0 outside of one
+    alignas(CACHE_LINE_SIZE) _Atomic(unsigned long long) epoch;
+
+    // Whether the slot belongs to a running thread
+    _Atomic(bool) taken;
+
+    // Slots are only ever added to the list, so it is walked without locks
+    struct ReaderSlot *next;
+} ReaderSlot;
+
+/**
+ * The current epoch. Incremented by retire_epoch, read by the threads
+ * entering a read section
+ */
+_Atomic(unsigned long long) reclaim_epoch = 1;
+
+/**
+ * All reader slots, see ReaderSlot.next
+ */
+_Atomic(ReaderSlot *) reader_slots = nullptr;
+
+/**
+ * Frees the slot of an exiting thread, see take_reader_slot
+ */
+pthread_key_t reader_slot_key;
+pthread_once_t reader_slot_key_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Slot of the thread and the depth of its nested read sections
+ */
+_Thread_local ReaderSlot *reader_slot = nullptr;
+_Thread_local unsigned int reader_depth = 0;
+
+
+/**
+ * Gives the slot of an exiting thread to the threads started later
+ */
+void release_reader_slot(void *arg) {
+    ReaderSlot *slot = arg;
+    atomic_store_explicit(&slot -> epoch, 0, memory_order_release);
+    atomic_store_explicit(&slot -> taken, false, memory_order_release);
+}
+
+/**
+ * Creates reader_slot_key, once per process
+ */
+void create_reader_slot_key(void) {
+    if (pthread_key_create(&reader_slot_key, release_reader_slot) != 0) {
+        raise_error("Failed to create the reader slot key");
+    }
+}
+
+/**
+ * Takes a free slot for the calling thread or adds a new one.
+ * Called once per thread, on its first read section.
+ */
+ReaderSlot *take_reader_slot(void) {
+    pthread_once(&reader_slot_key_once, create_reader_slot_key);
+
+    ReaderSlot *slot = atomic_load(&reader_slots);
+    for (; slot; slot = slot -> next) {
+        bool taken = false;
+        if (atomic_compare_exchange_strong(&slot -> taken, &taken, true)) {
+            break;
+        }
+    }
+
+    if (!slot) {
+        slot = cache_aligned_calloc(sizeof(ReaderSlot));
+        atomic_init(&slot -> taken, true);
+        slot -> next = atomic_load(&reader_slots);
+        while (
+            !atomic_compare_exchange_weak(&reader_slots, &slot -> next, slot)
+        ) {
+        }
+    }
+
+    pthread_setspecific(reader_slot_key, slot);
+    return slot;
+}
+
+/**
+ * Enters a read section of the calling thread: the data published
+ * for the readers stays intact until the section is left.
+ * Sections may be nested, only the outermost one counts.
+ */
+void enter_read_section(void) {
+    if (reader_depth++ > 0) {
+        return;
+    }
+    if (!reader_slot) {
+        reader_slot = take_reader_slot();
+    }
+
+    atomic_store(&reader_slot -> epoch, atomic_load(&reclaim_epoch));
+    // The epoch must be visible before any shared pointer is loaded,
+    // see is_epoch_reclaimable
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+/**
+ * Leaves the read section of the calling thread
+ */
+void leave_read_section(void) {
+    if (--reader_depth > 0) {
+        return;
+    }
+    atomic_store_explicit(&reader_slot -> epoch, 0, memory_order_release);
+}
+
+/**
+ * Returns the epoch of the data the caller has just unpublished.
+ *
+ * A read section that has seen the data started at this epoch
+ * or earlier: it loaded the epoch before the pointer, and the pointer
+ * was replaced before the epoch was incremented here.
+ */
+unsigned long long retire_epoch(void) {
+    atomic_thread_fence(memory_order_seq_cst);
+    return atomic_fetch_add(&reclaim_epoch, 1);
+}
+
+/**
+ * Returns true if no read section that started at the epoch or earlier
+ * is still running: the data retired at the epoch is no longer seen
+ * by any reader and can be reused or freed.
+ */
+bool is_epoch_reclaimable(const unsigned long long epoch) {
+    atomic_thread_fence(memory_order_seq_cst);
+
+    const ReaderSlot *slot = atomic_load(&reader_slots);
+    for (; slot; slot = slot -> next) {
+        const unsigned long long started = atomic_load(&slot -> epoch);
+        if (started != 0 && started <= epoch) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -6,8 +6,8 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
-#include <cjson/cJSON.h>
 
 /**
  * Opens file descriptor in blocking mode and gets fstat
@@ -39,19 +39,6 @@ int fputs_error(void) {
     return fputs("Unknown error", stderr);
 }
 
-/**
- * Prints the message in red with \n and also adds the error text from errno
- */
-void printf_error(const char *format, ...) {
-    va_list args;
-    va_start(args, format);
-    (void)vfprintf(stderr, format, args);
-    va_end(args);
-    (void)fputs(". strerror: ", stderr);
-    (void)fputs_error();
-    (void)fputc('\n', stderr);
-}
-
 /**
  * Prints the message in red with \n and also adds the
  * error text from errno and exit(1)
@@ -197,19 +184,28 @@ unsigned long str_to_ulong(const char *value) {
 }
 
 /**
- * Converts string to unsigned long long
+ * Converts string to unsigned long long without failing.
+ * Returns false if the string is not a number.
  */
-unsigned long long str_to_ull(const char *value) {
+bool parse_ull(const char *value, unsigned long long *result) {
     char *end_ptr = nullptr;
     errno = 0;
 
-    const unsigned long long result = strtoull(value, &end_ptr, 10);
+    *result = strtoull(value, &end_ptr, 10);
 
-    if (
+    return !(
         end_ptr == value ||
         *end_ptr != '\0' ||
         errno == ERANGE
-    ) {
+    );
+}
+
+/**
+ * Converts string to unsigned long long
+ */
+unsigned long long str_to_ull(const char *value) {
+    unsigned long long result;
+    if (!parse_ull(value, &result)) {
         raise_error("Failed to convert '%s' to ull", value);
     }
 
@@ -230,6 +226,101 @@ unsigned int str_to_uint(const char *value) {
     return (unsigned int) str_to_ulong(value);
 }
 
+/**
+ * Allocates zeroed memory aligned to CACHE_LINE_SIZE.
+ * Fails with an error if there is no memory. The result must be freed
+ * by the caller.
+ */
+void *cache_aligned_calloc(const size_t size) {
+    const size_t aligned_size = (
+        (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE
+    );
+    void *memory = aligned_alloc(CACHE_LINE_SIZE, aligned_size);
+    if (!memory) {
+        raise_error("Can't allocate %zu bytes", aligned_size);
+    }
+    memset(memory, 0, aligned_size);
+    return memory;
+}
+
+/**
+ * Returns milliseconds from the monotonic clock. Unaffected by wall-clock jumps.
+ */
+unsigned long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (
+        (unsigned long long)ts.tv_sec * 1000ULL +
+        (unsigned long long)ts.tv_nsec / 1000000ULL
+    );
+}
+
+/**
+ * Returns nanoseconds from the monotonic clock, for measuring durations
+ */
+unsigned long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (
+        (unsigned long long)ts.tv_sec * 1000000000ULL +
+        (unsigned long long)ts.tv_nsec
+    );
+}
+
+/**
+ * Returns the microseconds elapsed since the monotonic time started_ns
+ */
+unsigned long long elapsed_us(const unsigned long long started_ns) {
+    return (monotonic_ns() - started_ns) / 1000;
+}
+
+/**
+ * Initializes the condition variable so that it waits on the monotonic clock,
+ * see monotonic_cond_wait
+ */
+void init_monotonic_cond(pthread_cond_t *cond) {
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+#ifndef __APPLE__
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+}
+
+/**
+ * Waits on the condition variable initialized by init_monotonic_cond until
+ * it is signaled or until the monotonic time deadline_ms.
+ * The mutex must be locked. The wait may end early, so the caller checks
+ * its condition and the time in a loop.
+ */
+void monotonic_cond_wait(
+    pthread_cond_t *cond,
+    pthread_mutex_t *mutex,
+    const unsigned long long deadline_ms
+) {
+    const unsigned long long now = monotonic_ms();
+    if (now >= deadline_ms) {
+        return;
+    }
+
+#ifdef __APPLE__
+    // macOS has no pthread_condattr_setclock, but it can wait relatively
+    const unsigned long long wait_ms = deadline_ms - now;
+    const struct timespec ts = {
+        .tv_sec = (time_t)(wait_ms / 1000),
+        .tv_nsec = (long)(wait_ms % 1000 * 1000000),
+    };
+    pthread_cond_timedwait_relative_np(cond, mutex, &ts);
+#else
+    const struct timespec ts = {
+        .tv_sec = (time_t)(deadline_ms / 1000),
+        .tv_nsec = (long)(deadline_ms % 1000 * 1000000),
+    };
+    pthread_cond_timedwait(cond, mutex, &ts);
+#endif
+}
+
 /**
  * Takes a value from the environment variables if it is set,
  * pastes it by the result pointer.
@@ -277,51 +368,363 @@ void replace_from_env_copy(const char *env_name, char **result) {
 }
 
 /**
- * Creates a new json array object
+ * Upper bounds (us) of the buckets of a Histogram, from 500us to 10s
  */
-cJSON *json_array(void) {
-    cJSON *arr = cJSON_CreateArray();
-    if (!arr) {
-        raise_error("Can't create json array");
+const unsigned long long histogram_bounds_us[HISTOGRAM_BUCKETS_CNT] = {
+    500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000,
+};
+
+/**
+ * Adds a duration in us to the histogram
+ */
+void histogram_observe(
+    Histogram *histogram, const unsigned long long value_us
+) {
+    unsigned int bucket = 0;
+    while (
+        bucket < HISTOGRAM_BUCKETS_CNT &&
+        value_us > histogram_bounds_us[bucket]
+    ) {
+        bucket++;
     }
-    return arr;
+
+    atomic_fetch_add_explicit(
+        &histogram -> buckets[bucket], 1, memory_order_relaxed
+    );
+    atomic_fetch_add_explicit(
+        &histogram -> sum_us, value_us, memory_order_relaxed
+    );
 }
 
 /**
- * Creates a new json object
+ * Adds the value to the counter. A counter written by a single thread
+ * is updated with a plain load and store, without a locked instruction,
+ * the others with an atomic increment.
  */
-cJSON *json_object(void) {
-    cJSON *arr = cJSON_CreateObject();
-    if (!arr) {
-        raise_error("Can't create json object");
+void counter_add(
+    _Atomic(unsigned long long) *counter,
+    const unsigned long long value,
+    const bool exclusive
+) {
+    if (exclusive) {
+        atomic_store_explicit(
+            counter,
+            atomic_load_explicit(counter, memory_order_relaxed) + value,
+            memory_order_relaxed
+        );
+    }
+    else {
+        atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
     }
-    return arr;
 }
 
 /**
- * Adds a new key and value to json
+ * Returns the bucket of a LatencyHistogram for the value in ns.
+ * The values below LATENCY_SUB_BUCKETS have a bucket each, the others
+ * fall into one of the LATENCY_SUB_BUCKETS buckets of their power of two.
  */
-void add_str_to_json_object(cJSON * obj, const char *key, const char *val) {
-    if (!cJSON_AddStringToObject(obj, key, val)) {
-        raise_error("Can't add str to object");
+unsigned int latency_bucket(const unsigned long long value_ns) {
+    if (value_ns < LATENCY_SUB_BUCKETS) {
+        return (unsigned int) value_ns;
     }
+
+    const unsigned int exponent = (
+        63U - (unsigned int) __builtin_clzll(value_ns)
+    );
+    const unsigned int shift = exponent - LATENCY_SUB_BUCKET_BITS;
+    const unsigned int bucket = (
+        (exponent - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS +
+        (unsigned int)((value_ns >> shift) & (LATENCY_SUB_BUCKETS - 1))
+    );
+    return bucket < LATENCY_BUCKETS_CNT ? bucket : LATENCY_BUCKETS_CNT - 1;
 }
 
 /**
- * Adds a new key with value null to json
+ * Returns the largest value (ns) that falls into the bucket
  */
-void add_null_to_json_object(cJSON * obj, const char *key) {
-    if (!cJSON_AddNullToObject(obj, key)) {
-        raise_error("Can't add null to object");
+unsigned long long latency_bucket_upper(const unsigned int bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return bucket;
     }
+
+    const unsigned int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    const unsigned long long lower = (
+        (unsigned long long)(
+            LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS
+        ) << shift
+    );
+    return lower + (1ULL << shift) - 1;
 }
 
 /**
- * Converts json to string.
- * The string must be freed by the caller.
+ * Adds a duration in ns to the histogram.
+ * exclusive means that only the calling thread writes the histogram,
+ * see counter_add.
  */
-char *json_to_str(cJSON *json) {
-    char *result = cJSON_PrintUnformatted(json);
-    cJSON_Delete(json);
-    return result;
+void latency_record(
+    LatencyHistogram *histogram,
+    const unsigned long long value_ns,
+    const bool exclusive
+) {
+    counter_add(
+        &histogram -> buckets[latency_bucket(value_ns)], 1, exclusive
+    );
+    counter_add(&histogram -> count, 1, exclusive);
+    counter_add(&histogram -> sum_ns, value_ns, exclusive);
+}
+
+/**
+ * Adds the histogram to the snapshot
+ */
+void latency_snapshot_add(
+    LatencySnapshot *snapshot, const LatencyHistogram *histogram
+) {
+    for (unsigned int i = 0; i < LATENCY_BUCKETS_CNT; i++) {
+        snapshot -> buckets[i] += atomic_load_explicit(
+            &histogram -> buckets[i], memory_order_relaxed
+        );
+    }
+    snapshot -> count += atomic_load_explicit(
+        &histogram -> count, memory_order_relaxed
+    );
+    snapshot -> sum_ns += atomic_load_explicit(
+        &histogram -> sum_ns, memory_order_relaxed
+    );
+}
+
+/**
+ * Returns the value (ns) below which the quantile q of the durations
+ * of the snapshot lies: the upper bound of its bucket. 0 if it is empty.
+ */
+unsigned long long latency_quantile(
+    const LatencySnapshot *snapshot, const double q
+) {
+    unsigned long long total = 0;
+    for (unsigned int i = 0; i < LATENCY_BUCKETS_CNT; i++) {
+        total += snapshot -> buckets[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    unsigned long long rank = (unsigned long long)(q * (double) total);
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    unsigned long long seen = 0;
+    for (unsigned int i = 0; i < LATENCY_BUCKETS_CNT; i++) {
+        seen += snapshot -> buckets[i];
+        if (seen >= rank) {
+            return latency_bucket_upper(i);
+        }
+    }
+    return latency_bucket_upper(LATENCY_BUCKETS_CNT - 1);
+}
+
+/**
+ * Thread-local buffer of json_writer_init_pooled
+ */
+_Thread_local char json_pool[JSON_POOL_SIZE];
+
+/**
+ * Starts writing into the buffer of cap bytes.
+ * With a nullptr buffer, the output is written to the heap.
+ */
+void json_writer_init(JsonWriter *writer, char *buf, const size_t cap) {
+    writer -> buf = buf;
+    writer -> len = 0;
+    writer -> cap = buf ? cap : 0;
+    writer -> heap = false;
+    writer -> need_comma = false;
+}
+
+/**
+ * Starts writing into the thread-local buffer of JSON_POOL_SIZE bytes.
+ * The string is valid until the next pooled writer on the same thread,
+ * so it must be copied, for example with MHD_RESPMEM_MUST_COPY.
+ */
+void json_writer_init_pooled(JsonWriter *writer) {
+    json_writer_init(writer, json_pool, sizeof(json_pool));
+}
+
+/**
+ * Makes room for len more bytes and the terminating null.
+ * Moves the output to the heap once it outgrows the buffer.
+ */
+void json_reserve(JsonWriter *writer, const size_t len) {
+    const size_t needed = writer -> len + len + 1;
+    if (needed <= writer -> cap) {
+        return;
+    }
+
+    size_t cap = writer -> cap ? writer -> cap * 2 : 256;
+    while (cap < needed) {
+        cap *= 2;
+    }
+
+    char *buf;
+    if (writer -> heap) {
+        buf = realloc(writer -> buf, cap);
+    }
+    else {
+        buf = malloc(cap);
+        if (buf && writer -> len) {
+            memcpy(buf, writer -> buf, writer -> len);
+        }
+    }
+    if (!buf) {
+        raise_error("Can't allocate memory for json");
+    }
+
+    writer -> buf = buf;
+    writer -> cap = cap;
+    writer -> heap = true;
+}
+
+/**
+ * Appends len raw bytes
+ */
+void json_write(JsonWriter *writer, const char *str, const size_t len) {
+    json_reserve(writer, len);
+    memcpy(writer -> buf + writer -> len, str, len);
+    writer -> len += len;
+}
+
+/**
+ * Appends a comma if the previous value needs one, before the next one
+ */
+void json_separate(JsonWriter *writer) {
+    if (writer -> need_comma) {
+        json_write(writer, ",", 1);
+    }
+    writer -> need_comma = true;
+}
+
+/**
+ * Appends the string in quotes, escaping the quotes, the backslashes
+ * and the control characters. Other bytes, UTF-8 included, are copied.
+ */
+void json_write_escaped(JsonWriter *writer, const char *str) {
+    static const char hex[] = "0123456789abcdef";
+
+    json_write(writer, "\"", 1);
+    const char *start = str;
+    for (; *str; str++) {
+        const unsigned char c = (unsigned char) *str;
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+
+        json_write(writer, start, (size_t)(str - start));
+        start = str + 1;
+        switch (c) {
+            case '"': json_write(writer, "\\\"", 2); break;
+            case '\\': json_write(writer, "\\\\", 2); break;
+            case '\b': json_write(writer, "\\b", 2); break;
+            case '\f': json_write(writer, "\\f", 2); break;
+            case '\n': json_write(writer, "\\n", 2); break;
+            case '\r': json_write(writer, "\\r", 2); break;
+            case '\t': json_write(writer, "\\t", 2); break;
+            default: {
+                const char escaped[6] = {
+                    '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF]
+                };
+                json_write(writer, escaped, sizeof(escaped));
+            }
+        }
+    }
+    json_write(writer, start, (size_t)(str - start));
+    json_write(writer, "\"", 1);
+}
+
+/**
+ * Null-terminates the output and returns it.
+ * If writer.heap is set, the string must be freed by the caller.
+ */
+char *json_writer_finish(JsonWriter *writer) {
+    json_reserve(writer, 0);
+    writer -> buf[writer -> len] = '\0';
+    return writer -> buf;
+}
+
+/**
+ * Opens an object, see json_key for its values
+ */
+void json_begin_object(JsonWriter *writer) {
+    json_separate(writer);
+    json_write(writer, "{", 1);
+    writer -> need_comma = false;
+}
+
+/**
+ * Closes the object opened last
+ */
+void json_end_object(JsonWriter *writer) {
+    json_write(writer, "}", 1);
+    writer -> need_comma = true;
+}
+
+/**
+ * Opens an array
+ */
+void json_begin_array(JsonWriter *writer) {
+    json_separate(writer);
+    json_write(writer, "[", 1);
+    writer -> need_comma = false;
+}
+
+/**
+ * Closes the array opened last
+ */
+void json_end_array(JsonWriter *writer) {
+    json_write(writer, "]", 1);
+    writer -> need_comma = true;
+}
+
+/**
+ * Writes the key of the next value of an object
+ */
+void json_key(JsonWriter *writer, const char *key) {
+    json_separate(writer);
+    json_write_escaped(writer, key);
+    json_write(writer, ":", 1);
+    writer -> need_comma = false;
+}
+
+/**
+ * Writes the escaped string, or null for nullptr
+ */
+void json_string(JsonWriter *writer, const char *val) {
+    if (!val) {
+        json_null(writer);
+        return;
+    }
+    json_separate(writer);
+    json_write_escaped(writer, val);
+}
+
+/**
+ * Writes the unsigned integer
+ */
+void json_uint(JsonWriter *writer, const unsigned long long val) {
+    char digits[20];
+    unsigned int len = 0;
+    unsigned long long rest = val;
+    do {
+        digits[sizeof(digits) - ++len] = (char)('0' + rest % 10);
+        rest /= 10;
+    } while (rest);
+
+    json_separate(writer);
+    json_write(writer, digits + sizeof(digits) - len, len);
+}
+
+/**
+ * Writes null
+ */
+void json_null(JsonWriter *writer) {
+    json_separate(writer);
+    json_write(writer, "null", 4);
 }
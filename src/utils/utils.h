@@ -2,8 +2,11 @@
 #define PG_STATUS_UTILS_H
 
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <sys/stat.h>
-#include <cjson/cJSON.h>
 
 typedef struct FileDescriptor {
     int fd;
@@ -24,7 +27,81 @@ FileDescriptor open_file(const char *path);
 #endif
 
 /**
- * Prints the message in red with \n and also adds the error text from errno
+ * Levels of the log messages, see pg_status__log_level
+ */
+typedef enum LogLevel {
+    LOG_DEBUG = 0,
+    LOG_INFO,
+    LOG_WARNING,
+    LOG_ERROR,
+} LogLevel;
+
+/**
+ * Maximum length of a log message, longer ones are cut
+ */
+# define LOG_MESSAGE_LEN 256
+
+/**
+ * Number of the messages the log holds until the log thread writes them.
+ * Must be a power of two
+ */
+# define LOG_RING_SIZE 1024
+
+/**
+ * Time in ms the log thread sleeps when there is nothing to write
+ */
+# define LOG_DRAIN_INTERVAL_MS 20
+
+/**
+ * State of a message logged with log_limited. A zeroed one has logged
+ * nothing yet.
+ */
+typedef struct LogLimit {
+    // Monotonic time (ms) of the last logged message, 0 if none
+    _Atomic(unsigned long long) logged_ms;
+
+    // Key of the last logged message
+    _Atomic(unsigned int) key;
+
+    // Number of the messages skipped since the last logged one
+    _Atomic(unsigned long long) suppressed;
+} LogLimit;
+
+/**
+ * Starts the log thread. From then on, the messages are written
+ * by it and the callers never wait for the output.
+ */
+void start_logger(void);
+
+/**
+ * Stops the log thread once it has written the messages of the ring.
+ * Later messages are written synchronously.
+ */
+void stop_logger(void);
+
+/**
+ * Returns the number of the messages dropped because the log was full
+ */
+unsigned long long get_log_dropped(void);
+
+/**
+ * Logs the message of the level with \n. Never blocks: if the log
+ * is full, the message is dropped and counted.
+ */
+void log_message(LogLevel level, const char *format, ...) __printflike(2, 3);
+
+/**
+ * Logs the message unless a message with the same key was logged with
+ * the limit less than log_repeat_ms ago. The skipped messages are counted
+ * and their number is added to the next logged one.
+ * A message with another key is always logged, so a change is never missed.
+ */
+void log_limited(
+    LogLimit *limit, unsigned int key, LogLevel level, const char *format, ...
+) __printflike(4, 5);
+
+/**
+ * Logs the error with the error text from errno, see log_message
  */
 void printf_error(const char *format, ...) __printflike(1, 2);
 
@@ -81,6 +158,12 @@ long str_to_long(const char *value);
  */
 unsigned long str_to_ulong(const char *value);
 
+/**
+ * Converts string to unsigned long long without failing.
+ * Returns false if the string is not a number.
+ */
+bool parse_ull(const char *value, unsigned long long *result);
+
 /**
  * Converts string to unsigned long long
  */
@@ -96,6 +179,83 @@ int str_to_int(const char *value);
  */
 unsigned int str_to_uint(const char *value);
 
+/**
+ * Size of the cache line that hot shared data is aligned to
+ */
+#define CACHE_LINE_SIZE 64
+
+/**
+ * Allocates zeroed memory aligned to CACHE_LINE_SIZE.
+ * Fails with an error if there is no memory. The result must be freed
+ * by the caller.
+ */
+void *cache_aligned_calloc(size_t size);
+
+/**
+ * Returns milliseconds from the monotonic clock. Unaffected by wall-clock jumps.
+ */
+unsigned long long monotonic_ms(void);
+
+/**
+ * Returns nanoseconds from the monotonic clock, for measuring durations
+ */
+unsigned long long monotonic_ns(void);
+
+/**
+ * Returns the microseconds elapsed since the monotonic time started_ns
+ */
+unsigned long long elapsed_us(unsigned long long started_ns);
+
+/**
+ * Initializes the condition variable so that it waits on the monotonic clock,
+ * see monotonic_cond_wait
+ */
+void init_monotonic_cond(pthread_cond_t *cond);
+
+/**
+ * Waits on the condition variable initialized by init_monotonic_cond until
+ * it is signaled or until the monotonic time deadline_ms.
+ * The mutex must be locked. The wait may end early, so the caller checks
+ * its condition and the time in a loop.
+ */
+void monotonic_cond_wait(
+    pthread_cond_t *cond,
+    pthread_mutex_t *mutex,
+    unsigned long long deadline_ms
+);
+
+/**
+ * Enters a read section of the calling thread: the data published
+ * for the readers stays intact until the section is left.
+ * Sections may be nested, only the outermost one counts.
+ *
+ * This is epoch-based reclamation. Readers load the published pointers
+ * only inside a read section. A writer that has replaced a pointer takes
+ * the epoch of the old data with retire_epoch, and reuses or frees it only
+ * once is_epoch_reclaimable returns true for that epoch: no section that
+ * could have seen it is still running, however long its thread has been
+ * stalled. A section writes only to a cache line of its own thread,
+ * so readers never contend with each other.
+ */
+void enter_read_section(void);
+
+/**
+ * Leaves the read section of the calling thread
+ */
+void leave_read_section(void);
+
+/**
+ * Returns the epoch of the data the caller has just unpublished
+ */
+unsigned long long retire_epoch(void);
+
+/**
+ * Returns true if no read section that started at the epoch or earlier
+ * is still running: the data retired at the epoch is no longer seen
+ * by any reader and can be reused or freed.
+ */
+bool is_epoch_reclaimable(unsigned long long epoch);
+
 /**
  * Takes a value from the environment variables if it is set,
  * pastes it by the result pointer.
@@ -122,29 +282,195 @@ void replace_from_env_ull(const char *env_name, unsigned long long *result);
 void replace_from_env_copy(const char *env_name, char **result);
 
 /**
- * Creates a new json array object
+ * Number of the fixed buckets of a Histogram
  */
-cJSON *json_array(void);
+# define HISTOGRAM_BUCKETS_CNT 14
 
 /**
- * Creates a new json object
+ * Upper bounds (us) of the buckets of a Histogram, from 500us to 10s
  */
-cJSON *json_object(void);
+extern const unsigned long long histogram_bounds_us[HISTOGRAM_BUCKETS_CNT];
 
 /**
- * Adds a new key and value to json
+ * Histogram of durations with fixed buckets, see histogram_bounds_us.
+ * Updated with relaxed atomic increments, so it is written without locks
+ * and read while it is written. A reader may see an observation in
+ * the buckets before it is added to the sum.
+ * A zeroed histogram is empty.
  */
-void add_str_to_json_object(cJSON * obj, const char *key, const char *val);
+typedef struct Histogram {
+    // Number of the observations in each bucket, not cumulative.
+    // The last bucket counts the observations above all bounds
+    _Atomic(unsigned long long) buckets[HISTOGRAM_BUCKETS_CNT + 1];
+
+    // Sum of the observations in us
+    _Atomic(unsigned long long) sum_us;
+} Histogram;
 
 /**
- * Adds a new key with value null to json
+ * Adds a duration in us to the histogram
  */
-void add_null_to_json_object(cJSON * obj, const char *key);
+void histogram_observe(Histogram *histogram, unsigned long long value_us);
 
 /**
- * Converts json to string.
- * The string must be freed by the caller.
+ * Sub-buckets of every power of two of a LatencyHistogram: 8, so a value
+ * is known with an error of at most 12.5%
+ */
+# define LATENCY_SUB_BUCKET_BITS 3
+# define LATENCY_SUB_BUCKETS (1U << LATENCY_SUB_BUCKET_BITS)
+
+/**
+ * Number of the buckets of a LatencyHistogram. They cover the values
+ * up to 2^41 ns, about 36 minutes, longer ones fall into the last bucket.
+ */
+# define LATENCY_BUCKETS_CNT 312
+
+/**
+ * HDR-style histogram of durations in ns with log-linear buckets:
+ * every power of two is split into LATENCY_SUB_BUCKETS equal buckets,
+ * so microsecond and second durations are both measured precisely.
+ * A zeroed histogram is empty.
+ */
+typedef struct LatencyHistogram {
+    _Atomic(unsigned long long) buckets[LATENCY_BUCKETS_CNT];
+    _Atomic(unsigned long long) count;
+    _Atomic(unsigned long long) sum_ns;
+} LatencyHistogram;
+
+/**
+ * Consistent copy of a LatencyHistogram or a sum of several of them,
+ * see latency_snapshot_add
+ */
+typedef struct LatencySnapshot {
+    unsigned long long buckets[LATENCY_BUCKETS_CNT];
+    unsigned long long count;
+    unsigned long long sum_ns;
+} LatencySnapshot;
+
+/**
+ * Adds the value to the counter. A counter written by a single thread
+ * is updated with a plain load and store, without a locked instruction,
+ * the others with an atomic increment.
+ */
+void counter_add(
+    _Atomic(unsigned long long) *counter,
+    unsigned long long value,
+    bool exclusive
+);
+
+/**
+ * Adds a duration in ns to the histogram.
+ * exclusive means that only the calling thread writes the histogram,
+ * see counter_add.
+ */
+void latency_record(
+    LatencyHistogram *histogram, unsigned long long value_ns, bool exclusive
+);
+
+/**
+ * Adds the histogram to the snapshot
+ */
+void latency_snapshot_add(
+    LatencySnapshot *snapshot, const LatencyHistogram *histogram
+);
+
+/**
+ * Returns the value (ns) below which the quantile q of the durations
+ * of the snapshot lies: the upper bound of its bucket. 0 if it is empty.
+ */
+unsigned long long latency_quantile(
+    const LatencySnapshot *snapshot, double q
+);
+
+/**
+ * Size of the thread-local buffer of json_writer_init_pooled
+ */
+# define JSON_POOL_SIZE 4096
+
+/**
+ * Streaming json writer. Writes the escaped output straight into a buffer,
+ * without building a tree and without allocating per value.
+ *
+ * Usage:
+ *     JsonWriter writer;
+ *     json_writer_init(&writer, nullptr, 0);
+ *     json_begin_object(&writer);
+ *     json_key(&writer, "host");
+ *     json_string(&writer, host);
+ *     json_end_object(&writer);
+ *     char *str = json_writer_finish(&writer);
+ */
+typedef struct JsonWriter {
+    char *buf;
+    size_t len;
+    size_t cap;
+
+    // Whether buf was allocated by the writer. The writer moves to the heap
+    // once the output outgrows the buffer it was given, and then
+    // the string must be freed by the caller
+    bool heap;
+
+    // Whether the next value or key must be preceded by a comma
+    bool need_comma;
+} JsonWriter;
+
+/**
+ * Starts writing into the buffer of cap bytes.
+ * With a nullptr buffer, the output is written to the heap.
+ */
+void json_writer_init(JsonWriter *writer, char *buf, size_t cap);
+
+/**
+ * Starts writing into the thread-local buffer of JSON_POOL_SIZE bytes.
+ * The string is valid until the next pooled writer on the same thread,
+ * so it must be copied, for example with MHD_RESPMEM_MUST_COPY.
+ */
+void json_writer_init_pooled(JsonWriter *writer);
+
+/**
+ * Null-terminates the output and returns it.
+ * If writer.heap is set, the string must be freed by the caller.
+ */
+char *json_writer_finish(JsonWriter *writer);
+
+/**
+ * Opens an object, see json_key for its values
+ */
+void json_begin_object(JsonWriter *writer);
+
+/**
+ * Closes the object opened last
+ */
+void json_end_object(JsonWriter *writer);
+
+/**
+ * Opens an array
+ */
+void json_begin_array(JsonWriter *writer);
+
+/**
+ * Closes the array opened last
+ */
+void json_end_array(JsonWriter *writer);
+
+/**
+ * Writes the key of the next value of an object
+ */
+void json_key(JsonWriter *writer, const char *key);
+
+/**
+ * Writes the escaped string, or null for nullptr
+ */
+void json_string(JsonWriter *writer, const char *val);
+
+/**
+ * Writes the unsigned integer
+ */
+void json_uint(JsonWriter *writer, unsigned long long val);
+
+/**
+ * Writes null
  */
-char *json_to_str(cJSON *json);
+void json_null(JsonWriter *writer);
 
 #endif //PG_STATUS_UTILS_H
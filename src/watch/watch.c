@@ -0,0 +1,230 @@
+#include "watch.h"
+#include "utils.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+/**
+ * A request suspended until a topology change.
+ * Watches are kept in a list ordered by deadline: all of them wait
+ * for the same time, so a new one is appended to the end.
+ */
+typedef struct Watch {
+    MHD_Connection *connection;
+
+    // Index of the watched cluster
+    unsigned int cluster;
+
+    // Monotonic time (ms) at which the watch completes without a change
+    unsigned long long deadline_ms;
+
+    struct Watch *prev;
+    struct Watch *next;
+} Watch;
+
+/**
+ * Everything below is protected by watch_mutex
+ */
+static pthread_mutex_t watch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watch_cond;
+static bool watch_running = false;
+static pthread_t watch_tid;
+
+/**
+ * Suspended watches, the earliest deadline first
+ */
+Watch *watches_head = nullptr;
+Watch *watches_tail = nullptr;
+
+/**
+ * The last generation of each cluster the watches were woken for,
+ * indexed by MonitorCluster.index
+ */
+unsigned long long *watch_generations = nullptr;
+
+unsigned long long watch_timeout_ms = DEFAULT_WATCH_TIMEOUT_MS;
+
+
+/**
+ * Removes the watch from the list and resumes its request,
+ * so the handler is called again and responds.
+ * watch_mutex must be locked.
+ */
+void complete_watch(Watch *watch) {
+    if (watch -> prev) {
+        watch -> prev -> next = watch -> next;
+    }
+    else {
+        watches_head = watch -> next;
+    }
+    if (watch -> next) {
+        watch -> next -> prev = watch -> prev;
+    }
+    else {
+        watches_tail = watch -> prev;
+    }
+
+    watch -> prev = nullptr;
+    watch -> next = nullptr;
+    MHD_resume_connection(watch -> connection);
+}
+
+/**
+ * topology_listener that completes the watches of the cluster when
+ * the generation of the published topology snapshot changes.
+ * Must be added with add_topology_listener before start_pg_monitor,
+ * after the listener that renders the responses the watches return.
+ *
+ * The first calls come from start_pg_monitor before the request threads
+ * start, so the generations are allocated there.
+ */
+void wake_topology_watchers(
+    const MonitorCluster *cluster, const Topology *topology
+) {
+    pthread_mutex_lock(&watch_mutex);
+
+    if (!watch_generations) {
+        watch_generations = calloc(
+            get_clusters_cnt(), sizeof(unsigned long long)
+        );
+        if (!watch_generations) {
+            raise_error("Can't allocate memory for watches");
+        }
+    }
+
+    if (watch_generations[cluster -> index] != topology -> generation) {
+        watch_generations[cluster -> index] = topology -> generation;
+
+        Watch *watch = watches_head;
+        while (watch) {
+            Watch *next = watch -> next;
+            if (watch -> cluster == cluster -> index) {
+                complete_watch(watch);
+            }
+            watch = next;
+        }
+    }
+
+    pthread_mutex_unlock(&watch_mutex);
+}
+
+/**
+ * Suspends the request until the cluster publishes a topology snapshot
+ * whose generation differs from since, or until the watch timeout.
+ * Returns true if the request has been suspended: the handler must return
+ * without a response and will be called again when the watch completes.
+ * Returns false if the handler must respond now.
+ *
+ * The generation is compared and the request is suspended under
+ * watch_mutex, so a change published in between is not missed.
+ */
+bool wait_topology_change(
+    HTTPResponse *response,
+    const MonitorCluster *cluster,
+    const unsigned long long since
+) {
+    if (!response -> context || *response -> context) {
+        // The watch has completed and the request has been resumed
+        return false;
+    }
+
+    pthread_mutex_lock(&watch_mutex);
+
+    if (
+        !watch_running ||
+        watch_generations[cluster -> index] != since
+    ) {
+        pthread_mutex_unlock(&watch_mutex);
+        return false;
+    }
+
+    Watch *watch = malloc(sizeof(Watch));
+    if (!watch) {
+        pthread_mutex_unlock(&watch_mutex);
+        printf_error("Can't allocate memory for a watch");
+        return false;
+    }
+    watch -> connection = response -> connection;
+    watch -> cluster = cluster -> index;
+    watch -> deadline_ms = monotonic_ms() + watch_timeout_ms;
+    watch -> prev = watches_tail;
+    watch -> next = nullptr;
+    *response -> context = watch;
+
+    if (watches_tail) {
+        watches_tail -> next = watch;
+    }
+    else {
+        watches_head = watch;
+        pthread_cond_signal(&watch_cond);
+    }
+    watches_tail = watch;
+
+    suspend_request(response);
+    pthread_mutex_unlock(&watch_mutex);
+    return true;
+}
+
+/**
+ * The thread that completes the watches whose deadline has passed.
+ * Sleeps until the earliest deadline or until a watch is added
+ * to the empty list.
+ */
+void *watch_thread(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&watch_mutex);
+    while (watch_running) {
+        const unsigned long long now = monotonic_ms();
+        while (watches_head && watches_head -> deadline_ms <= now) {
+            complete_watch(watches_head);
+        }
+
+        if (watches_head) {
+            monotonic_cond_wait(
+                &watch_cond, &watch_mutex, watches_head -> deadline_ms
+            );
+        }
+        else {
+            pthread_cond_wait(&watch_cond, &watch_mutex);
+        }
+    }
+    pthread_mutex_unlock(&watch_mutex);
+
+    return nullptr;
+}
+
+/**
+ * Reads pg_status__watch_timeout_ms and starts the thread that completes
+ * the watches on timeout. Must be called before start_http_server.
+ */
+void start_watch(void) {
+    replace_from_env_ull("pg_status__watch_timeout_ms", &watch_timeout_ms);
+    init_monotonic_cond(&watch_cond);
+    watch_running = true;
+
+    const int started = pthread_create(
+        &watch_tid, nullptr, watch_thread, nullptr
+    );
+    if (started != 0) {
+        raise_error("Failed to start the watch thread");
+    }
+}
+
+/**
+ * Completes all watches and stops the thread.
+ * Must be called before stop_http_server.
+ */
+void stop_watch(void) {
+    pthread_mutex_lock(&watch_mutex);
+        watch_running = false;
+        while (watches_head) {
+            complete_watch(watches_head);
+        }
+        pthread_cond_signal(&watch_cond);
+    pthread_mutex_unlock(&watch_mutex);
+
+    pthread_join(watch_tid, nullptr);
+}
@@ -0,0 +1,47 @@
+#ifndef PG_STATUS_WATCH_H
+#define PG_STATUS_WATCH_H
+
+#include "http_server.h"
+#include "pg_monitor.h"
+
+/**
+ * How long a watch waits for a topology change by default, ms
+ */
+# define DEFAULT_WATCH_TIMEOUT_MS 30000
+
+/**
+ * Reads pg_status__watch_timeout_ms and starts the thread that completes
+ * the watches on timeout. Must be called before start_http_server.
+ */
+void start_watch(void);
+
+/**
+ * Completes all watches and stops the thread.
+ * Must be called before stop_http_server.
+ */
+void stop_watch(void);
+
+/**
+ * topology_listener that completes the watches of the cluster when
+ * the generation of the published topology snapshot changes.
+ * Must be added with add_topology_listener before start_pg_monitor,
+ * after the listener that renders the responses the watches return.
+ */
+void wake_topology_watchers(
+    const MonitorCluster *cluster, const Topology *topology
+);
+
+/**
+ * Suspends the request until the cluster publishes a topology snapshot
+ * whose generation differs from since, or until the watch timeout.
+ * Returns true if the request has been suspended: the handler must return
+ * without a response and will be called again when the watch completes.
+ * Returns false if the handler must respond now.
+ */
+bool wait_topology_change(
+    HTTPResponse *response,
+    const MonitorCluster *cluster,
+    unsigned long long since
+);
+
+#endif //PG_STATUS_WATCH_H